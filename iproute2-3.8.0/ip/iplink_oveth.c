@@ -21,7 +21,7 @@
 static void explain (void)
 {
 	fprintf (stderr,
-		 "Usage: ... oveth vni VNI\n"
+		 "Usage: ... oveth vni VNI [ ageing SECONDS ]\n"
 		 "routing settings are configured by "
 		 "\"ip ov\" and \"ipv oveth\".\n"
 		);
@@ -31,8 +31,8 @@ static int
 oveth_parse_opt (struct link_util * lu, int argc, char ** argv,
 		 struct nlmsghdr * n)
 {
-	__u32 vni;
-	int vni_flag = 0;
+	__u32 vni, ageing;
+	int vni_flag = 0, ageing_flag = 0;
 
 
 	while (argc > 0) {
@@ -45,6 +45,11 @@ oveth_parse_opt (struct link_util * lu, int argc, char ** argv,
 			    vni >= 1u << 24)
 				invarg ("invalid vni", *argv);
 			vni_flag++;
+		} else if (!matches (*argv, "ageing")) {
+			NEXT_ARG ();
+			if (get_u32 (&ageing, *argv, 0))
+				invarg ("invalid ageing", *argv);
+			ageing_flag++;
 		} else {
 			fprintf (stderr, "oveth: unknown command \"%s\"\n",
 				 *argv);
@@ -60,6 +65,8 @@ oveth_parse_opt (struct link_util * lu, int argc, char ** argv,
 	}
 
 	addattr32 (n, 1024, IFLA_OVETH_VNI, vni);
+	if (ageing_flag)
+		addattr32 (n, 1024, IFLA_OVETH_AGEING, ageing);
 
 	return 0;
 }
@@ -68,6 +75,20 @@ oveth_parse_opt (struct link_util * lu, int argc, char ** argv,
 static void
 oveth_print_opt (struct link_util * lu, FILE * f, struct rtattr *tb[])
 {
+	if (!tb)
+		return;
+
+	if (tb[IFLA_OVETH_VNI])
+		fprintf (f, "vni %u ", rta_getattr_u32 (tb[IFLA_OVETH_VNI]));
+
+	if (tb[IFLA_OVETH_AGEING]) {
+		__u32 ageing = rta_getattr_u32 (tb[IFLA_OVETH_AGEING]);
+		if (ageing == 0)
+			fprintf (f, "ageing none ");
+		else
+			fprintf (f, "ageing %u ", ageing);
+	}
+
 	return;
 }
 
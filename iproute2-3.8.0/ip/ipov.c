@@ -23,6 +23,13 @@
 
 #define NODE_ID_OFFSET 18
 #define ADDRESS_OFFSET 42
+
+/* bulk import. a message carries entries up to BULK_BUFSIZ, and up to
+ * BULK_WINDOW messages are sent before their replies are read. */
+#define BULK_BUFSIZ	32768
+#define BULK_ENTRY_MAX	128
+#define BULK_WINDOW	8
+#define BULK_APPS	256	/* app id is 8bit */
 	
 
 /* netlink socket */
@@ -38,6 +45,10 @@ struct ovstack_param {
 	struct in_addr addr4;
 	struct in6_addr addr6;
 	u_int8_t weight;
+	__u8 encap;
+	__u8 route_mode;
+	__u32 interval;
+	__u8 probe_multi;
 	
 	int app_id_flag;
 	int node_id_flag;
@@ -45,58 +56,108 @@ struct ovstack_param {
 	int nxt_node_id_flag;
 	int addr_flag;
 	int weight_flag;
+	int encap_flag;
+	int route_mode_flag;
+	int staging_flag;
+	int interval_flag;
+	int probe_multi_flag;
 
 };
 
 static void usage (void) __attribute ((noreturn));
 
 
+/* next argument of an option, or return -1 from parse_args_check () */
+#define PARSE_NEXT_ARG()						\
+	do {								\
+		argv++;							\
+		if (--argc <= 0) {					\
+			fprintf (stderr, "\"%s\" needs an argument\n",	\
+				 argv[-1]);				\
+			return -1;					\
+		}							\
+	} while (0)
+
+/*
+ * returns -1 after printing a message on an invalid argument instead of
+ * exiting, so that import can report the line and go on.
+ */
 static int
-parse_args (int argc, char ** argv, struct ovstack_param * p)
+parse_args_check (int argc, char ** argv, struct ovstack_param * p)
 {
-	if (argc < 1)
-		usage ();
+	inet_prefix addr;
 
 	memset (p, 0, sizeof (struct ovstack_param));
 
 	while (argc > 0) {
 		if (strcmp (*argv, "app") == 0) {
-			NEXT_ARG ();
-			if (get_u8 (&p->app_id, *argv, 0)) {
-				invarg ("invalid application\n", * argv);
-				exit (-1);
-			}
+			PARSE_NEXT_ARG ();
+			if (get_u8 (&p->app_id, *argv, 0))
+				goto invalid;
 			p->app_id_flag = 1;
 		} else if (strcmp (*argv, "id") == 0) {
-			NEXT_ARG ();
-			p->node_id = get_addr32 (*argv);
+			PARSE_NEXT_ARG ();
+			if (get_addr_1 (&addr, *argv, AF_INET))
+				goto invalid;
+			p->node_id = addr.data[0];
 			p->node_id_flag = 1;
 		} else if (strcmp (*argv, "addr") == 0) {
-			NEXT_ARG ();
+			PARSE_NEXT_ARG ();
 			if (inet_pton (AF_INET, *argv, &(p->addr4)) > 0)
 				p->ai_family = AF_INET;
 			else if (inet_pton (AF_INET6, *argv, &(p->addr6)) > 0)
 				p->ai_family = AF_INET6;
-			else {
-				invarg ("invalid address\n", *argv);
-				exit (-1);
-			}
+			else
+				goto invalid;
 			p->addr_flag = 1;
 		} else if (strcmp (*argv, "weight") == 0) {
-			NEXT_ARG ();
-			if (get_u8 (&(p->weight), *argv, 0)) {
-				invarg ("invalid weight\n", *argv);
-				exit (-1);
-			}
+			PARSE_NEXT_ARG ();
+			if (get_u8 (&(p->weight), *argv, 0))
+				goto invalid;
 			p->weight_flag = 1;
 		} else if (strcmp (*argv, "to") == 0) {
-			NEXT_ARG ();
-			p->dst_node_id = get_addr32 (*argv);
+			PARSE_NEXT_ARG ();
+			if (get_addr_1 (&addr, *argv, AF_INET))
+				goto invalid;
+			p->dst_node_id = addr.data[0];
 			p->dst_node_id_flag = 1;
 		} else if (strcmp (*argv, "via") == 0) {
-			NEXT_ARG ();
-			p->nxt_node_id = get_addr32 (*argv);
+			PARSE_NEXT_ARG ();
+			if (get_addr_1 (&addr, *argv, AF_INET))
+				goto invalid;
+			p->nxt_node_id = addr.data[0];
 			p->nxt_node_id_flag = 1;
+		} else if (strcmp (*argv, "encap") == 0) {
+			PARSE_NEXT_ARG ();
+			if (strcmp (*argv, "raw") == 0)
+				p->encap = OVSTACK_ENCAP_RAW;
+			else if (strcmp (*argv, "udp") == 0)
+				p->encap = OVSTACK_ENCAP_UDP;
+			else
+				goto invalid;
+			p->encap_flag = 1;
+		} else if (strcmp (*argv, "mode") == 0) {
+			PARSE_NEXT_ARG ();
+			if (strcmp (*argv, "replicate") == 0)
+				p->route_mode = OVSTACK_ROUTE_MODE_REPLICATE;
+			else if (strcmp (*argv, "ecmp") == 0)
+				p->route_mode = OVSTACK_ROUTE_MODE_ECMP;
+			else
+				goto invalid;
+			p->route_mode_flag = 1;
+		} else if (strcmp (*argv, "staging") == 0) {
+			p->staging_flag = 1;
+		} else if (strcmp (*argv, "interval") == 0) {
+			PARSE_NEXT_ARG ();
+			if (get_u32 (&p->interval, *argv, 0))
+				goto invalid;
+			p->interval_flag = 1;
+		} else if (strcmp (*argv, "multiplier") == 0) {
+			PARSE_NEXT_ARG ();
+			if (get_u8 (&p->probe_multi, *argv, 0) ||
+			    p->probe_multi == 0)
+				goto invalid;
+			p->probe_multi_flag = 1;
 		} 
 
 		argc--;
@@ -104,6 +165,22 @@ parse_args (int argc, char ** argv, struct ovstack_param * p)
 	}
 	
 	return 0;
+
+invalid:
+	fprintf (stderr, "invalid %s \"%s\"\n", argv[-1], *argv);
+	return -1;
+}
+
+static int
+parse_args (int argc, char ** argv, struct ovstack_param * p)
+{
+	if (argc < 1)
+		usage ();
+
+	if (parse_args_check (argc, argv, p) < 0)
+		exit (-1);
+
+	return 0;
 }
 
 
@@ -117,23 +194,48 @@ usage (void)
 		 "		[ id NODEID ]\n"
 		 "		[ addr ADDRESS ]\n"
 		 "		[ weight WEIGHT ]\n"
+		 "		[ encap { raw | udp } ]\n"
 		 "\n"
-		 "	ip ov set { id | locator | node }\n"
+		 "	ip ov set { id | locator | node | encap }\n"
 		 "		[ app APPID ]\n"
 		 "		[ id NODEID ]\n"
 		 "		[ addr ADDRESS ]\n"
 		 "		[ weight WEIGHT ]\n"
+		 "		[ encap { raw | udp } ]\n"
+		 "\n"
+		 "	ip ov set probe\n"
+		 "		[ app APPID ]\n"
+		 "		[ interval MSEC ]\n"
+		 "		[ multiplier NUM ]\n"
+		 "\n"
+		 "	ip ov set adaptive\n"
+		 "		[ app APPID ]\n"
+		 "		[ interval MSEC ]\n"
 		 "\n"
 		 "	ip ov route { show | add | del }\n"
 		 "		[ app APPID ]\n"
 		 "		[ to NODEID ]\n"
 		 "		[ via NODEID ]\n"
+		 "		[ mode { replicate | ecmp } ]\n"
+		 "		[ weight WEIGHT ]\n"
+		 "		[ staging ]\n"
+		 "\n"
+		 "	ip ov route { commit | abort | flush }\n"
+		 "		[ app APPID ]\n"
 		 "\n"
 		 "	ip ov show { app | id | locator | node }\n"
 		 "		[ app APPID ]\n"
 		 "		[ id NODEID ]\n"
 		 "		[ addr ADDRESS ]\n"
 		 "\n"
+		 "	ip ov stats\n"
+		 "		[ app APPID ]\n"
+		 "\n"
+		 "	ip ov stats drops\n"
+		 "\n"
+		 "	ip ov import FILE\n"
+		 "	ip ov route import FILE [ replace ]\n"
+		 "\n"
 		);
 
 	exit (-1);
@@ -228,6 +330,9 @@ do_add_node (int argc, char **argv)
 	if (p.weight_flag)
 		addattr8 (&req.n, 1024, OVSTACK_ATTR_LOCATOR_WEIGHT, p.weight);
 
+	if (p.encap_flag)
+		addattr8 (&req.n, 1024, OVSTACK_ATTR_ENCAP, p.encap);
+
 	if (rtnl_talk (&genl_rth, &req.n, 0, 0, NULL) < 0)
 		return -2;
 
@@ -493,6 +598,94 @@ do_set_node (int argc, char ** argv)
 	return 0;
 }
 
+static int
+do_set_encap (int argc, char ** argv)
+{
+	struct ovstack_param p;
+
+	parse_args (argc, argv, &p);
+
+	if (!p.app_id_flag) {
+		fprintf (stderr, "application is not specified\n");
+		return -1;
+	}
+	if (!p.encap_flag) {
+		fprintf (stderr, "encap is not specified\n");
+		return -1;
+	}
+
+	GENL_REQUEST (req, 1024, genl_family, 0, OVSTACK_GENL_VERSION,
+		      OVSTACK_CMD_ENCAP_SET, NLM_F_REQUEST | NLM_F_ACK);
+
+	addattr8 (&req.n, 1024, OVSTACK_ATTR_APP_ID, p.app_id);
+	addattr8 (&req.n, 1024, OVSTACK_ATTR_ENCAP, p.encap);
+
+	if (rtnl_talk (&genl_rth, &req.n, 0, 0, NULL) < 0)
+		return -2;
+
+	return 0;
+}
+
+static int
+do_set_probe (int argc, char ** argv)
+{
+	struct ovstack_param p;
+
+	parse_args (argc, argv, &p);
+
+	if (!p.app_id_flag) {
+		fprintf (stderr, "application is not specified\n");
+		return -1;
+	}
+	if (!p.interval_flag) {
+		fprintf (stderr, "interval is not specified\n");
+		return -1;
+	}
+
+	GENL_REQUEST (req, 1024, genl_family, 0, OVSTACK_GENL_VERSION,
+		      OVSTACK_CMD_PROBE_SET, NLM_F_REQUEST | NLM_F_ACK);
+
+	addattr8 (&req.n, 1024, OVSTACK_ATTR_APP_ID, p.app_id);
+	addattr32 (&req.n, 1024, OVSTACK_ATTR_PROBE_INTERVAL,
+		   p.interval);
+	if (p.probe_multi_flag)
+		addattr8 (&req.n, 1024, OVSTACK_ATTR_PROBE_MULTI,
+			  p.probe_multi);
+
+	if (rtnl_talk (&genl_rth, &req.n, 0, 0, NULL) < 0)
+		return -2;
+
+	return 0;
+}
+
+static int
+do_set_adaptive (int argc, char ** argv)
+{
+	struct ovstack_param p;
+
+	parse_args (argc, argv, &p);
+
+	if (!p.app_id_flag) {
+		fprintf (stderr, "application is not specified\n");
+		return -1;
+	}
+	if (!p.interval_flag) {
+		fprintf (stderr, "interval is not specified\n");
+		return -1;
+	}
+
+	GENL_REQUEST (req, 1024, genl_family, 0, OVSTACK_GENL_VERSION,
+		      OVSTACK_CMD_ADAPTIVE_SET, NLM_F_REQUEST | NLM_F_ACK);
+
+	addattr8 (&req.n, 1024, OVSTACK_ATTR_APP_ID, p.app_id);
+	addattr32 (&req.n, 1024, OVSTACK_ATTR_ADAPTIVE_INTERVAL, p.interval);
+
+	if (rtnl_talk (&genl_rth, &req.n, 0, 0, NULL) < 0)
+		return -2;
+
+	return 0;
+}
+
 static int
 do_set (int argc, char ** argv)
 {
@@ -507,6 +700,12 @@ do_set (int argc, char ** argv)
 		return do_set_locator (argc - 1, argv + 1);
 	if (strcmp (*argv, "node") == 0) 
 		return do_set_node (argc - 1, argv + 1);
+	if (strcmp (*argv, "encap") == 0) 
+		return do_set_encap (argc - 1, argv + 1);
+	if (strcmp (*argv, "probe") == 0) 
+		return do_set_probe (argc - 1, argv + 1);
+	if (strcmp (*argv, "adaptive") == 0)
+		return do_set_adaptive (argc - 1, argv + 1);
 	else {
 		fprintf (stderr, "invalid command \"%s\"", *argv);
 		exit (1);
@@ -526,6 +725,32 @@ print_offset (char * param, int offset)
 	return;
 }
 
+static char *
+encap_name (__u8 encap)
+{
+	switch (encap) {
+	case OVSTACK_ENCAP_RAW :
+		return "raw";
+	case OVSTACK_ENCAP_UDP :
+		return "udp";
+	}
+
+	return "default";
+}
+
+static char *
+route_mode_name (__u8 mode)
+{
+	switch (mode) {
+	case OVSTACK_ROUTE_MODE_REPLICATE :
+		return "replicate";
+	case OVSTACK_ROUTE_MODE_ECMP :
+		return "ecmp";
+	}
+
+	return "unknown";
+}
+
 static int
 locator_nlmsg (const struct sockaddr_nl * who, struct nlmsghdr * n, void * arg)
 {
@@ -534,6 +759,7 @@ locator_nlmsg (const struct sockaddr_nl * who, struct nlmsghdr * n, void * arg)
 	__u32 node_id;
 	__u32 addr[4];
 	char addrbuf4[16], addrbuf6[64];
+	struct ovstack_locator_stats st;
 	struct genlmsghdr * ghdr;
 	struct rtattr *attrs[OVSTACK_ATTR_MAX + 1];
 
@@ -592,7 +818,35 @@ locator_nlmsg (const struct sockaddr_nl * who, struct nlmsghdr * n, void * arg)
 	print_offset (addrbuf4, NODE_ID_OFFSET);
 	printf ("%s", addrbuf6);
 	print_offset (addrbuf6, ADDRESS_OFFSET);
-	printf ("%d\n", weight);
+	printf ("%d", weight);
+	if (attrs[OVSTACK_ATTR_ENCAP])
+		printf ("  encap %s", 
+			encap_name (rta_getattr_u8 (attrs[OVSTACK_ATTR_ENCAP])));
+	if (attrs[OVSTACK_ATTR_LOCATOR_FLAGS] &&
+	    (rta_getattr_u8 (attrs[OVSTACK_ATTR_LOCATOR_FLAGS]) &
+	     OVSTACK_LOCATOR_F_DOWN))
+		printf ("  down");
+	if (attrs[OVSTACK_ATTR_LOCATOR_PMTU])
+		printf ("  pmtu %u",
+			rta_getattr_u32 (attrs[OVSTACK_ATTR_LOCATOR_PMTU]));
+	if (attrs[OVSTACK_ATTR_LOCATOR_EFF_WEIGHT] &&
+	    rta_getattr_u8 (attrs[OVSTACK_ATTR_LOCATOR_EFF_WEIGHT]) != weight)
+		printf ("  effective %d", rta_getattr_u8
+			(attrs[OVSTACK_ATTR_LOCATOR_EFF_WEIGHT]));
+	printf ("\n");
+
+	if (show_stats && attrs[OVSTACK_ATTR_LOCATOR_STATS] &&
+	    RTA_PAYLOAD (attrs[OVSTACK_ATTR_LOCATOR_STATS]) >= sizeof (st)) {
+		memcpy (&st, RTA_DATA (attrs[OVSTACK_ATTR_LOCATOR_STATS]),
+			sizeof (st));
+		printf ("    RX: %llu packets %llu bytes\n",
+			(unsigned long long) st.rx_packets,
+			(unsigned long long) st.rx_bytes);
+		printf ("    TX: %llu packets %llu bytes %llu errors\n",
+			(unsigned long long) st.tx_packets,
+			(unsigned long long) st.tx_bytes,
+			(unsigned long long) st.tx_errors);
+	}
 
 	return 0;
 }
@@ -635,7 +889,25 @@ id_nlmsg (const struct sockaddr_nl * who, struct nlmsghdr * n, void * arg)
 	node_id = rta_getattr_u32 (attrs[OVSTACK_ATTR_NODE_ID]);
 	inet_ntop (AF_INET, &node_id, addrbuf4, sizeof (addrbuf4));
 
-	printf ("%3d  %s\n", app_id, addrbuf4);
+	printf ("%3d  %s", app_id, addrbuf4);
+	if (attrs[OVSTACK_ATTR_ENCAP]) {
+		print_offset (addrbuf4, NODE_ID_OFFSET);
+		printf ("%s",
+			encap_name (rta_getattr_u8 (attrs[OVSTACK_ATTR_ENCAP])));
+	}
+	if (attrs[OVSTACK_ATTR_PROBE_INTERVAL] &&
+	    rta_getattr_u32 (attrs[OVSTACK_ATTR_PROBE_INTERVAL])) {
+		printf ("  probe %ums",
+			rta_getattr_u32 (attrs[OVSTACK_ATTR_PROBE_INTERVAL]));
+		if (attrs[OVSTACK_ATTR_PROBE_MULTI])
+			printf (" x%d", rta_getattr_u8
+				(attrs[OVSTACK_ATTR_PROBE_MULTI]));
+	}
+	if (attrs[OVSTACK_ATTR_ADAPTIVE_INTERVAL] &&
+	    rta_getattr_u32 (attrs[OVSTACK_ATTR_ADAPTIVE_INTERVAL]))
+		printf ("  adaptive %ums",
+			rta_getattr_u32 (attrs[OVSTACK_ATTR_ADAPTIVE_INTERVAL]));
+	printf ("\n");
 
 	return 0;
 }
@@ -690,11 +962,180 @@ route_nlmsg (const struct sockaddr_nl * who, struct nlmsghdr * n, void * arg)
 	inet_ntop (AF_INET, &nxt_node_id, addrbuf4, sizeof (addrbuf4));
 	printf ("%s", addrbuf4);
 	print_offset (addrbuf4, NODE_ID_OFFSET);
+	if (attrs[OVSTACK_ATTR_ROUTE_MODE])
+		printf ("%-11s",
+			route_mode_name (rta_getattr_u8
+					 (attrs[OVSTACK_ATTR_ROUTE_MODE])));
+	if (attrs[OVSTACK_ATTR_NXT_WEIGHT])
+		printf ("%d", rta_getattr_u8 (attrs[OVSTACK_ATTR_NXT_WEIGHT]));
 	printf ("\n");
 	
 	return 0;
 }
 
+static int
+stats_nlmsg (const struct sockaddr_nl * who, struct nlmsghdr * n, void * arg)
+{
+	int len;
+	__u8 app_id;
+	struct ovstack_param * p = arg;
+	struct ovstack_app_stats st;
+	struct genlmsghdr * ghdr;
+	struct rtattr * attrs[OVSTACK_ATTR_MAX + 1];
+
+	if (n->nlmsg_type == NLMSG_ERROR) {
+		fprintf (stderr, "%s: nlmsg_error\n", __func__);
+		return -EBADMSG;
+	}
+
+	ghdr = NLMSG_DATA (n);
+	len = n->nlmsg_len - NLMSG_LENGTH (sizeof (*ghdr));
+	if (len < 0) {
+		fprintf (stderr, "%s: nlmsg length error\n", __func__);
+		return -1;
+	}
+
+	parse_rtattr (attrs, OVSTACK_ATTR_MAX,
+		      (void *) ghdr + GENL_HDRLEN, len);
+
+	if (!attrs[OVSTACK_ATTR_APP_ID]) {
+		fprintf (stderr, "%s: empty app id\n", __func__);
+		return -1;
+	}
+	if (!attrs[OVSTACK_ATTR_STATS] ||
+	    RTA_PAYLOAD (attrs[OVSTACK_ATTR_STATS]) < sizeof (st)) {
+		fprintf (stderr, "%s: empty stats\n", __func__);
+		return -1;
+	}
+
+	app_id = rta_getattr_u8 (attrs[OVSTACK_ATTR_APP_ID]);
+	if (p->app_id_flag && p->app_id != app_id)
+		return 0;
+
+	memcpy (&st, RTA_DATA (attrs[OVSTACK_ATTR_STATS]), sizeof (st));
+
+	printf ("app %d\n", app_id);
+	printf ("    RX: %llu packets %llu bytes %llu dropped\n",
+		(unsigned long long) st.rx_packets,
+		(unsigned long long) st.rx_bytes,
+		(unsigned long long) st.rx_dropped);
+	printf ("    TX: %llu packets %llu bytes %llu dropped\n",
+		(unsigned long long) st.tx_packets,
+		(unsigned long long) st.tx_bytes,
+		(unsigned long long) st.tx_dropped);
+	printf ("    forwarded: %llu packets %llu bytes\n",
+		(unsigned long long) st.fwd_packets,
+		(unsigned long long) st.fwd_bytes);
+	printf ("    local: %llu packets %llu bytes\n",
+		(unsigned long long) st.local_packets,
+		(unsigned long long) st.local_bytes);
+	printf ("    mcast replicas: %llu\n",
+		(unsigned long long) st.mcast_replicas);
+
+	return 0;
+}
+
+#define DROP_NAME(reason, name) [OVSTACK_DROP_##reason] = name,
+
+static const char * drop_names[OVSTACK_DROP_MAX] = {
+	OVSTACK_DROP_REASONS (DROP_NAME)
+};
+
+static int
+drops_nlmsg (const struct sockaddr_nl * who, struct nlmsghdr * n, void * arg)
+{
+	int len, r, count;
+	__u64 drops[OVSTACK_DROP_MAX];
+	struct genlmsghdr * ghdr;
+	struct rtattr * attrs[OVSTACK_ATTR_MAX + 1];
+
+	if (n->nlmsg_type == NLMSG_ERROR) {
+		fprintf (stderr, "%s: nlmsg_error\n", __func__);
+		return -EBADMSG;
+	}
+
+	ghdr = NLMSG_DATA (n);
+	len = n->nlmsg_len - NLMSG_LENGTH (sizeof (*ghdr));
+	if (len < 0) {
+		fprintf (stderr, "%s: nlmsg length error\n", __func__);
+		return -1;
+	}
+
+	parse_rtattr (attrs, OVSTACK_ATTR_MAX,
+		      (void *) ghdr + GENL_HDRLEN, len);
+
+	if (!attrs[OVSTACK_ATTR_DROP_STATS]) {
+		fprintf (stderr, "%s: empty drop stats\n", __func__);
+		return -1;
+	}
+
+	/* kernel may know more or less reasons than this ip command */
+	count = RTA_PAYLOAD (attrs[OVSTACK_ATTR_DROP_STATS]) / sizeof (__u64);
+	if (count > OVSTACK_DROP_MAX)
+		count = OVSTACK_DROP_MAX;
+	memcpy (drops, RTA_DATA (attrs[OVSTACK_ATTR_DROP_STATS]),
+		count * sizeof (__u64));
+
+	for (r = 0; r < count; r++) {
+		printf ("%s", drop_names[r]);
+		print_offset ((char *) drop_names[r], NODE_ID_OFFSET);
+		printf ("%llu\n", (unsigned long long) drops[r]);
+	}
+
+	return 0;
+}
+
+static int
+do_stats_drops (int argc, char ** argv)
+{
+	GENL_REQUEST (req, 1024, genl_family, 0, OVSTACK_GENL_VERSION,
+		      OVSTACK_CMD_DROPS_GET, NLM_F_REQUEST | NLM_F_DUMP);
+
+	req.n.nlmsg_seq = genl_rth.dump = ++genl_rth.seq;
+
+	if (rtnl_send (&genl_rth, &req, req.n.nlmsg_len) < 0)
+		return -2;
+
+	printf ("Reason");
+	print_offset ("Reason", NODE_ID_OFFSET);
+	printf ("Packets\n");
+
+	if (rtnl_dump_filter (&genl_rth, drops_nlmsg, NULL) < 0) {
+		fprintf (stderr, "Dump terminated\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+do_stats (int argc, char ** argv)
+{
+	struct ovstack_param p;
+
+	if (argc > 0 && strcmp (*argv, "drops") == 0)
+		return do_stats_drops (argc - 1, argv + 1);
+
+	memset (&p, 0, sizeof (p));
+	if (argc > 0)
+		parse_args (argc, argv, &p);
+
+	GENL_REQUEST (req, 1024, genl_family, 0, OVSTACK_GENL_VERSION,
+		      OVSTACK_CMD_STATS_GET, NLM_F_REQUEST | NLM_F_DUMP);
+
+	req.n.nlmsg_seq = genl_rth.dump = ++genl_rth.seq;
+
+	if (rtnl_send (&genl_rth, &req, req.n.nlmsg_len) < 0)
+		return -2;
+
+	if (rtnl_dump_filter (&genl_rth, stats_nlmsg, &p) < 0) {
+		fprintf (stderr, "Dump terminated\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int
 do_show_app (int argc, char ** argv)
 {
@@ -708,7 +1149,9 @@ do_show_app (int argc, char ** argv)
 		return -2;
 	}
 	
-	printf ("App  Node id\n");
+	printf ("App  Node id");
+	print_offset ("Node id", NODE_ID_OFFSET);
+	printf ("Encap\n");
 
 	if (rtnl_dump_filter (&genl_rth, id_nlmsg, NULL) < 0) {
 		fprintf (stderr, "Dump terminated\n");
@@ -731,7 +1174,9 @@ do_show_id (int argc, char ** argv)
 		return -2;
 	}
 	
-	printf ("App  Node id\n");
+	printf ("App  Node id");
+	print_offset ("Node id", NODE_ID_OFFSET);
+	printf ("Encap\n");
 
 	if (rtnl_dump_filter (&genl_rth, id_nlmsg, NULL) < 0) {
 		fprintf (stderr, "Dump terminated\n");
@@ -834,7 +1279,8 @@ do_route_show (int argc, char ** argv)
 	print_offset ("Destination", NODE_ID_OFFSET);
 	printf ("Next hop");
 	print_offset ("Next hop", NODE_ID_OFFSET);
-	printf ("\n");
+	printf ("%-11s", "Mode");
+	printf ("Weight\n");
 	if (rtnl_dump_filter (&genl_rth, route_nlmsg, NULL) < 0) {
 		fprintf (stderr, "Dump terminated\n");
 		return -1;
@@ -869,6 +1315,13 @@ do_route_add (int argc, char ** argv)
 	addattr8 (&req.n, 1024, OVSTACK_ATTR_APP_ID, p.app_id);
 	addattr32 (&req.n, 1024, OVSTACK_ATTR_DST_NODE_ID, p.dst_node_id);
 	addattr32 (&req.n, 1024, OVSTACK_ATTR_NXT_NODE_ID, p.nxt_node_id);
+
+	if (p.route_mode_flag)
+		addattr8 (&req.n, 1024, OVSTACK_ATTR_ROUTE_MODE, p.route_mode);
+	if (p.weight_flag)
+		addattr8 (&req.n, 1024, OVSTACK_ATTR_NXT_WEIGHT, p.weight);
+	if (p.staging_flag)
+		addattr_l (&req.n, 1024, OVSTACK_ATTR_ROUTE_STAGING, NULL, 0);
 	
 	if (rtnl_talk (&genl_rth, &req.n, 0, 0, NULL) < 0)
 		return -2;
@@ -902,6 +1355,9 @@ do_route_del (int argc, char ** argv)
 	addattr8 (&req.n, 1024, OVSTACK_ATTR_APP_ID, p.app_id);
 	addattr32 (&req.n, 1024, OVSTACK_ATTR_DST_NODE_ID, p.dst_node_id);
 	addattr32 (&req.n, 1024, OVSTACK_ATTR_NXT_NODE_ID, p.nxt_node_id);
+
+	if (p.staging_flag)
+		addattr_l (&req.n, 1024, OVSTACK_ATTR_ROUTE_STAGING, NULL, 0);
 	
 	if (rtnl_talk (&genl_rth, &req.n, 0, 0, NULL) < 0)
 		return -2;
@@ -909,6 +1365,464 @@ do_route_del (int argc, char ** argv)
 	return 0;
 }
 
+/* commit or abort the staging table of an app */
+static int
+route_staging_talk (int cmd, __u8 app_id)
+{
+	GENL_REQUEST (req, 1024, genl_family, 0, OVSTACK_GENL_VERSION,
+		      cmd, NLM_F_REQUEST | NLM_F_ACK);
+
+	addattr8 (&req.n, 1024, OVSTACK_ATTR_APP_ID, app_id);
+
+	if (rtnl_talk (&genl_rth, &req.n, 0, 0, NULL) < 0)
+		return -2;
+
+	return 0;
+}
+
+static int
+do_route_staging (int cmd, int argc, char ** argv)
+{
+	struct ovstack_param p;
+
+	parse_args (argc, argv, &p);
+
+	if (!p.app_id_flag) {
+		fprintf (stderr, "application is not specified\n");
+		exit (-1);
+	}
+
+	return route_staging_talk (cmd, p.app_id);
+}
+
+/* flush is a commit of an empty staging table */
+static int
+do_route_flush (int argc, char ** argv)
+{
+	struct ovstack_param p;
+
+	parse_args (argc, argv, &p);
+
+	if (!p.app_id_flag) {
+		fprintf (stderr, "application is not specified\n");
+		exit (-1);
+	}
+
+	if (route_staging_talk (OVSTACK_CMD_ROUTE_ABORT, p.app_id) < 0)
+		return -2;
+
+	return route_staging_talk (OVSTACK_CMD_ROUTE_COMMIT, p.app_id);
+}
+
+/*
+ * bulk programming. entries are packed into OVSTACK_CMD_BULK messages as
+ * nested attributes, and failed entries are reported by line number.
+ */
+static struct {
+	struct nlmsghdr	n;
+	char		buf[BULK_BUFSIZ];
+} bulk_req;
+
+static int bulk_entries;		/* entries in bulk_req */
+static int bulk_total;			/* entries added */
+static int bulk_outstanding;		/* messages without ack */
+static int bulk_failed;			/* failed entries */
+static int bulk_base[BULK_WINDOW];	/* first entry of a message, by seq */
+static int * bulk_lines;		/* line number of each entry */
+static int bulk_lines_size;
+
+static void
+bulk_reset (void)
+{
+	struct genlmsghdr * ghdr;
+
+	memset (&bulk_req, 0, sizeof (bulk_req.n) + GENL_HDRLEN);
+	bulk_req.n.nlmsg_len = NLMSG_LENGTH (GENL_HDRLEN);
+	bulk_req.n.nlmsg_type = genl_family;
+	bulk_req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	ghdr = NLMSG_DATA (&bulk_req.n);
+	ghdr->cmd = OVSTACK_CMD_BULK;
+	ghdr->version = OVSTACK_GENL_VERSION;
+	bulk_entries = 0;
+}
+
+static void
+bulk_reply (struct nlmsghdr * n)
+{
+	int len, base, line, reported = 0;
+	__u32 failed;
+	struct genlmsghdr * ghdr;
+	struct rtattr * attrs[OVSTACK_ATTR_MAX + 1];
+	struct rtattr * rta;
+	struct ovstack_bulk_error err;
+
+	ghdr = NLMSG_DATA (n);
+	len = n->nlmsg_len - NLMSG_LENGTH (sizeof (*ghdr));
+	if (len < 0)
+		return;
+
+	parse_rtattr (attrs, OVSTACK_ATTR_MAX,
+		      (void *) ghdr + GENL_HDRLEN, len);
+
+	base = bulk_base[n->nlmsg_seq % BULK_WINDOW];
+
+	if (attrs[OVSTACK_ATTR_BULK_ERRORS]) {
+		rta = RTA_DATA (attrs[OVSTACK_ATTR_BULK_ERRORS]);
+		len = RTA_PAYLOAD (attrs[OVSTACK_ATTR_BULK_ERRORS]);
+		for (; RTA_OK (rta, len); rta = RTA_NEXT (rta, len)) {
+			if (rta->rta_type != OVSTACK_ATTR_BULK_ERROR ||
+			    RTA_PAYLOAD (rta) < sizeof (err))
+				continue;
+			memcpy (&err, RTA_DATA (rta), sizeof (err));
+			line = (base + err.index < bulk_total) ?
+				bulk_lines[base + err.index] : 0;
+			fprintf (stderr, "line %d: %s\n", line,
+				 strerror (-err.error));
+			reported++;
+		}
+	}
+
+	/* errors which did not fit in the reply */
+	failed = attrs[OVSTACK_ATTR_BULK_FAILED] ?
+		rta_getattr_u32 (attrs[OVSTACK_ATTR_BULK_FAILED]) : reported;
+	if (failed > reported)
+		fprintf (stderr, "%u more entries failed in a message "
+			 "from line %d\n", failed - reported,
+			 base < bulk_total ? bulk_lines[base] : 0);
+
+	bulk_failed += (failed > reported) ? failed : reported;
+}
+
+/* read replies until at most 'until' messages are outstanding */
+static int
+bulk_wait (int until)
+{
+	int status;
+	/* an error ack echoes the whole request */
+	static char buf[BULK_BUFSIZ + 4096];
+	struct nlmsghdr * h;
+	struct nlmsgerr * err;
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof (buf) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	while (bulk_outstanding > until) {
+		status = recvmsg (genl_rth.fd, &msg, 0);
+		if (status < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			perror ("netlink receive error");
+			return -1;
+		}
+		if (status == 0) {
+			fprintf (stderr, "EOF on netlink\n");
+			return -1;
+		}
+		if (msg.msg_flags & MSG_TRUNC) {
+			/* a lost ack would wait forever */
+			fprintf (stderr, "netlink message truncated\n");
+			return -1;
+		}
+
+		for (h = (struct nlmsghdr *) buf; NLMSG_OK (h, status);
+		     h = NLMSG_NEXT (h, status)) {
+			if (h->nlmsg_pid != genl_rth.local.nl_pid)
+				continue;
+
+			if (h->nlmsg_type == genl_family) {
+				bulk_reply (h);
+				continue;
+			}
+			if (h->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			err = NLMSG_DATA (h);
+			if (err->error) {
+				fprintf (stderr, "bulk message failed: %s\n",
+					 strerror (-err->error));
+				bulk_failed++;
+			}
+			bulk_outstanding--;
+		}
+	}
+
+	return 0;
+}
+
+static int
+bulk_flush (void)
+{
+	if (bulk_entries == 0)
+		return 0;
+
+	if (bulk_wait (BULK_WINDOW - 1) < 0)
+		return -1;
+
+	bulk_req.n.nlmsg_seq = ++genl_rth.seq;
+	bulk_base[bulk_req.n.nlmsg_seq % BULK_WINDOW] =
+		bulk_total - bulk_entries;
+
+	if (rtnl_send (&genl_rth, &bulk_req, bulk_req.n.nlmsg_len) < 0) {
+		perror ("Cannot talk to genetlink");
+		return -1;
+	}
+	bulk_outstanding++;
+	bulk_reset ();
+
+	return 0;
+}
+
+static int
+bulk_add (int cmd, struct ovstack_param * p, int line)
+{
+	int maxlen = sizeof (bulk_req);
+	struct rtattr * nest;
+
+	if (bulk_req.n.nlmsg_len + BULK_ENTRY_MAX > maxlen &&
+	    bulk_flush () < 0)
+		return -1;
+
+	if (bulk_total == bulk_lines_size) {
+		bulk_lines_size = bulk_lines_size ? bulk_lines_size * 2 : 4096;
+		bulk_lines = realloc (bulk_lines,
+				      sizeof (int) * bulk_lines_size);
+		if (!bulk_lines) {
+			fprintf (stderr, "out of memory\n");
+			return -1;
+		}
+	}
+	bulk_lines[bulk_total] = line;
+
+	nest = addattr_nest (&bulk_req.n, maxlen, OVSTACK_ATTR_BULK_ENTRY);
+	addattr8 (&bulk_req.n, maxlen, OVSTACK_ATTR_BULK_CMD, cmd);
+
+	if (p->app_id_flag)
+		addattr8 (&bulk_req.n, maxlen, OVSTACK_ATTR_APP_ID, p->app_id);
+	if (p->node_id_flag)
+		addattr32 (&bulk_req.n, maxlen, OVSTACK_ATTR_NODE_ID,
+			   p->node_id);
+	if (p->dst_node_id_flag)
+		addattr32 (&bulk_req.n, maxlen, OVSTACK_ATTR_DST_NODE_ID,
+			   p->dst_node_id);
+	if (p->nxt_node_id_flag)
+		addattr32 (&bulk_req.n, maxlen, OVSTACK_ATTR_NXT_NODE_ID,
+			   p->nxt_node_id);
+
+	if (p->addr_flag && p->ai_family == AF_INET)
+		addattr32 (&bulk_req.n, maxlen, OVSTACK_ATTR_LOCATOR_IP4ADDR,
+			   *((__u32 *)&p->addr4));
+	if (p->addr_flag && p->ai_family == AF_INET6)
+		addattr_l (&bulk_req.n, maxlen, OVSTACK_ATTR_LOCATOR_IP6ADDR,
+			   &(p->addr6), sizeof (struct in6_addr));
+
+	if (p->weight_flag)
+		addattr8 (&bulk_req.n, maxlen,
+			  (cmd == OVSTACK_CMD_ROUTE_ADD) ?
+			  OVSTACK_ATTR_NXT_WEIGHT : OVSTACK_ATTR_LOCATOR_WEIGHT,
+			  p->weight);
+	if (p->encap_flag)
+		addattr8 (&bulk_req.n, maxlen, OVSTACK_ATTR_ENCAP, p->encap);
+	if (p->route_mode_flag)
+		addattr8 (&bulk_req.n, maxlen, OVSTACK_ATTR_ROUTE_MODE,
+			  p->route_mode);
+	if (p->staging_flag)
+		addattr_l (&bulk_req.n, maxlen, OVSTACK_ATTR_ROUTE_STAGING,
+			   NULL, 0);
+
+	addattr_nest_end (&bulk_req.n, nest);
+
+	bulk_entries++;
+	bulk_total++;
+
+	return 0;
+}
+
+/* command of an import line in "ip ov" syntax, or -1 */
+static int
+bulk_line_cmd (int argc, char ** argv)
+{
+	if (argc < 2)
+		return -1;
+
+	if (matches (argv[0], "add") == 0) {
+		if (strcmp (argv[1], "locator") == 0)
+			return OVSTACK_CMD_LOCATOR_ADD;
+		if (strcmp (argv[1], "node") == 0)
+			return OVSTACK_CMD_NODE_ADD;
+	}
+	if (matches (argv[0], "del") == 0 || matches (argv[0], "delete") == 0) {
+		if (strcmp (argv[1], "locator") == 0)
+			return OVSTACK_CMD_LOCATOR_DELETE;
+		if (strcmp (argv[1], "node") == 0)
+			return OVSTACK_CMD_NODE_DELETE;
+	}
+	if (matches (argv[0], "route") == 0) {
+		if (strcmp (argv[1], "add") == 0)
+			return OVSTACK_CMD_ROUTE_ADD;
+		if (strcmp (argv[1], "del") == 0 ||
+		    strcmp (argv[1], "delete") == 0)
+			return OVSTACK_CMD_ROUTE_DELETE;
+	}
+
+	return -1;
+}
+
+/* commit (or abort on failure) staging tables of apps in the import */
+static int
+bulk_import_finish (unsigned char * apps, int cmd)
+{
+	int n;
+	struct ovstack_param p;
+
+	memset (&p, 0, sizeof (p));
+	p.app_id_flag = 1;
+
+	for (n = 0; n < BULK_APPS; n++) {
+		if (!apps[n])
+			continue;
+		p.app_id = n;
+		if (bulk_add (cmd, &p, cmdlineno) < 0)
+			return -1;
+	}
+
+	if (bulk_flush () < 0 || bulk_wait (0) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * with replace, routes are added to staging tables, which replace the
+ * routing tables of apps in the file when all lines are accepted.
+ */
+static int
+bulk_import (const char * name, int route_only, int replace)
+{
+	int argc, cmd, ret = 0;
+	char * line = NULL;
+	char * argv[100];
+	size_t len = 0;
+	FILE * fp = stdin;
+	struct ovstack_param p, ap;
+	unsigned char apps[BULK_APPS];
+
+	if (strcmp (name, "-") != 0) {
+		fp = fopen (name, "r");
+		if (!fp) {
+			fprintf (stderr, "Cannot open file \"%s\" for reading: "
+				 "%s\n", name, strerror (errno));
+			return -1;
+		}
+	}
+
+	bulk_reset ();
+	bulk_total = bulk_failed = bulk_outstanding = 0;
+	cmdlineno = 0;
+	memset (apps, 0, sizeof (apps));
+	memset (&ap, 0, sizeof (ap));
+	ap.app_id_flag = 1;
+
+	while (getcmdline (&line, &len, fp) != -1) {
+		argc = makeargs (line, argv, 100);
+		if (argc == 0)
+			continue;
+
+		if (route_only)
+			cmd = OVSTACK_CMD_ROUTE_ADD;
+		else {
+			cmd = bulk_line_cmd (argc, argv);
+			argc -= 2;
+			if (cmd < 0 || argc < 1) {
+				fprintf (stderr, "line %d: invalid command\n",
+					 cmdlineno);
+				bulk_failed++;
+				continue;
+			}
+		}
+
+		if (parse_args_check (argc, route_only ? argv : argv + 2,
+				      &p) < 0) {
+			fprintf (stderr, "line %d: invalid arguments\n",
+				 cmdlineno);
+			bulk_failed++;
+			continue;
+		}
+
+		if (replace && p.app_id_flag) {
+			p.staging_flag = 1;
+			if (!apps[p.app_id]) {
+				/* start from an empty staging table */
+				apps[p.app_id] = 1;
+				ap.app_id = p.app_id;
+				if (bulk_add (OVSTACK_CMD_ROUTE_ABORT,
+					      &ap, cmdlineno) < 0) {
+					ret = -2;
+					break;
+				}
+			}
+		}
+
+		if (bulk_add (cmd, &p, cmdlineno) < 0) {
+			ret = -2;
+			break;
+		}
+	}
+
+	if (ret == 0 && (bulk_flush () < 0 || bulk_wait (0) < 0))
+		ret = -2;
+
+	if (ret == 0 && replace &&
+	    bulk_import_finish (apps, bulk_failed ?
+				OVSTACK_CMD_ROUTE_ABORT :
+				OVSTACK_CMD_ROUTE_COMMIT) < 0)
+		ret = -2;
+
+	free (line);
+	free (bulk_lines);
+	bulk_lines = NULL;
+	bulk_lines_size = 0;
+	if (fp != stdin)
+		fclose (fp);
+
+	if (ret == 0 && bulk_failed)
+		ret = -1;
+
+	fprintf (stderr, "%d entries, %d failed\n", bulk_total, bulk_failed);
+
+	return ret;
+}
+
+static int
+do_import (int argc, char ** argv)
+{
+	if (argc < 1) {
+		fprintf (stderr, "file is not specified\n");
+		return -1;
+	}
+
+	return bulk_import (*argv, 0, 0);
+}
+
+static int
+do_route_import (int argc, char ** argv)
+{
+	int replace = 0;
+
+	if (argc < 1) {
+		fprintf (stderr, "file is not specified\n");
+		return -1;
+	}
+
+	if (argc > 1) {
+		if (strcmp (argv[1], "replace") != 0) {
+			fprintf (stderr, "unknown option \"%s\".\n", argv[1]);
+			return -1;
+		}
+		replace = 1;
+	}
+
+	return bulk_import (*argv, 1, replace);
+}
+
 static int
 do_route (int argc, char ** argv)
 {
@@ -925,6 +1839,16 @@ do_route (int argc, char ** argv)
 		return do_route_del (argc - 1, argv + 1);
 	if (strcmp (*argv, "show") == 0)
 		return do_route_show (argc - 1, argv + 1);
+	if (strcmp (*argv, "import") == 0)
+		return do_route_import (argc - 1, argv + 1);
+	if (strcmp (*argv, "commit") == 0)
+		return do_route_staging (OVSTACK_CMD_ROUTE_COMMIT,
+					 argc - 1, argv + 1);
+	if (strcmp (*argv, "abort") == 0)
+		return do_route_staging (OVSTACK_CMD_ROUTE_ABORT,
+					 argc - 1, argv + 1);
+	if (strcmp (*argv, "flush") == 0)
+		return do_route_flush (argc - 1, argv + 1);
 	else {
 		fprintf (stderr, "unknown command \"%s\".\n", *argv);
 		return -1;
@@ -968,6 +1892,12 @@ do_ipov (int argc, char **argv)
 	if (matches (*argv, "route") == 0)
 		return do_route (argc -1, argv + 1);
 
+	if (matches (*argv, "stats") == 0)
+		return do_stats (argc - 1, argv + 1);
+
+	if (matches (*argv, "import") == 0)
+		return do_import (argc - 1, argv + 1);
+
 	if (matches (*argv, "help") == 0)
 		usage ();
 
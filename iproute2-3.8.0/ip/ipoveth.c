@@ -248,6 +248,68 @@ do_show_fdb (int argc, char ** argv)
 	return 0;
 }
 
+static void
+print_hash_stats (const char * name, struct rtattr * rta)
+{
+	int n;
+	struct oveth_hash_stats hs;
+
+	if (!rta || RTA_PAYLOAD (rta) < sizeof (hs))
+		return;
+
+	memcpy (&hs, RTA_DATA (rta), sizeof (hs));
+
+	printf ("%s: buckets %u entries %u used %u max_chain %u\n",
+		name, hs.buckets, hs.entries, hs.used, hs.max_chain);
+	printf ("    chain length");
+	for (n = 0; n < OVETH_HASH_HIST; n++)
+		printf (" %d%s:%u", n, n == OVETH_HASH_HIST - 1 ? "+" : "",
+			hs.hist[n]);
+	printf ("\n");
+
+	return;
+}
+
+static int
+do_show_hash (int argc, char ** argv)
+{
+	int len;
+	struct oveth_param p;
+	struct genlmsghdr * ghdr;
+	struct rtattr * attrs[OVETH_ATTR_MAX + 1];
+
+	memset (&p, 0, sizeof (p));
+	if (argc > 0)
+		parse_args (argc, argv, &p);
+
+	GENL_REQUEST (req, 1024, genl_family, 0, OVETH_GENL_VERSION,
+		      OVETH_CMD_HASH_GET, NLM_F_REQUEST | NLM_F_ACK);
+
+	if (p.vni_flag)
+		addattr32 (&req.n, 1024, OVETH_ATTR_VNI, p.vni);
+
+	if (rtnl_talk (&genl_rth, &req.n, 0, 0, &req.n) < 0)
+		return -2;
+
+	ghdr = NLMSG_DATA (&req.n);
+	len = req.n.nlmsg_len - NLMSG_LENGTH (sizeof (*ghdr));
+	if (len < 0) {
+		fprintf (stderr, "%s: nlmsg length error\n", __func__);
+		exit (-1);
+	}
+
+	parse_rtattr (attrs, OVETH_ATTR_MAX,
+		      (void *) ghdr + GENL_HDRLEN, len);
+
+	print_hash_stats ("vni table", attrs[OVETH_ATTR_VNI_HASH]);
+	if (attrs[OVETH_ATTR_FDB_HASH]) {
+		printf ("vni %u ", rta_getattr_u32 (attrs[OVETH_ATTR_VNI]));
+		print_hash_stats ("fdb table", attrs[OVETH_ATTR_FDB_HASH]);
+	}
+
+	return 0;
+}
+
 static int
 do_show (int argc, char ** argv)
 {
@@ -258,6 +320,8 @@ do_show (int argc, char ** argv)
 
 	if (!matches (*argv, "fdb"))
 		return do_show_fdb (argc - 1, argv + 1);
+	else if (!matches (*argv, "hash"))
+		return do_show_hash (argc - 1, argv + 1);
 	else
 		fprintf (stderr, "unkwnon command \"%s\".\n", *argv);
 
@@ -273,7 +337,7 @@ usage (void)
 		 "		[ to MACADDR ]\n"
 		 "		[ via NODEID ]\n"
 		 "\n"
-		 "	 ip oveth show { fdb }\n"
+		 "	 ip oveth show { fdb | hash [ vni VNI ] }\n"
 		 "\n"
 		);
 
@@ -0,0 +1,238 @@
+/*
+ * Resizable RCU hash table for ovstack and oveth
+ *
+ * Each entry has two hlist nodes. A new table links entries through the
+ * other node, so readers walking the old table are not disturbed while
+ * the table is resized. Readers do not take any lock. Insert, remove and
+ * resize must be serialized by the caller (genl_mutex or rtnl), and
+ * ov_hash_adjust () must be called in process context. Callers holding
+ * a spinlock allocate a table with ov_htable_alloc () outside of the
+ * lock, and link it with ov_hash_replace () under the lock.
+ */
+
+#ifndef _LINUX_OV_HASH_H_
+#define _LINUX_OV_HASH_H_
+
+#include <linux/kernel.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/hash.h>
+
+struct ov_hnode {
+	struct hlist_node	node[2];
+	u32			key;
+};
+
+struct ov_htable {
+	unsigned int		bits;
+	int			ver;		/* index of ov_hnode->node */
+	struct hlist_head	buckets[0];
+};
+
+struct ov_hash {
+	struct ov_htable __rcu	* tbl;
+	unsigned int		count;		/* number of entries */
+	unsigned int		min_bits;
+	unsigned int		max_bits;
+};
+
+#define OV_HTABLE_SIZE(t)	(1U << (t)->bits)
+
+static inline struct ov_htable *
+ov_hash_table (struct ov_hash * h)
+{
+	return rcu_dereference_raw (h->tbl);
+}
+
+static inline struct hlist_head *
+ov_htable_bucket (struct ov_htable * t, u32 key)
+{
+	return &(t->buckets[hash_32 (key, t->bits)]);
+}
+
+/* iterate entries which may have the key. t is from ov_hash_table () */
+#define ov_htable_for_each_possible_rcu(t, pos, member, key)		\
+	hlist_for_each_entry_rcu (pos, ov_htable_bucket (t, key),	\
+				  member.node[(t)->ver])
+
+/* number of entries in a bucket, for statistics */
+static inline unsigned int
+ov_htable_bucket_len (struct ov_htable * t, unsigned int n)
+{
+	unsigned int len = 0;
+	struct hlist_node * p;
+
+	for (p = rcu_dereference_raw (hlist_first_rcu (&(t->buckets[n])));
+	     p; p = rcu_dereference_raw (hlist_next_rcu (p)))
+		len++;
+
+	return len;
+}
+
+/* iterate all entries. only for writers or under RCU for dumps */
+#define ov_htable_for_each_rcu(t, n, pos, member)			\
+	for (n = 0; n < OV_HTABLE_SIZE (t); n++)			\
+		hlist_for_each_entry_rcu (pos, &((t)->buckets[n]),	\
+					  member.node[(t)->ver])
+
+static inline struct ov_htable *
+ov_htable_alloc (unsigned int bits)
+{
+	unsigned int n;
+	size_t size;
+	struct ov_htable * t;
+
+	size = sizeof (struct ov_htable) +
+		sizeof (struct hlist_head) * (1U << bits);
+
+	if (size <= PAGE_SIZE)
+		t = kmalloc (size, GFP_KERNEL);
+	else
+		t = vmalloc (size);
+	if (!t)
+		return NULL;
+
+	t->bits = bits;
+	t->ver = 0;
+	for (n = 0; n < (1U << bits); n++)
+		INIT_HLIST_HEAD (&(t->buckets[n]));
+
+	return t;
+}
+
+static inline void
+ov_htable_free (struct ov_htable * t)
+{
+	if (is_vmalloc_addr (t))
+		vfree (t);
+	else
+		kfree (t);
+}
+
+static inline int
+ov_hash_init (struct ov_hash * h, unsigned int min_bits,
+	      unsigned int max_bits)
+{
+	struct ov_htable * t;
+
+	t = ov_htable_alloc (min_bits);
+	if (!t)
+		return -ENOMEM;
+
+	h->count = 0;
+	h->min_bits = min_bits;
+	h->max_bits = max_bits;
+	rcu_assign_pointer (h->tbl, t);
+
+	return 0;
+}
+
+/* entries must be removed and freed by the caller */
+static inline void
+ov_hash_destroy (struct ov_hash * h)
+{
+	struct ov_htable * t = ov_hash_table (h);
+
+	RCU_INIT_POINTER (h->tbl, NULL);
+	synchronize_rcu ();
+	ov_htable_free (t);
+}
+
+static inline void
+ov_hash_insert (struct ov_hash * h, struct ov_hnode * hn, u32 key)
+{
+	struct ov_htable * t = ov_hash_table (h);
+
+	hn->key = key;
+	hlist_add_head_rcu (&(hn->node[t->ver]), ov_htable_bucket (t, key));
+	h->count++;
+}
+
+static inline void
+ov_hash_remove (struct ov_hash * h, struct ov_hnode * hn)
+{
+	struct ov_htable * t = ov_hash_table (h);
+
+	hlist_del_rcu (&(hn->node[t->ver]));
+	h->count--;
+}
+
+/*
+ * grow the table when load factor exceeds 1, and shrink it when load
+ * factor falls below 1/4. Returns bits of the table to be resized to,
+ * or bits of the current table if resize is not needed.
+ */
+static inline unsigned int
+ov_hash_target_bits (struct ov_hash * h)
+{
+	struct ov_htable * t = ov_hash_table (h);
+
+	if (h->count > OV_HTABLE_SIZE (t) && t->bits < h->max_bits)
+		return t->bits + 1;
+	if (h->count < OV_HTABLE_SIZE (t) / 4 && t->bits > h->min_bits)
+		return t->bits - 1;
+
+	return t->bits;
+}
+
+static inline bool
+ov_hash_need_resize (struct ov_hash * h)
+{
+	return ov_hash_target_bits (h) != ov_hash_table (h)->bits;
+}
+
+/*
+ * link all entries to new table and publish it. The old table is
+ * returned, and must be freed after a grace period. Until then, the
+ * table must not be replaced again, because the next resize reuses
+ * node[old->ver] of entries.
+ */
+static inline struct ov_htable *
+ov_hash_replace (struct ov_hash * h, struct ov_htable * new)
+{
+	unsigned int n;
+	struct ov_htable * old = ov_hash_table (h);
+	struct ov_hnode * hn;
+
+	new->ver = !old->ver;
+
+	for (n = 0; n < OV_HTABLE_SIZE (old); n++) {
+		hlist_for_each_entry (hn, &(old->buckets[n]), node[old->ver])
+			hlist_add_head_rcu (&(hn->node[new->ver]),
+					    ov_htable_bucket (new, hn->key));
+	}
+
+	rcu_assign_pointer (h->tbl, new);
+
+	return old;
+}
+
+/*
+ * resize the table if needed. Returns 1 if resized, 0 if not needed and
+ * -ENOMEM if new table can not be allocated (old table still works).
+ */
+static inline int
+ov_hash_adjust (struct ov_hash * h)
+{
+	unsigned int bits;
+	struct ov_htable * old, * new;
+
+	bits = ov_hash_target_bits (h);
+	if (bits == ov_hash_table (h)->bits)
+		return 0;
+
+	new = ov_htable_alloc (bits);
+	if (!new)
+		return -ENOMEM;
+
+	old = ov_hash_replace (h, new);
+
+	synchronize_rcu ();
+	ov_htable_free (old);
+
+	return 1;
+}
+
+#endif /* _LINUX_OV_HASH_H_ */
@@ -2,19 +2,17 @@
  * Overlay ethernet driver
  */
 
-#ifndef DEBUG
-#define DEBUG
-#endif
-
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/version.h>
 #include <linux/string.h>
+#include <linux/slab.h>
 #include <linux/hashtable.h>
 #include <linux/in.h>
 #include <linux/inet.h>
 #include <linux/byteorder/generic.h>
 #include <linux/hash.h>
+#include <linux/jhash.h>
 #include <linux/udp.h>
 #include <linux/etherdevice.h>
 #include <net/udp.h>
@@ -23,6 +21,8 @@
 #include <net/ip6_route.h>
 #include <net/inet_sock.h>
 #include <net/inet_ecn.h>
+#include <net/icmp.h>
+#include <net/ip6_checksum.h>
 #include <net/rtnetlink.h>
 #include <net/genetlink.h>
 #include <net/net_namespace.h>
@@ -30,6 +30,8 @@
 
 
 #include "ovstack.h"
+#include "ov_hash.h"
+#include "ovstack_trace.h"
 #include "oveth.h"
 
 #define OVETH_VERSION "0.0.2"
@@ -44,61 +46,91 @@ MODULE_ALIAS_RTNL_LINK ("oveth");
 #define MAX_MTU		65535
 
 #define VNI_MAX		0x00FFFFFF
-#define VNI_HASH_BITS	8
-#define FDB_HASH_BITS	8
-#define MAC_HASH_BITS	8
 
-#define VNI_HASH_SIZE (1 << VNI_HASH_BITS)
-#define FDB_HASH_SIZE (1 << FDB_HASH_BITS)
+/* vni and fdb tables are resized between 2^min and 2^max buckets */
+#define VNI_HASH_MIN_BITS	4
+#define VNI_HASH_MAX_BITS	16
+#define FDB_HASH_MIN_BITS	8
+#define FDB_HASH_MAX_BITS	20
 
 /* IP + UDP + OVHDR + Ethernet */
-#define OVETH_IPV4_HEADROOM (20 + 8 + 16 + 14)
-#define OVETH_IPV6_HEADROOM (40 + 8 + 16 + 14)
+#define OVETH_IPV4_HEADROOM (20 + 8 + 20 + 14)
+#define OVETH_IPV6_HEADROOM (40 + 8 + 20 + 14)
 
 /* OVHDR + Ethernet */
-#define OVETH_HEADROOM (16 + 14)
+#define OVETH_HEADROOM (20 + 14)
+
+/* invoking packet quoted in ICMPv6 PTB, fits in IPv6 minimum MTU */
+#define OVETH_PTB_QUOTE_MAX (IPV6_MIN_MTU - sizeof (struct ipv6hdr) -	\
+			     sizeof (struct icmp6hdr))
+
+/* Aging. fdb buckets are swept a few at a time, see oveth_cleanup () */
+#define MAC_AGE_INTERVAL		(10 * HZ)	/* between sweeps */
+#define MAC_AGE_LIFETIME		(60 * HZ)	/* default */
+#define MAC_AGE_TICK			(HZ / 10)	/* within a sweep */
+#define MAC_AGE_BUDGET			256		/* entries per tick */
 
-/* Aging interval */
-#define MAC_AGE_INTERVAL		(10 * HZ)
-#define MAC_AGE_LIFETIME		(60 * HZ)
+/* MAC learning, see oveth_snoop () */
+#define MAC_LEARN_BATCH			64
+#define MAC_LEARN_REFRESH		(1 * HZ)
 
 
 static u32 oveth_salt __read_mostly;
 static u8  bcast_ethaddr[ETH_ALEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 
+/* a destination node of an FDB entry */
 struct oveth_fdb_node {
-	struct list_head	list;
-	struct rcu_head		rcu;
-
-	u16			state;
+	__be32			node_id;
+	u16			state;		/* NUD_* */
 	unsigned long		updated;
+};
 
-	__be32			node_id;
-	struct oveth_fdb	* fdb;		/* parent */
+/* nodes of an entry with more than one node, replaced under RCU */
+struct oveth_fdb_nodes {
+	struct rcu_head		rcu;
+	unsigned int		count;
+	struct oveth_fdb_node	node[0];
 };
 
+/*
+ * FDB entry. The bucket links, the MAC and the node of a single node
+ * entry come first, so that a unicast hit in oveth_xmit () reads one
+ * cache line of the entry (node.updated, written by learning, is in
+ * the next one). Entries with more nodes (broadcast, or a MAC behind
+ * several nodes) hang an array of them instead.
+ */
 struct oveth_fdb {
-	struct list_head	list;
-	struct list_head	chain;
+	struct ov_hnode		hnode;		/* fdb_hash */
+	u8			eth_addr[ETH_ALEN];
+	struct oveth_fdb_nodes __rcu * nodes;
+	struct oveth_fdb_node	node;		/* if nodes is NULL */
+
+	struct list_head	chain;		/* fdb_chain */
 	struct rcu_head		rcu;
+};
+
+static struct kmem_cache * oveth_fdb_cache __read_mostly;
 
-        unsigned long		update;
 
+/*
+ * MACs learned on a cpu, which are not in the fdb yet. Only the cpu and
+ * oveth_learn_work () take the lock.
+ */
+struct oveth_learn_ent {
 	u8			eth_addr[ETH_ALEN];
-	struct list_head	node_id_list;
-	u8			node_id_count;
+	__be32			node_id;
 };
 
-#define OVETH_FDB_FIRST_NODE(fdb) \
-	(list_entry_rcu (&(fdb->node_id_list), struct oveth_fdb_node, list))
-
-#define OVETH_FDB_NODE_COUNT(fdb) fdb->node_id_count
-
+struct oveth_learn_pcpu {
+	spinlock_t		lock;
+	unsigned int		count;
+	struct oveth_learn_ent	ent[MAC_LEARN_BATCH];
+};
 
 /* per network namespace instance */
 static unsigned int oveth_net_id;
 struct oveth_net {
-	struct list_head vni_list[VNI_HASH_SIZE];	/* oveth_dev table */
+	struct ov_hash	 vni_hash;			/* oveth_dev table */
 	struct list_head vni_chain;			/* oveth_dev chain */
 };
 
@@ -114,16 +146,22 @@ struct oveth_stats {
 
 /* psuedo network device */
 struct oveth_dev {
-	struct list_head	list;
+	struct ov_hnode		hnode;		/* vni_hash */
 	struct list_head	chain;
 	struct net_device	* dev;
 	struct oveth_stats	__percpu * stats;
 
 	__u32			vni;
-	struct list_head	fdb_head[FDB_HASH_SIZE];
+	spinlock_t		fdb_lock;
+	struct ov_hash		fdb_hash;
 	struct list_head	fdb_chain;
+	struct work_struct	fdb_resize_work;
+
+	struct oveth_learn_pcpu __percpu * learn;
+	struct work_struct	learn_work;
 
-	unsigned long		age_interval;
+	unsigned long		age_lifetime;	/* 0 means no aging */
+	unsigned int		age_cursor;	/* next bucket to sweep */
 	struct timer_list	age_timer;
 };
 
@@ -142,25 +180,19 @@ static u32 eth_hash(const unsigned char *addr)
 	value <<= 16;
 	#endif
 
-	return hash_64(value, FDB_HASH_BITS);
+	return hash_64(value, 32);
 }
 
 
 /* vni and fdb operations */
-static inline struct list_head *
-vni_head (struct net * net, u32 vni)
-{
-	struct oveth_net * ovnet = net_generic (net, oveth_net_id);
-	
-	return &(ovnet->vni_list[hash_32 (vni, VNI_HASH_BITS)]);
-}
-
 static struct oveth_dev *
 find_oveth_by_vni (struct net * net, u32 vni)
 {
+	struct oveth_net * ovnet = net_generic (net, oveth_net_id);
+	struct ov_htable * t = ov_hash_table (&(ovnet->vni_hash));
 	struct oveth_dev * oveth;
 
-	list_for_each_entry_rcu (oveth, vni_head (net, vni), list) {
+	ov_htable_for_each_possible_rcu (t, oveth, hnode, vni) {
 		if (oveth->vni == vni)
 			return oveth;
 	}
@@ -168,147 +200,309 @@ find_oveth_by_vni (struct net * net, u32 vni)
 	return NULL;
 }
 
-static inline struct list_head *
-oveth_fdb_head (struct oveth_dev * oveth, const u8 * mac)
-{
-	return &(oveth->fdb_head[eth_hash (mac)]);
-}
-
 static struct oveth_fdb *
 find_oveth_fdb_by_mac (struct oveth_dev * oveth, const u8 * mac)
 {
-	struct list_head * head = oveth_fdb_head (oveth, mac);
+	struct ov_htable * t = ov_hash_table (&(oveth->fdb_hash));
 	struct oveth_fdb * f;
 
-	list_for_each_entry_rcu (f, head, list) {
+	ov_htable_for_each_possible_rcu (t, f, hnode, eth_hash (mac)) {
 		if (compare_ether_addr (mac, f->eth_addr) == 0)
 			return f;
 	}
 	return NULL;
 }
 
+/* nodes of the entry. The array is valid until rcu read unlock. */
+static inline struct oveth_fdb_node *
+oveth_fdb_nodes (struct oveth_fdb * f, unsigned int * count)
+{
+	struct oveth_fdb_nodes * nodes = rcu_dereference_raw (f->nodes);
+
+	if (likely (!nodes)) {
+		*count = 1;
+		return &(f->node);
+	}
+
+	*count = nodes->count;
+	return nodes->node;
+}
+
 static struct oveth_fdb *
-create_oveth_fdb (const u8 * mac, gfp_t flags)
+create_oveth_fdb (const u8 * mac, __be32 node_id, u16 state, gfp_t flags)
 {
 	struct oveth_fdb * f;
 
-	f = kmalloc (sizeof (struct oveth_fdb), flags);
-
+	f = kmem_cache_zalloc (oveth_fdb_cache, flags);
 	if (!f)
 		return NULL;
 
-	memset (f, 0, sizeof (struct oveth_fdb));
-	
-	INIT_LIST_HEAD (&(f->list));
 	INIT_LIST_HEAD (&(f->chain));
-	INIT_LIST_HEAD (&(f->node_id_list));
 	memcpy (f->eth_addr, mac, ETH_ALEN);
-	f->update = jiffies;
+	f->node.node_id = node_id;
+	f->node.state = state;
+	f->node.updated = jiffies;
 
 	return f;
 }
 
+static void
+oveth_fdb_free_rcu (struct rcu_head * head)
+{
+	struct oveth_fdb * f = container_of (head, struct oveth_fdb, rcu);
+
+	kfree (rcu_dereference_raw (f->nodes));
+	kmem_cache_free (oveth_fdb_cache, f);
+}
+
+/*
+ * writers of the fdb hold fdb_lock. The table can not be resized under
+ * the spinlock, so that it is resized by oveth_fdb_resize_work ().
+ */
 static void
 oveth_fdb_add (struct oveth_dev * oveth, struct oveth_fdb * f)
 {
-	list_add_rcu (&(f->list), oveth_fdb_head (oveth, f->eth_addr));
+	ov_hash_insert (&(oveth->fdb_hash), &(f->hnode),
+			eth_hash (f->eth_addr));
 	list_add_rcu (&(f->chain), &(oveth->fdb_chain));
+
+	if (ov_hash_need_resize (&(oveth->fdb_hash)))
+		schedule_work (&oveth->fdb_resize_work);
 	return;
 }
 
 static void
-oveth_fdb_del (struct oveth_fdb * f)
+oveth_fdb_del (struct oveth_dev * oveth, struct oveth_fdb * f)
 {
-	struct list_head *p, *tmp;
-	struct oveth_fdb_node * fn;
+	ov_hash_remove (&(oveth->fdb_hash), &(f->hnode));
+	list_del_rcu (&(f->chain));
+	call_rcu (&(f->rcu), oveth_fdb_free_rcu);
+
+	if (ov_hash_need_resize (&(oveth->fdb_hash)))
+		schedule_work (&oveth->fdb_resize_work);
+}
+
+static void
+oveth_fdb_resize_work (struct work_struct * work)
+{
+	unsigned int bits;
+	struct ov_htable * old, * new;
+	struct oveth_dev * oveth = container_of (work, struct oveth_dev,
+						 fdb_resize_work);
+
+	for (;;) {
+		spin_lock_bh (&oveth->fdb_lock);
+		bits = ov_hash_target_bits (&(oveth->fdb_hash));
+		spin_unlock_bh (&oveth->fdb_lock);
+
+		if (bits == ov_hash_table (&(oveth->fdb_hash))->bits)
+			break;
+
+		new = ov_htable_alloc (bits);
+		if (!new) {
+			pr_debug ("%s: failed to allocate fdb table, "
+				  "%u bits\n", __func__, bits);
+			break;
+		}
+
+		/* only this work replaces the table */
+		spin_lock_bh (&oveth->fdb_lock);
+		old = ov_hash_replace (&(oveth->fdb_hash), new);
+		spin_unlock_bh (&oveth->fdb_lock);
 
-	/* destroy node id list */
-	list_for_each_safe (p, tmp, &(f->node_id_list)) {
-		fn = list_entry_rcu (p, struct oveth_fdb_node, list);
-		list_del_rcu (&(fn->list));
-		kfree_rcu (fn, rcu);
+		synchronize_rcu ();
+		ov_htable_free (old);
 	}
 
-	list_del_rcu (&(f->list));
-	list_del_rcu (&(f->chain));
+	return;
 }
 
 static struct oveth_fdb_node *
 oveth_fdb_find_node (struct oveth_fdb * f, __be32 node_id)
 {
+	unsigned int n, count;
 	struct oveth_fdb_node * fn;
 
-	list_for_each_entry_rcu (fn, &(f->node_id_list), list) {
-		if (fn->node_id == node_id)
-			return fn;
+	fn = oveth_fdb_nodes (f, &count);
+	for (n = 0; n < count; n++) {
+		if (fn[n].node_id == node_id)
+			return &fn[n];
 	}
 	return NULL;
 }
 
-static struct oveth_fdb_node *
-oveth_fdb_add_node (struct oveth_fdb * f, __be32 node_id, gfp_t flags)
+static int
+oveth_fdb_add_node (struct oveth_fdb * f, __be32 node_id, u16 state,
+		    gfp_t flags)
 {
+	unsigned int count;
 	struct oveth_fdb_node * fn;
+	struct oveth_fdb_nodes * nodes, * old;
 
-	fn = kmalloc (sizeof (struct oveth_fdb_node), flags);
-	memset (fn, 0, sizeof (struct oveth_fdb_node));
+	fn = oveth_fdb_nodes (f, &count);
+
+	nodes = kmalloc (sizeof (*nodes) + sizeof (*fn) * (count + 1), flags);
+	if (!nodes)
+		return -ENOMEM;
 
-	fn->node_id = node_id;
-	fn->updated = jiffies;
-	fn->fdb = f;
+	memcpy (nodes->node, fn, sizeof (*fn) * count);
+	nodes->node[count].node_id = node_id;
+	nodes->node[count].state = state;
+	nodes->node[count].updated = jiffies;
+	nodes->count = count + 1;
 
-	list_add_rcu (&(fn->list), &(f->node_id_list));
-	f->node_id_count++;
+	old = rcu_dereference_raw (f->nodes);
+	rcu_assign_pointer (f->nodes, nodes);
+	if (old)
+		kfree_rcu (old, rcu);
 
-	return fn;
+	return 0;
 }
 
-static void
-oveth_fdb_del_node (struct oveth_fdb * f, __be32 node_id)
+/* returns 1 if the last node is deleted with the entry */
+static int
+oveth_fdb_del_node (struct oveth_dev * oveth, struct oveth_fdb * f,
+		    __be32 node_id)
 {
+	unsigned int n, m, count;
 	struct oveth_fdb_node * fn;
-	fn = oveth_fdb_find_node (f, node_id);
-	if (fn == NULL)
-		return;
-	fn->fdb = NULL;
-	list_del_rcu (&(fn->list));
-	f->node_id_count--;
+	struct oveth_fdb_nodes * nodes, * old;
+
+	fn = oveth_fdb_nodes (f, &count);
+	if (count == 1) {
+		if (fn->node_id != node_id)
+			return -ENOENT;
+		oveth_fdb_del (oveth, f);
+		return 1;
+	}
 
-	return;
+	old = rcu_dereference_raw (f->nodes);
+
+	if (count == 2) {
+		/* back to a single node entry in the first line */
+		n = (fn[0].node_id == node_id) ? 1 : 0;
+		if (fn[!n].node_id != node_id)
+			return -ENOENT;
+		f->node = fn[n];
+		smp_wmb ();
+		RCU_INIT_POINTER (f->nodes, NULL);
+		kfree_rcu (old, rcu);
+		return 0;
+	}
+
+	nodes = kmalloc (sizeof (*nodes) + sizeof (*fn) * (count - 1),
+			 GFP_ATOMIC);
+	if (!nodes)
+		return -ENOMEM;
+
+	for (n = 0, m = 0; n < count; n++) {
+		if (fn[n].node_id == node_id)
+			continue;
+		if (m == count - 1) {
+			kfree (nodes);
+			return -ENOENT;
+		}
+		nodes->node[m++] = fn[n];
+	}
+	nodes->count = m;
+
+	rcu_assign_pointer (f->nodes, nodes);
+	kfree_rcu (old, rcu);
+
+	return 0;
+}
+
+/* add node_id to the entry of mac, or create the entry */
+static int
+oveth_fdb_update (struct oveth_dev * oveth, const u8 * mac, __be32 node_id,
+		  u16 state)
+{
+	struct oveth_fdb * f;
+
+	f = find_oveth_fdb_by_mac (oveth, mac);
+	if (f) {
+		if (oveth_fdb_find_node (f, node_id))
+			return -EEXIST;
+		return oveth_fdb_add_node (f, node_id, state, GFP_ATOMIC);
+	}
+
+	f = create_oveth_fdb (mac, node_id, state, GFP_ATOMIC);
+	if (!f)
+		return -ENOMEM;
+	oveth_fdb_add (oveth, f);
+
+	return 0;
 }
 
+static void
+oveth_fdb_flush (struct oveth_dev * oveth)
+{
+	struct oveth_fdb * f, * tmp;
+
+	spin_lock_bh (&oveth->fdb_lock);
+	list_for_each_entry_safe (f, tmp, &(oveth->fdb_chain), chain)
+		oveth_fdb_del (oveth, f);
+	spin_unlock_bh (&oveth->fdb_lock);
+}
 
+
+/* sweep buckets from age_cursor until MAC_AGE_BUDGET entries are
+ * examined, so that a large fdb does not stall the softirq. */
 static void
 oveth_cleanup (unsigned long arg)
 {
 	struct oveth_dev * oveth = (struct oveth_dev *) arg;
-	struct list_head * p, * tmp, * p2, * tmp2;
 	struct oveth_fdb * f;
 	struct oveth_fdb_node * fn;
-	unsigned long timeout;
-	unsigned long next_timer = jiffies + MAC_AGE_INTERVAL;
+	struct ov_htable * t;
+	struct hlist_node * tmp;
+	unsigned int n, count;
+	int budget = MAC_AGE_BUDGET;
+	unsigned long next_timer;
 
 	if (!netif_running (oveth->dev))
 		return;
 
-	list_for_each_safe (p, tmp, &oveth->fdb_chain) {
-		f = list_entry (p, struct oveth_fdb, chain);
-
-		list_for_each_safe (p2, tmp2, &f->node_id_list) {
-			fn = list_entry (p2, struct oveth_fdb_node, list);
-			if (fn->state & NUD_PERMANENT) 
-				goto next;
-
-			timeout = fn->updated + MAC_AGE_LIFETIME;
-
-			if (time_before_eq (timeout, jiffies)) {
-				list_del_rcu (&fn->list);
-				kfree_rcu (fn, rcu);
+	spin_lock_bh (&oveth->fdb_lock);
+
+	/* the table may have been resized since the last tick */
+	t = ov_hash_table (&(oveth->fdb_hash));
+	if (oveth->age_cursor >= OV_HTABLE_SIZE (t))
+		oveth->age_cursor = 0;
+
+	do {
+		hlist_for_each_entry_safe (f, tmp,
+					   &(t->buckets[oveth->age_cursor]),
+					   hnode.node[t->ver]) {
+			budget--;
+		again:
+			fn = oveth_fdb_nodes (f, &count);
+			for (n = 0; n < count; n++) {
+				if (fn[n].state & NUD_PERMANENT)
+					continue;
+				if (time_after (fn[n].updated +
+						oveth->age_lifetime, jiffies))
+					continue;
+
+				/* the array is replaced by deleting a node */
+				if (oveth_fdb_del_node (oveth, f,
+							fn[n].node_id) == 0)
+					goto again;
+				break;
 			}
-
-		next:;
 		}
-	}
+		oveth->age_cursor = (oveth->age_cursor + 1) %
+			OV_HTABLE_SIZE (t);
+	} while (budget > 0 && oveth->age_cursor);
+
+	spin_unlock_bh (&oveth->fdb_lock);
+
+	/* a sweep finishes when the cursor wraps around */
+	if (oveth->age_cursor)
+		next_timer = jiffies + MAC_AGE_TICK;
+	else
+		next_timer = jiffies + min_t (unsigned long, MAC_AGE_INTERVAL,
+					      oveth->age_lifetime);
 
 	mod_timer (&oveth->age_timer, next_timer);
 
@@ -319,14 +513,40 @@ oveth_cleanup (unsigned long arg)
  *	net_device_ops related
  *************************************/
 
+/* skb->data is ovhdr. skb is consumed */
+static inline void
+oveth_xmit_node (struct oveth_dev * oveth, struct sk_buff * skb,
+		 __be32 node_id)
+{
+	int rc;
+	unsigned int len = skb->len - sizeof (struct ovhdr);
+	struct ovhdr * ovh = (struct ovhdr *) skb->data;
+	struct net_device * dev = oveth->dev;
+
+	ovh->ov_dst = node_id;
+	trace_oveth_xmit (skb, ovh);
+	rc = ovstack_xmit (skb, dev);
+
+	if (net_xmit_eval (rc) == 0) {
+		struct oveth_stats * stats = this_cpu_ptr (oveth->stats);
+		u64_stats_update_begin (&stats->syncp);
+		stats->tx_packets++;
+		stats->tx_bytes += len;
+		u64_stats_update_end (&stats->syncp);
+	} else {
+		dev->stats.tx_errors++;
+		dev->stats.tx_aborted_errors++;
+	}
+}
+
 static netdev_tx_t
 oveth_xmit (struct sk_buff * skb, struct net_device * dev)
 {
-	int rc;
-	u32 hash;
+	__be32 hash;
 	struct sk_buff * mskb;
 	struct ovhdr * ovh;
 	struct ethhdr * eth;
+	unsigned int n, count;
 	struct oveth_fdb * f;
 	struct oveth_fdb_node * fn;
 	struct oveth_dev * oveth = netdev_priv (dev);
@@ -344,7 +564,9 @@ oveth_xmit (struct sk_buff * skb, struct net_device * dev)
 		}
 	}
 
-	hash = eth_hash (eth->h_dest);
+	/* inner flow, so that flows of a VM are spread over locators */
+	skb_set_network_header (skb, ETH_HLEN);
+	hash = ovstack_flow_hash (skb, jhash (eth->h_dest, ETH_ALEN, 0));
 
 	/* setup ovly header */
 	if (skb_cow_head (skb, OVETH_HEADROOM)) {
@@ -359,44 +581,243 @@ oveth_xmit (struct sk_buff * skb, struct net_device * dev)
 	ovh->ov_app	= OVAPP_ETHERNET;
 	ovh->ov_flags	= 0;
 	ovh->ov_vni	= htonl (oveth->vni << 8);
-	ovh->ov_hash	= htonl (hash);
+	ovh->ov_hash	= hash;
 	ovh->ov_dst	= 0;
 	ovh->ov_src	= ovstack_own_node_id (dev_net (dev), OVAPP_ETHERNET);
 
-	list_for_each_entry_rcu (fn, &f->node_id_list, list) {
-
+	/*
+	 * skb itself goes to the last node, so that unicast, which is
+	 * almost all, is sent without clone. Clones for other nodes get
+	 * their own header because ov_dst differs.
+	 */
+	fn = oveth_fdb_nodes (f, &count);
+	for (n = 0; n < count - 1; n++) {
 		mskb = skb_clone (skb, GFP_ATOMIC);
-
-		if (unlikely (!mskb)) {
+		if (unlikely (!mskb || skb_cow_head (mskb, 0))) {
+			if (mskb)
+				dev_kfree_skb (mskb);
 			dev->stats.tx_errors++;
 			dev->stats.tx_aborted_errors++;
 			printk (KERN_ERR "oveth: failed to alloc skb\n");
-			goto skip;
-		}
-
-		ovh = (struct ovhdr *) mskb->data;
-		ovh->ov_dst = fn->node_id;
-		rc = ovstack_xmit (mskb, dev);
-
-		if (net_xmit_eval (rc) == 0) {
-			struct oveth_stats * stats = 
-				this_cpu_ptr (oveth->stats);
-			u64_stats_update_begin (&stats->syncp);
-			stats->tx_packets++;
-			stats->tx_bytes += mskb->len;
-			u64_stats_update_end (&stats->syncp);
-		} else {
-			dev->stats.tx_errors++;
-			dev->stats.tx_aborted_errors++;
+			continue;
 		}
-	skip:;
+		oveth_xmit_node (oveth, mskb, fn[n].node_id);
 	}
 
-	dev_kfree_skb (skb);
+	oveth_xmit_node (oveth, skb, fn[count - 1].node_id);
 
 	return NETDEV_TX_OK;
 }
 
+/*
+ * an ethernet frame sent by oveth_xmit () exceeds the path MTU. Tell the
+ * inner sender by an ICMP frag needed or ICMPv6 packet too big from the
+ * inner destination, as ip tunnels do. mtu is the largest frame after
+ * ovhdr. Returns nonzero to let ovstack fragment the outer packet.
+ */
+static int
+oveth_pmtu_icmp4 (struct net_device * dev, struct sk_buff * skb,
+		  unsigned int mtu)
+{
+	unsigned int qlen, off = sizeof (struct ovhdr) + ETH_HLEN;
+	struct ethhdr * eth, * neth;
+	struct iphdr * iph, * niph;
+	struct icmphdr * icmph;
+	struct sk_buff * nskb;
+
+	if (!pskb_may_pull (skb, off + sizeof (struct iphdr)))
+		return -1;
+
+	eth = (struct ethhdr *) (skb->data + sizeof (struct ovhdr));
+	iph = (struct iphdr *) (skb->data + off);
+	if (!(iph->frag_off & htons (IP_DF)) || mtu < MIN_MTU)
+		return -1;
+
+	qlen = min_t (unsigned int, skb->len - off, iph->ihl * 4 + 8);
+	nskb = netdev_alloc_skb_ip_align (dev, ETH_HLEN + sizeof (*niph) +
+					  sizeof (*icmph) + qlen);
+	if (!nskb)
+		return -1;
+
+	neth = (struct ethhdr *) skb_put (nskb, ETH_HLEN);
+	memcpy (neth->h_dest, eth->h_source, ETH_ALEN);
+	memcpy (neth->h_source, eth->h_dest, ETH_ALEN);
+	neth->h_proto = htons (ETH_P_IP);
+
+	niph = (struct iphdr *) skb_put (nskb, sizeof (*niph));
+	icmph = (struct icmphdr *) skb_put (nskb, sizeof (*icmph));
+	skb_copy_bits (skb, off, skb_put (nskb, qlen), qlen);
+
+	icmph->type	= ICMP_DEST_UNREACH;
+	icmph->code	= ICMP_FRAG_NEEDED;
+	icmph->un.frag.__unused = 0;
+	icmph->un.frag.mtu = htons (mtu);
+	icmph->checksum	= 0;
+	icmph->checksum	= csum_fold (csum_partial (icmph, sizeof (*icmph) +
+						   qlen, 0));
+
+	niph->version	= 4;
+	niph->ihl	= sizeof (*niph) >> 2;
+	niph->tos	= 0;
+	niph->tot_len	= htons (sizeof (*niph) + sizeof (*icmph) + qlen);
+	niph->id	= 0;
+	niph->frag_off	= htons (IP_DF);
+	niph->ttl	= 64;
+	niph->protocol	= IPPROTO_ICMP;
+	niph->saddr	= iph->daddr;
+	niph->daddr	= iph->saddr;
+	niph->check	= 0;
+	niph->check	= ip_fast_csum (niph, niph->ihl);
+
+	nskb->protocol = eth_type_trans (nskb, dev);
+	netif_rx (nskb);
+
+	return 0;
+}
+
+static int
+oveth_pmtu_icmp6 (struct net_device * dev, struct sk_buff * skb,
+		  unsigned int mtu)
+{
+	unsigned int qlen, off = sizeof (struct ovhdr) + ETH_HLEN;
+	struct ethhdr * eth, * neth;
+	struct ipv6hdr * ip6h, * nip6h;
+	struct icmp6hdr * icmp6h;
+	struct sk_buff * nskb;
+
+	/* IPv6 links carry IPV6_MIN_MTU, so the outer is fragmented */
+	if (mtu < IPV6_MIN_MTU ||
+	    !pskb_may_pull (skb, off + sizeof (struct ipv6hdr)))
+		return -1;
+
+	eth = (struct ethhdr *) (skb->data + sizeof (struct ovhdr));
+	ip6h = (struct ipv6hdr *) (skb->data + off);
+
+	qlen = min_t (unsigned int, skb->len - off, OVETH_PTB_QUOTE_MAX);
+	nskb = netdev_alloc_skb_ip_align (dev, ETH_HLEN + sizeof (*nip6h) +
+					  sizeof (*icmp6h) + qlen);
+	if (!nskb)
+		return -1;
+
+	neth = (struct ethhdr *) skb_put (nskb, ETH_HLEN);
+	memcpy (neth->h_dest, eth->h_source, ETH_ALEN);
+	memcpy (neth->h_source, eth->h_dest, ETH_ALEN);
+	neth->h_proto = htons (ETH_P_IPV6);
+
+	nip6h = (struct ipv6hdr *) skb_put (nskb, sizeof (*nip6h));
+	icmp6h = (struct icmp6hdr *) skb_put (nskb, sizeof (*icmp6h));
+	skb_copy_bits (skb, off, skb_put (nskb, qlen), qlen);
+
+	memset (nip6h, 0, sizeof (*nip6h));
+	nip6h->version		= 6;
+	nip6h->payload_len	= htons (sizeof (*icmp6h) + qlen);
+	nip6h->nexthdr		= IPPROTO_ICMPV6;
+	nip6h->hop_limit	= 255;
+	nip6h->saddr		= ip6h->daddr;
+	nip6h->daddr		= ip6h->saddr;
+
+	memset (icmp6h, 0, sizeof (*icmp6h));
+	icmp6h->icmp6_type	= ICMPV6_PKT_TOOBIG;
+	icmp6h->icmp6_mtu	= htonl (mtu);
+	icmp6h->icmp6_cksum	= csum_ipv6_magic (&nip6h->saddr,
+						   &nip6h->daddr,
+						   sizeof (*icmp6h) + qlen,
+						   IPPROTO_ICMPV6,
+						   csum_partial (icmp6h,
+								 sizeof (*icmp6h)
+								 + qlen, 0));
+
+	nskb->protocol = eth_type_trans (nskb, dev);
+	netif_rx (nskb);
+
+	return 0;
+}
+
+static int
+oveth_pmtu_recv (struct sk_buff * skb, unsigned int mtu)
+{
+	struct ethhdr * eth;
+	struct net_device * dev = skb->dev;
+
+	if (mtu <= ETH_HLEN ||
+	    !pskb_may_pull (skb, sizeof (struct ovhdr) + ETH_HLEN))
+		return -1;
+
+	/* largest IP packet in the inner ethernet frame */
+	mtu -= ETH_HLEN;
+
+	eth = (struct ethhdr *) (skb->data + sizeof (struct ovhdr));
+	switch (ntohs (eth->h_proto)) {
+	case ETH_P_IP :
+		return oveth_pmtu_icmp4 (dev, skb, mtu);
+	case ETH_P_IPV6 :
+		return oveth_pmtu_icmp6 (dev, skb, mtu);
+	}
+
+	return -1;
+}
+
+/* single writer of learned MACs. drains the queues of all cpus */
+static void
+oveth_learn_work (struct work_struct * work)
+{
+	int cpu;
+	unsigned int n;
+	struct oveth_learn_pcpu * l;
+	struct oveth_dev * oveth = container_of (work, struct oveth_dev,
+						 learn_work);
+
+	spin_lock_bh (&oveth->fdb_lock);
+
+	for_each_possible_cpu (cpu) {
+		l = per_cpu_ptr (oveth->learn, cpu);
+		spin_lock (&l->lock);
+		for (n = 0; n < l->count; n++)
+			oveth_fdb_update (oveth, l->ent[n].eth_addr,
+					  l->ent[n].node_id, NUD_REACHABLE);
+		l->count = 0;
+		spin_unlock (&l->lock);
+	}
+
+	spin_unlock_bh (&oveth->fdb_lock);
+
+	return;
+}
+
+static void
+oveth_learn_queue (struct oveth_dev * oveth, __be32 ov_src,
+		   const u8 * src_mac)
+{
+	bool kick = false;
+	struct oveth_learn_ent * e;
+	struct oveth_learn_pcpu * l = this_cpu_ptr (oveth->learn);
+
+	spin_lock (&l->lock);
+
+	/* a burst from a new MAC is queued once. when the queue is full,
+	 * later frames learn it after the queue is drained */
+	if (l->count) {
+		e = &l->ent[l->count - 1];
+		if (e->node_id == ov_src &&
+		    compare_ether_addr (e->eth_addr, src_mac) == 0)
+			goto out;
+	}
+	if (l->count == MAC_LEARN_BATCH)
+		goto out;
+
+	e = &l->ent[l->count++];
+	memcpy (e->eth_addr, src_mac, ETH_ALEN);
+	e->node_id = ov_src;
+	kick = (l->count == 1);
+out:
+	spin_unlock (&l->lock);
+
+	if (kick)
+		schedule_work (&oveth->learn_work);
+
+	return;
+}
+
 static void
 oveth_snoop (struct oveth_dev * oveth, __be32 ov_src, const u8 * src_mac)
 {
@@ -406,25 +827,20 @@ oveth_snoop (struct oveth_dev * oveth, __be32 ov_src, const u8 * src_mac)
 	struct oveth_fdb_node * fn;
 
 	f = find_oveth_fdb_by_mac (oveth, src_mac);
-
 	if (likely (f)) {
 		fn = oveth_fdb_find_node (f, ov_src);
-		if (likely (fn))
-			fn->updated = jiffies;
-		else 
-			fn = oveth_fdb_add_node (f, ov_src, GFP_ATOMIC);
-	} else {
-		if (!(f = create_oveth_fdb (src_mac, GFP_ATOMIC)))
+		if (likely (fn)) {
+			/* the line is read by xmit on every packet, so
+			 * it is written only once in a refresh period */
+			if (unlikely (time_after (jiffies, fn->updated +
+						  MAC_LEARN_REFRESH)))
+				fn->updated = jiffies;
 			return;
-
-		if (!(fn = oveth_fdb_add_node (f, ov_src, GFP_ATOMIC)))
-			return;
-
-		fn->state = NUD_REACHABLE;
-
-		oveth_fdb_add (oveth, f);
+		}
 	}
 
+	oveth_learn_queue (oveth, ov_src, src_mac);
+
 	return;
 }
 
@@ -442,6 +858,8 @@ oveth_encap_recv (struct sk_buff * skb)
 	/* outer udp header is already removed by ovstack. */
 	
 	ovh = (struct ovhdr *) skb->data;
+	trace_oveth_encap_recv (skb, ovh);
+
 	vni = ntohl (ovh->ov_vni) >> 8;
 	net = dev_net (skb->dev);
 	oveth = find_oveth_by_vni (net, vni);
@@ -450,13 +868,14 @@ oveth_encap_recv (struct sk_buff * skb)
 
 	/* vni check */
 	if (!oveth) {
-		netdev_dbg (skb->dev, "unknown vni %d\n", vni);
-		goto drop;
+		ovstack_drop (skb, ovh, OVSTACK_DROP_UNKNOWN_VNI);
+		return 0;
 	}
         if (!pskb_may_pull (skb, ETH_HLEN)) {
 		oveth->dev->stats.rx_length_errors++;
 		oveth->dev->stats.rx_errors++;
-		goto drop;
+		ovstack_drop (skb, NULL, OVSTACK_DROP_TRUNCATED);
+		return 0;
 	}
 
 	skb_reset_mac_header (skb);
@@ -467,8 +886,10 @@ oveth_encap_recv (struct sk_buff * skb)
 
 	/* loop ? */
 	if (compare_ether_addr (eth_hdr(skb)->h_source,
-				oveth->dev->dev_addr) == 0) 
-		goto drop;
+				oveth->dev->dev_addr) == 0) {
+		ovstack_drop (skb, NULL, OVSTACK_DROP_LOOP);
+		return 0;
+	}
 
 	__skb_tunnel_rx (skb, oveth->dev, net);
 	skb_reset_network_header (skb);
@@ -494,21 +915,35 @@ oveth_encap_recv (struct sk_buff * skb)
 	netif_rx(skb);
 
 	return 0;
-
-drop:
-	kfree_skb (skb);
-	return 0;
 }
 
 static int
 oveth_init (struct net_device * dev)
 {
+	int cpu;
 	struct oveth_dev * oveth = netdev_priv (dev);
 
 	oveth->stats = alloc_percpu (struct oveth_stats);
 	if (!oveth->stats)
 		return -ENOMEM;
 
+	oveth->learn = alloc_percpu (struct oveth_learn_pcpu);
+	if (!oveth->learn) {
+		free_percpu (oveth->stats);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu (cpu)
+		spin_lock_init (&(per_cpu_ptr (oveth->learn, cpu)->lock));
+	INIT_WORK (&oveth->learn_work, oveth_learn_work);
+
+	if (ov_hash_init (&(oveth->fdb_hash), FDB_HASH_MIN_BITS,
+			  FDB_HASH_MAX_BITS) < 0) {
+		free_percpu (oveth->learn);
+		free_percpu (oveth->stats);
+		return -ENOMEM;
+	}
+	INIT_WORK (&oveth->fdb_resize_work, oveth_fdb_resize_work);
+
 	return 0;
 }
 
@@ -517,7 +952,7 @@ oveth_open (struct net_device * dev)
 {
 	struct oveth_dev * oveth = netdev_priv (dev);
 
-	if (oveth->age_interval)
+	if (oveth->age_lifetime)
 		mod_timer (&oveth->age_timer, jiffies + MAC_AGE_INTERVAL);
 
 	return 0;
@@ -583,10 +1018,9 @@ oveth_ndo_fdb_add (struct ndmsg * ndm, struct nlattr * tb[],
 		   struct net_device * dev, 
 		   const unsigned char * addr, u16 flags)
 {
+	int rc = 0;
 	__be32 node_id;
 	struct oveth_dev * oveth = netdev_priv (dev);
-	struct oveth_fdb * f;
-	struct oveth_fdb_node * fn;
 
 	if (!(ndm->ndm_state & (NUD_PERMANENT | NUD_REACHABLE))) {
 		pr_info ("RTM_NEWNEIGH with invalid state %#x\n",
@@ -604,21 +1038,11 @@ oveth_ndo_fdb_add (struct ndmsg * ndm, struct nlattr * tb[],
 
 	node_id = nla_get_be32 (tb[NDA_DST]);
 
-	f = find_oveth_fdb_by_mac (oveth, addr);
-	if (f == NULL) {
-		f = create_oveth_fdb ((u8 *)addr, GFP_KERNEL);
-		oveth_fdb_add (oveth, f);
-	}
+	spin_lock_bh (&oveth->fdb_lock);
+	rc = oveth_fdb_update (oveth, addr, node_id, NUD_PERMANENT);
+	spin_unlock_bh (&oveth->fdb_lock);
 
-	fn = oveth_fdb_find_node (f, node_id);
-	if (fn == NULL) {
-		fn = oveth_fdb_add_node (f, node_id, GFP_KERNEL);
-		fn->state |= NUD_PERMANENT;
-	} else {
-		return -EEXIST;
-	}
-
-	return 0;
+	return rc;
 }
 
 /* Delete entry via netlink */
@@ -638,19 +1062,18 @@ oveth_ndo_fdb_delete (struct ndmsg * ndm, struct nlattr * tb[],
 		return -EINVAL;
 	}
 
+	spin_lock_bh (&oveth->fdb_lock);
 	f = find_oveth_fdb_by_mac (oveth, addr);
-	if (f == NULL)
-		return -ENOENT;
+	if (f)
+		oveth_fdb_del (oveth, f);
+	spin_unlock_bh (&oveth->fdb_lock);
 
-	oveth_fdb_del (f);
-	kfree_rcu (f, rcu);
-
-	return 0;
+	return f ? 0 : -ENOENT;
 }
 
 static int
 oveth_fdb_info (struct sk_buff * skb, struct oveth_dev * oveth,
-		const struct oveth_fdb_node * fn, 
+		const struct oveth_fdb * f, const struct oveth_fdb_node * fn,
 		u32 portid, u32 seq, int type, unsigned int flags)
 {
 	unsigned long now = jiffies;
@@ -671,7 +1094,7 @@ oveth_fdb_info (struct sk_buff * skb, struct oveth_dev * oveth,
 	if (type == RTM_GETNEIGH) {
 		ndm->ndm_family = AF_INET;
 		send_ip = fn->node_id != 0;
-		send_eth = !is_zero_ether_addr (fn->fdb->eth_addr);
+		send_eth = !is_zero_ether_addr (f->eth_addr);
 	} else
 		ndm->ndm_family = AF_BRIDGE;
 
@@ -680,8 +1103,7 @@ oveth_fdb_info (struct sk_buff * skb, struct oveth_dev * oveth,
 	ndm->ndm_flags = NTF_SELF;
 	ndm->ndm_type = NDA_DST;
 
-	if (send_eth && nla_put (skb, NDA_LLADDR, ETH_ALEN, 
-				 &fn->fdb->eth_addr))
+	if (send_eth && nla_put (skb, NDA_LLADDR, ETH_ALEN, f->eth_addr))
 		goto nla_put_failure;
 	
 	if (send_ip && nla_put_be32 (skb, NDA_DST, fn->node_id))
@@ -709,6 +1131,7 @@ oveth_ndo_fdb_dump (struct sk_buff * skb, struct netlink_callback * cb,
 		    struct net_device * dev, int idx)
 {
 	int err;
+	unsigned int n, count;
 	struct oveth_fdb * f;
 	struct oveth_fdb_node * fn;
 	struct oveth_dev * oveth = netdev_priv (dev);
@@ -717,8 +1140,9 @@ oveth_ndo_fdb_dump (struct sk_buff * skb, struct netlink_callback * cb,
 		if (idx < cb->args[0])
 			goto skip;
 
-		list_for_each_entry_rcu (fn, &f->node_id_list, list) {
-			err = oveth_fdb_info (skb, oveth, fn,
+		fn = oveth_fdb_nodes (f, &count);
+		for (n = 0; n < count; n++) {
+			err = oveth_fdb_info (skb, oveth, f, &fn[n],
 					      NETLINK_CB (cb->skb).portid,
 					      cb->nlh->nlmsg_seq,
 					      RTM_NEWNEIGH, NLM_F_MULTI);
@@ -770,6 +1194,13 @@ oveth_free (struct net_device * dev)
 {
 	struct oveth_dev * oveth = netdev_priv (dev);
 
+	/* learned after oveth_dellink () flushed the fdb */
+	cancel_work_sync (&oveth->learn_work);
+	oveth_fdb_flush (oveth);
+	cancel_work_sync (&oveth->fdb_resize_work);
+	ov_hash_destroy (&(oveth->fdb_hash));
+
+	free_percpu (oveth->learn);
 	free_percpu (oveth->stats);
 	free_netdev (dev);
 
@@ -784,6 +1215,7 @@ oveth_setup (struct net_device * dev)
 	eth_hw_addr_random (dev);
 	ether_setup (dev);
 	dev->hard_header_len = ETH_HLEN + OVETH_IPV6_HEADROOM;
+	dev->mtu = ETH_DATA_LEN - OVETH_IPV4_HEADROOM;
 
 	dev->netdev_ops = &oveth_netdev_ops;
 	dev->destructor = &oveth_free;
@@ -794,8 +1226,13 @@ oveth_setup (struct net_device * dev)
 	dev->features   |= NETIF_F_NETNS_LOCAL;
 	dev->features   |= NETIF_F_SG | NETIF_F_HW_CSUM;
 	dev->features   |= NETIF_F_RXCSUM;
+	dev->features   |= NETIF_F_GSO_SOFTWARE;
 
 	dev->hw_features |= NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_RXCSUM;
+	dev->hw_features |= NETIF_F_GSO_SOFTWARE;
+
+	/* super packets are segmented after encapsulation by ovstack */
+	netif_set_gso_max_size (dev, GSO_MAX_SIZE - OVETH_IPV6_HEADROOM);
 	dev->priv_flags &= ~IFF_XMIT_DST_RELEASE;
 
 	init_timer_deferrable (&oveth->age_timer);
@@ -810,12 +1247,18 @@ oveth_setup (struct net_device * dev)
 static int
 oveth_validate (struct nlattr * tb[], struct nlattr * data[])
 {
-	if (tb[IFLA_OVETH_VNI]) {
+	if (data && data[IFLA_OVETH_VNI]) {
 		__u32 vni = nla_get_u32 (data[IFLA_OVETH_VNI]);
 		if (vni >= VNI_MAX)
 			return -ERANGE;
 	}
 
+	if (data && data[IFLA_OVETH_AGEING]) {
+		__u32 ageing = nla_get_u32 (data[IFLA_OVETH_AGEING]);
+		if (ageing > MAX_JIFFY_OFFSET / HZ)
+			return -ERANGE;
+	}
+
 	return 0;
 }
 
@@ -823,7 +1266,7 @@ static int
 oveth_newlink (struct net * net, struct net_device * dev,
 	       struct nlattr * tb[], struct nlattr * data[])
 {
-	int n, rc;
+	int rc;
 	__u32 vni;
 	struct oveth_dev * oveth = netdev_priv (dev);
 	struct oveth_net * ovnet = net_generic (net, oveth_net_id);
@@ -844,33 +1287,37 @@ oveth_newlink (struct net * net, struct net_device * dev,
 	}
 
 	oveth->vni = vni;
+	oveth->age_lifetime = MAC_AGE_LIFETIME;
+	if (data[IFLA_OVETH_AGEING])
+		oveth->age_lifetime =
+			nla_get_u32 (data[IFLA_OVETH_AGEING]) * HZ;
+
+	spin_lock_init (&oveth->fdb_lock);
 	INIT_LIST_HEAD (&oveth->fdb_chain);
-	for (n = 0; n < FDB_HASH_SIZE; n++) 
-		INIT_LIST_HEAD (&(oveth->fdb_head[n]));
 
 	rc = register_netdevice (dev);
 	if (rc == 0) {
-		list_add_rcu (&(oveth->list), vni_head (net, oveth->vni));
+		/* writers of vni_hash are serialized by rtnl */
+		ov_hash_insert (&(ovnet->vni_hash), &(oveth->hnode), vni);
+		ov_hash_adjust (&(ovnet->vni_hash));
 		list_add_rcu (&(oveth->chain), &(ovnet->vni_chain));
 	}
 
-	oveth->age_interval = MAC_AGE_INTERVAL;
-
 	return rc;
 }
 
 static void
 oveth_dellink (struct net_device * dev, struct list_head * head)
 {
-	struct oveth_fdb * f;
-	struct list_head * p, * tmp;
 	struct oveth_dev * oveth = netdev_priv (dev);
+	struct oveth_net * ovnet = net_generic (dev_net (dev), oveth_net_id);
+
+	ov_hash_remove (&(ovnet->vni_hash), &(oveth->hnode));
+	ov_hash_adjust (&(ovnet->vni_hash));
+	list_del_rcu (&(oveth->chain));
 	
 	/* destroy fdb */
-	list_for_each_safe (p, tmp, &(oveth->fdb_chain)) {
-		f = list_entry (p, struct oveth_fdb, chain);
-		oveth_fdb_del (f);
-	}
+	oveth_fdb_flush (oveth);
 
 	unregister_netdevice_queue (dev, head);
 
@@ -882,13 +1329,27 @@ oveth_get_size (const struct net_device * dev)
 {
 	return nla_total_size (sizeof (__u32)) +	/* IFLA_OVETH_VNI */
 		nla_total_size (sizeof (__u8)) + 	/* IFLA_OVETH_TTL */
+		nla_total_size (sizeof (__u32)) +	/* IFLA_OVETH_AGEING */
 		0;
 }
 
+static int
+oveth_fill_info (struct sk_buff * skb, const struct net_device * dev)
+{
+	const struct oveth_dev * oveth = netdev_priv (dev);
+
+	if (nla_put_u32 (skb, IFLA_OVETH_VNI, oveth->vni) ||
+	    nla_put_u32 (skb, IFLA_OVETH_AGEING, oveth->age_lifetime / HZ))
+		return -EMSGSIZE;
+
+	return 0;
+}
+
 
 static const struct nla_policy oveth_policy[IFLA_OVETH_MAX + 1] = {
 	[IFLA_OVETH_VNI]	= { .type = NLA_U32, },
 	[IFLA_OVETH_TTL]	= { .type = NLA_U8, },
+	[IFLA_OVETH_AGEING]	= { .type = NLA_U32, },
 };
 
 static struct rtnl_link_ops oveth_link_ops __read_mostly = {
@@ -901,6 +1362,7 @@ static struct rtnl_link_ops oveth_link_ops __read_mostly = {
 	.newlink	= oveth_newlink,
 	.dellink	= oveth_dellink,
 	.get_size	= oveth_get_size,
+	.fill_info	= oveth_fill_info,
 };
 
 
@@ -933,9 +1395,8 @@ oveth_nl_cmd_fdb_add (struct sk_buff * skb, struct genl_info * info)
 	__be32 node_id;
 	u8 mac[ETH_ALEN];
 	struct net * net = genl_info_net (info);
+	int rc;
 	struct oveth_dev * oveth;
-	struct oveth_fdb * f;
-	struct oveth_fdb_node * fn;
 
 	if (!info->attrs[OVETH_ATTR_VNI] ||
 	    !info->attrs[OVETH_ATTR_NODE_ID] || 
@@ -953,21 +1414,11 @@ oveth_nl_cmd_fdb_add (struct sk_buff * skb, struct genl_info * info)
 		return -ENODEV;
 	}
 
-	f = find_oveth_fdb_by_mac (oveth, mac);
-	if (f == NULL) {
-		f = create_oveth_fdb (mac, GFP_KERNEL);
-		oveth_fdb_add (oveth, f);
-	}
-	
-	fn = oveth_fdb_find_node (f, node_id);
-	if (fn == NULL) {
-		fn = oveth_fdb_add_node (f, node_id, GFP_KERNEL);
-		fn->state |= NUD_PERMANENT;
-	} else {
-		return -EEXIST;
-	}
+	spin_lock_bh (&oveth->fdb_lock);
+	rc = oveth_fdb_update (oveth, mac, node_id, NUD_PERMANENT);
+	spin_unlock_bh (&oveth->fdb_lock);
 
-	return 0;
+	return rc;
 }
 
 static int
@@ -977,9 +1428,9 @@ oveth_nl_cmd_fdb_delete (struct sk_buff * skb, struct genl_info * info)
 	__be32 node_id;
 	u8 mac[ETH_ALEN];
 	struct net * net = genl_info_net (info);
+	int rc = -ENOENT;
 	struct oveth_dev * oveth;
 	struct oveth_fdb * f;
-	struct oveth_fdb_node * fn;
 
 	if (!info->attrs[OVETH_ATTR_VNI] ||
 	    !info->attrs[OVETH_ATTR_NODE_ID] || 
@@ -997,24 +1448,23 @@ oveth_nl_cmd_fdb_delete (struct sk_buff * skb, struct genl_info * info)
 		return -ENODEV;
 	}
 
-	if ((f = find_oveth_fdb_by_mac (oveth, mac)) == NULL) 
-		return -ENOENT;
-	
-	if ((fn = oveth_fdb_find_node (f, node_id)) == NULL) 
-		return -ENOENT;
-	 else 
-		oveth_fdb_del_node (f, node_id);
+	spin_lock_bh (&oveth->fdb_lock);
+	f = find_oveth_fdb_by_mac (oveth, mac);
+	if (f)
+		rc = oveth_fdb_del_node (oveth, f, node_id);
+	spin_unlock_bh (&oveth->fdb_lock);
 
-	return 0;
+	return rc < 0 ? rc : 0;
 }
 
 static int
 oveth_nl_fdb_node_send (struct sk_buff * skb, u32 pid, u32 seq, int flags,
-			  int cmd, u32 vni, struct oveth_fdb_node * fn)
+			  int cmd, u32 vni, struct oveth_fdb * f,
+			  struct oveth_fdb_node * fn)
 {
 	void * hdr;
 	
-	if (!skb || !fn)
+	if (!skb || !f || !fn)
 		return -1;
 
 	hdr = genlmsg_put (skb, pid, seq, &oveth_nl_family, flags, cmd);
@@ -1024,7 +1474,7 @@ oveth_nl_fdb_node_send (struct sk_buff * skb, u32 pid, u32 seq, int flags,
 
 	if (nla_put_u32 (skb, OVETH_ATTR_VNI, vni) ||
 	    nla_put_be32 (skb, OVETH_ATTR_NODE_ID, fn->node_id) ||
-	    nla_put (skb, OVETH_ATTR_MACADDR, ETH_ALEN, fn->fdb->eth_addr)) {
+	    nla_put (skb, OVETH_ATTR_MACADDR, ETH_ALEN, f->eth_addr)) {
 		goto err_out;
 	}
 
@@ -1049,6 +1499,7 @@ oveth_nl_cmd_fdb_dump (struct sk_buff * skb, struct netlink_callback * cb)
 	__u32 vni;
 	struct net * net = sock_net (skb->sk);
 	struct oveth_net * ovnet = net_generic (net, oveth_net_id);
+	unsigned int n, count;
 	struct oveth_dev * oveth, * oveth_next;
 	struct oveth_fdb * f;
 	struct oveth_fdb_node * fn;
@@ -1069,13 +1520,14 @@ oveth_nl_cmd_fdb_dump (struct sk_buff * skb, struct netlink_callback * cb)
 		if (idx != cb->args[1]) 
 			goto skip;
 
-		list_for_each_entry_rcu (fn, &(f->node_id_list), list) {
+		fn = oveth_fdb_nodes (f, &count);
+		for (n = 0; n < count; n++) {
 			oveth_nl_fdb_node_send (skb, 
 						NETLINK_CB (cb->skb).portid,
 						cb->nlh->nlmsg_seq,
 						NLM_F_MULTI,
 						OVETH_CMD_FDB_GET,
-						vni, fn);
+						vni, f, &fn[n]);
 		}
 		break;
 skip:
@@ -1099,6 +1551,82 @@ out:
 	return skb->len;
 }
 
+static void
+oveth_hash_stats_get (struct ov_hash * h, struct oveth_hash_stats * hs)
+{
+	unsigned int n, len;
+	struct ov_htable * t = ov_hash_table (h);
+
+	memset (hs, 0, sizeof (*hs));
+	hs->buckets = OV_HTABLE_SIZE (t);
+
+	for (n = 0; n < OV_HTABLE_SIZE (t); n++) {
+		len = ov_htable_bucket_len (t, n);
+		hs->entries += len;
+		if (len)
+			hs->used++;
+		if (len > hs->max_chain)
+			hs->max_chain = len;
+		hs->hist[min_t (unsigned int, len, OVETH_HASH_HIST - 1)]++;
+	}
+}
+
+static int
+oveth_nl_cmd_hash_get (struct sk_buff * skb, struct genl_info * info)
+{
+	int rc = -EMSGSIZE;
+	__u32 vni;
+	void * hdr;
+	struct net * net = genl_info_net (info);
+	struct oveth_net * ovnet = net_generic (net, oveth_net_id);
+	struct oveth_dev * oveth;
+	struct oveth_hash_stats hs;
+	struct sk_buff * reply;
+
+	reply = genlmsg_new (NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!reply)
+		return -ENOMEM;
+
+	hdr = genlmsg_put (reply, info->snd_portid, info->snd_seq,
+			   &oveth_nl_family, 0, OVETH_CMD_HASH_GET);
+	if (!hdr)
+		goto err_out;
+
+	/* chains are walked without locks, the numbers are a snapshot */
+	rcu_read_lock ();
+
+	oveth_hash_stats_get (&(ovnet->vni_hash), &hs);
+	if (nla_put (reply, OVETH_ATTR_VNI_HASH, sizeof (hs), &hs))
+		goto err_unlock;
+
+	if (info->attrs[OVETH_ATTR_VNI]) {
+		vni = nla_get_u32 (info->attrs[OVETH_ATTR_VNI]);
+		oveth = find_oveth_by_vni (net, vni);
+		if (oveth == NULL) {
+			pr_debug ("vni %u does not exists\n", vni);
+			rc = -ENODEV;
+			goto err_unlock;
+		}
+
+		oveth_hash_stats_get (&(oveth->fdb_hash), &hs);
+		if (nla_put_u32 (reply, OVETH_ATTR_VNI, vni) ||
+		    nla_put (reply, OVETH_ATTR_FDB_HASH, sizeof (hs), &hs))
+			goto err_unlock;
+	}
+
+	rcu_read_unlock ();
+
+	genlmsg_end (reply, hdr);
+
+	return genlmsg_reply (reply, info);
+
+err_unlock:
+	rcu_read_unlock ();
+err_out:
+	nlmsg_free (reply);
+	return rc;
+}
+
 static struct genl_ops oveth_nl_ops[] = {
 	{
 		.cmd = OVETH_CMD_FDB_ADD,
@@ -1118,6 +1646,11 @@ static struct genl_ops oveth_nl_ops[] = {
 		.dumpit = oveth_nl_cmd_fdb_dump,
 		.policy = oveth_nl_policy,
 	},
+	{
+		.cmd = OVETH_CMD_HASH_GET,
+		.doit = oveth_nl_cmd_hash_get,
+		.policy = oveth_nl_policy,
+	},
 };
 
 
@@ -1128,14 +1661,15 @@ static struct genl_ops oveth_nl_ops[] = {
 static __net_init int
 oveth_init_net (struct net * net)
 {
-	int rc, n;
+	int rc;
 	struct oveth_net * ovnet = net_generic (net, oveth_net_id);
 
 	memset (ovnet, 0, sizeof (struct oveth_net));
 
-	/* init vni list */
-	for (n = 0; n < VNI_HASH_SIZE; n++) 
-		INIT_LIST_HEAD (&(ovnet->vni_list[n]));
+	/* init vni table */
+	if (ov_hash_init (&(ovnet->vni_hash), VNI_HASH_MIN_BITS,
+			  VNI_HASH_MAX_BITS) < 0)
+		return -ENOMEM;
 	INIT_LIST_HEAD (&(ovnet->vni_chain));
 
 	/* register ovstack callback */
@@ -1143,8 +1677,10 @@ oveth_init_net (struct net * net)
 				       oveth_encap_recv);
 	if (!rc) {
 		printk (KERN_ERR "failed to register as ovstack app\n");
+		ov_hash_destroy (&(ovnet->vni_hash));
 		return -1;
 	}
+	ovstack_register_app_pmtu_ops (net, OVAPP_ETHERNET, oveth_pmtu_recv);
 
 	return 0;
 }
@@ -1154,12 +1690,23 @@ static __net_exit void
 oveth_exit_net (struct net * net)
 {
 	int rc;
+	struct oveth_net * ovnet = net_generic (net, oveth_net_id);
+	struct oveth_dev * oveth, * tmp;
+	LIST_HEAD (list);
 
 	rc = ovstack_unregister_app_ops (net, OVAPP_ETHERNET);
-	if (!rc) {
+	if (!rc)
 		printk (KERN_ERR "failed to unregister as ovstack app\n");
-		return;
-	}
+
+	/* devices must leave vni_hash before it is destroyed. default
+	 * device exit of the namespace runs after this. */
+	rtnl_lock ();
+	list_for_each_entry_safe (oveth, tmp, &(ovnet->vni_chain), chain)
+		oveth_dellink (oveth->dev, &list);
+	unregister_netdevice_many (&list);
+	rtnl_unlock ();
+
+	ov_hash_destroy (&(ovnet->vni_hash));
 
 	return;
 }
@@ -1185,6 +1732,12 @@ __init oveth_init_module (void)
 
 	get_random_bytes (&oveth_salt, sizeof (oveth_salt));
 
+	oveth_fdb_cache = kmem_cache_create ("oveth_fdb",
+					     sizeof (struct oveth_fdb), 0,
+					     SLAB_HWCACHE_ALIGN, NULL);
+	if (!oveth_fdb_cache)
+		return -ENOMEM;
+
 	rc = register_pernet_device (&oveth_net_ops);
 	if (rc != 0)
 		goto error_out;
@@ -1209,6 +1762,7 @@ genl_failed :
 link_failed :	 
 	unregister_pernet_device (&oveth_net_ops);
 error_out :
+	kmem_cache_destroy (oveth_fdb_cache);
 	return rc;
 
 }
@@ -1222,6 +1776,10 @@ __exit oveth_exit_module (void)
 	rtnl_link_unregister (&oveth_link_ops);
 	unregister_pernet_device (&oveth_net_ops);
 
+	/* wait for oveth_fdb_free_rcu () */
+	rcu_barrier ();
+	kmem_cache_destroy (oveth_fdb_cache);
+
 	printk (KERN_INFO "overlay ethernet driver "
 		"(version %s) is unloaded)\n", OVETH_VERSION);
 
@@ -11,6 +11,7 @@ enum {
 	IFLA_OVETH_UNSEPC,	
 	IFLA_OVETH_VNI,		/* 32bit number	(24bit)	*/
 	IFLA_OVETH_TTL,		/* 8bit ttl	*/
+	IFLA_OVETH_AGEING,	/* 32bit fdb lifetime in sec, 0 disables */
 	__IFLA_OVETH_MAX
 };
 
@@ -28,7 +29,10 @@ enum {
  * FDB_ADD			- vni, mac, node_id
  * FDB_DELETE			- vni, mac, node_id
  * OVETH_CMD_FDB_GET		- (vni?)
+ * OVETH_CMD_HASH_GET		- (vni?) : vni_hash, (vni, fdb_hash)
  *
+ * HASH_GET reports bucket occupancy of the vni table of the namespace,
+ * and of the fdb table of the device if vni is specified.
  */
 
 enum {
@@ -36,6 +40,7 @@ enum {
 	OVETH_CMD_FDB_DELETE,		/* mac, vni, node_id */
 	OVETH_CMD_FDB_GET,		/* none : vni, mac, node_id */
 	OVETH_CMD_EVENT,		/* event (which is kicked by kmod) */
+	OVETH_CMD_HASH_GET,		/* vni? : vni_hash, fdb_hash */
 	__OVETH_CMD_MAX,
 };
 
@@ -50,11 +55,25 @@ enum {
 	OVETH_ATTR_VNI,			/* 32bit vni  */
 	OVETH_ATTR_MACADDR,		/* 48bit mac address */
 	OVETH_ATTR_EVENT,		/* oveth_genl_event */
+	OVETH_ATTR_VNI_HASH,		/* struct oveth_hash_stats */
+	OVETH_ATTR_FDB_HASH,		/* struct oveth_hash_stats */
 	__OVETH_ATTR_MAX,
 };
 
 #define OVETH_ATTR_MAX	(__OVETH_ATTR_MAX - 1)
 
+/* bucket occupancy of a hash table. hist[n] is the number of buckets
+ * which have n entries, and the last one counts longer chains too. */
+#define OVETH_HASH_HIST	8
+
+struct oveth_hash_stats {
+	__u32	buckets;
+	__u32	entries;
+	__u32	used;			/* non-empty buckets */
+	__u32	max_chain;
+	__u32	hist[OVETH_HASH_HIST];
+};
+
 /*
  * NETLINK_GENERIC related info
  */
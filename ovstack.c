@@ -2,19 +2,26 @@
  * Overlay Routing Stack 
  */
 
-#ifndef DEBUG
-#define DEBUG
-#endif
-
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/version.h>
+#include <linux/etherdevice.h>
 #include <linux/string.h>
 #include <linux/rculist.h>
 #include <linux/hash.h>
+#include <linux/jhash.h>
 #include <linux/udp.h>
+#include <linux/percpu.h>
+#include <linux/in6.h>
+#include <linux/icmpv6.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/workqueue.h>
 #include <net/protocol.h>
 #include <net/udp.h>
+#include <net/icmp.h>
+#include <net/ipv6.h>
 #include <net/sock.h>
+#include <net/dst.h>
 #include <net/route.h>
 #include <net/ip6_route.h>
 #include <net/net_namespace.h>
@@ -25,6 +32,14 @@
 
 #include "ovstack.h"
 #include "ovstack_netlink.h"
+#include "ov_hash.h"
+
+#define CREATE_TRACE_POINTS
+#include "ovstack_trace.h"
+
+/* oveth events are defined here, and fired by oveth module */
+EXPORT_TRACEPOINT_SYMBOL_GPL (oveth_xmit);
+EXPORT_TRACEPOINT_SYMBOL_GPL (oveth_encap_recv);
 
 #define OVSTACK_VERSION "0.0.3"
 MODULE_VERSION (OVSTACK_VERSION);
@@ -32,31 +47,78 @@ MODULE_LICENSE ("GPL");
 MODULE_AUTHOR ("upa@haeena.net");
 
 
-#define LIB_HASH_BITS	8
-#define ORT_HASH_BITS	8
-
-#define LIB_HASH_SIZE	(1 << LIB_HASH_BITS)
-#define ORT_HASH_SIZE	(1 << ORT_HASH_BITS)
+/* node and routing tables are resized between 2^min and 2^max buckets */
+#define LIB_HASH_MIN_BITS	4
+#define LIB_HASH_MAX_BITS	22
+#define ORT_HASH_MIN_BITS	4
+#define ORT_HASH_MAX_BITS	22
 
 #define OVSTACK_DEFAULT_WEIGHT 50
 
 /* IP. OVHDR is already pushed by upper driver */
 #define OVSTACK_IPV4_HEADROOM (20)
 #define OVSTACK_IPV6_HEADROOM (40)
+#define OVSTACK_UDP_HEADROOM (8)
+
+/* TTL and hop limit of outer IP headers */
+#define OVSTACK_OUTER_TTL	16
+
+/* headroom of replicas, enough for any locator and link layer */
+#define OVSTACK_REPLICA_HEADROOM \
+	(LL_MAX_HEADER + OVSTACK_IPV6_HEADROOM + OVSTACK_UDP_HEADROOM)
+
+/* next hop of a replica queued in ovstack_xmit () */
+struct ovstack_xmit_cb {
+	struct ortable_plan_nexthop * pnxt;
+};
+#define OVSTACK_XMIT_CB(skb) ((struct ovstack_xmit_cb *)(skb)->cb)
+
+/* detection time of locator probing is interval * multi */
+#define OVSTACK_PROBE_DEFAULT_MULTI	3
+
+/* source ports of UDP encapsulation, derived from ovhdr hash */
+#define OVSTACK_UDP_SPORT_MIN	49152
+#define OVSTACK_UDP_SPORT_MAX	65535
 
 static unsigned int ovstack_net_id;
 static u32 ovstack_salt __read_mostly;
 static unsigned long ovstack_event_seqnum __read_mostly;
 
 
+/*
+ * Maglev style locator selection table. Each locator fills slots in the
+ * order of its own permutation of the table, in proportion to its
+ * weight. A flow is mapped to slots[hash % OV_MAGLEV_SIZE], so that
+ * selection is O(1) and adding, deleting or reweighting a locator moves
+ * only flows of the slots that change the owner.
+ */
+#define OV_MAGLEV_SIZE		509	/* prime */
+#define OV_MAGLEV_MAX		255	/* entries indexed by u8 */
+#define OV_MAGLEV_EMPTY		0xFF
+
+enum {
+	OV_LOC_TABLE_IPV4,
+	OV_LOC_TABLE_IPV6,
+	OV_LOC_TABLE_ANY,	/* only when both families exist */
+	OV_LOC_TABLE_MAX
+};
+
+struct ov_loc_table {
+	struct rcu_head		rcu;
+	unsigned int		count;
+	u8			slots[OV_MAGLEV_SIZE];	/* if count > 1 */
+	struct ov_locator	* locs[0];
+};
+
 /* Overlay Node */
 struct ov_node {
-	struct list_head	list;
+	struct ov_hnode		hnode;
 	struct list_head	chain;
 	struct rcu_head		rcu;
 	unsigned long 		update;
 
 	__be32			node_id;
+	unsigned int		refcnt;		/* referred by route next hops */
 
 	struct list_head	ipv4_locator_list;
 	u8			ipv4_locator_count;
@@ -65,7 +127,12 @@ struct ov_node {
 	struct list_head	ipv6_locator_list;
 	u8			ipv6_locator_count;
 	u32			ipv6_locator_weight_sum;
+
+	/* locator selection tables, see find_ov_locator_by_hash () */
+	struct ov_loc_table __rcu * loc_table[OV_LOC_TABLE_MAX];
 };
+#define OV_NODE_NO_LOCATOR	AF_MAX	/* ov_node_loc_family () */
+
 #define OV_NODE_NEXT(ovnode) \
 	list_entry_rcu (ovnode->chain.next, struct ov_node, chain)
 
@@ -89,15 +156,75 @@ struct ov_node {
 			break;				\
 	}						\
 
+/*
+ * underlay dst cache. route of a (src locator, dst locator) pair is
+ * stable, so dst locator caches dst_entry per cpu for a few src locators
+ * (direct mapped by src address). Entries are validated by dst_check ().
+ */
+#define OV_DST_CACHE_BITS	2
+#define OV_DST_CACHE_SIZE	(1 << OV_DST_CACHE_BITS)
+
+struct ov_dst_cache_entry {
+	struct dst_entry	* dst;
+	u32			cookie;
+	union {
+		__be32		__src_addr4[1];
+		__be32		__src_addr6[4];
+	} src_ip;
+};
+
+struct ov_dst_cache {
+	struct ov_dst_cache_entry entry[OV_DST_CACHE_SIZE];
+};
+
+/* per cpu datapath stats of a locator */
+struct ov_locator_pcpu_stats {
+	u64	tx_packets;
+	u64	tx_bytes;
+	u64	tx_errors;
+	u64	rx_packets;
+	u64	rx_bytes;
+	struct u64_stats_sync	syncp;
+};
+
+#define OV_LOCATOR_STATS_ADD(loc, pkts, bytes, len)			\
+	do {								\
+		struct ov_locator_pcpu_stats * _s =			\
+			this_cpu_ptr ((loc)->stats);			\
+		u64_stats_update_begin (&_s->syncp);			\
+		_s->pkts++;						\
+		_s->bytes += (len);					\
+		u64_stats_update_end (&_s->syncp);			\
+	} while (0)
+
+#define OV_LOCATOR_STATS_INC(loc, cnt)					\
+	do {								\
+		struct ov_locator_pcpu_stats * _s =			\
+			this_cpu_ptr ((loc)->stats);			\
+		u64_stats_update_begin (&_s->syncp);			\
+		_s->cnt++;						\
+		u64_stats_update_end (&_s->syncp);			\
+	} while (0)
+
 /* Locator */
 struct ov_locator {
 	struct list_head	list;
 	struct rcu_head		rcu;
 
+	struct ov_dst_cache __percpu * dst_cache;	/* as dst locator */
+	struct ov_locator_pcpu_stats __percpu * stats;
+	u8			encap;		/* OVSTACK_ENCAP_* */
+
 	struct ov_node		* node;		/* parent node */
 	u8			remote_ip_family;
 	u8			priority;
 	u8			weight;
+	u8			eff_weight;	/* weight in locator tables */
+	u8			flags;		/* OVSTACK_LOCATOR_F_* */
+	unsigned long		probe_rx;	/* jiffies of last probe reply */
+	unsigned int		pmtu;		/* path MTU seen as dst locator */
+	u64			adapt_tx_packets; /* at last adaptive run */
+	u64			adapt_tx_errors;
 	union {
 		__be32		__loc_addr4[1];
 		__be32		__loc_addr6[4];
@@ -110,13 +237,16 @@ struct ov_locator {
 
 /* Overlay Routing Table */
 struct ortable {
-	struct list_head	list;
+	struct ov_hnode		hnode;
 	struct list_head	chain;
 	struct rcu_head		rcu;
 	
 	__be32			ort_dst;	/* destination node id */
+	u8			mode;		/* OVSTACK_ROUTE_MODE_* */
 	unsigned long		ort_nxt_count;	/* number of nexthops */
 	struct list_head	ort_nxts;	/* next hop list */
+
+	struct ortable_plan __rcu * plan;	/* compiled for xmit */
 };
 
 struct ortable_nexthop {
@@ -124,22 +254,112 @@ struct ortable_nexthop {
 	struct rcu_head		rcu;
 	struct ortable		* ort;
 	__be32			ort_nxt;	/* next hop node id */
+	struct ov_node		* node;		/* next hop node (refcnt held) */
+	u8			weight;		/* for OVSTACK_ROUTE_MODE_ECMP */
 };
 #define ort_nxt_dst ort->ort_dst
 
+/*
+ * xmit plan. ortable_nexthop list is compiled to a flat array of resolved
+ * next hop nodes when control plane changes the route, own node id or
+ * own locators. ovstack_xmit () reads it under RCU, so that per packet
+ * cost is one find_ortable () and an array index.
+ */
+struct ortable_plan_nexthop {
+	__be32			nxt;		/* next hop node id */
+	struct ov_node		* node;		/* resolved next hop node */
+	u8			flags;
+};
+#define ORT_PLAN_NXT_OWN	0x01	/* next hop is own node */
+
+/*
+ * replicate plan sends a packet to all next hops. ecmp plan sends it to
+ * nxts[slots[hash]], a maglev table of next hops built as locator tables.
+ */
+struct ortable_plan {
+	struct rcu_head		rcu;
+	u8			family;		/* src locator family */
+	u8			mode;		/* OVSTACK_ROUTE_MODE_* */
+	u8			* slots;	/* ecmp and nxt_count > 1 */
+	unsigned int		nxt_count;
+	struct ortable_plan_nexthop nxts[0];
+};
+
+/*
+ * routing table of an application. Control plane can fill a staging
+ * table aside and publish it by one pointer swap (ortable_commit ()), so
+ * that readers see either the old or the new table, never a mix of them.
+ */
+struct ortable_set {
+	struct ov_hash		hash;
+	struct list_head	chain;
+};
+
+/* per cpu datapath stats of an application */
+struct ovstack_app_pcpu_stats {
+	u64	rx_packets;
+	u64	rx_bytes;
+	u64	tx_packets;
+	u64	tx_bytes;
+	u64	fwd_packets;
+	u64	fwd_bytes;
+	u64	local_packets;
+	u64	local_bytes;
+	u64	mcast_replicas;
+	u64	rx_dropped;
+	u64	tx_dropped;
+	struct u64_stats_sync	syncp;
+};
+
+#define OVSTACK_APP_STATS_ADD(ovapp, pkts, bytes, len)			\
+	do {								\
+		struct ovstack_app_pcpu_stats * _s =			\
+			this_cpu_ptr ((ovapp)->stats);			\
+		u64_stats_update_begin (&_s->syncp);			\
+		_s->pkts++;						\
+		_s->bytes += (len);					\
+		u64_stats_update_end (&_s->syncp);			\
+	} while (0)
+
+#define OVSTACK_APP_STATS_INC(ovapp, cnt)				\
+	do {								\
+		struct ovstack_app_pcpu_stats * _s =			\
+			this_cpu_ptr ((ovapp)->stats);			\
+		u64_stats_update_begin (&_s->syncp);			\
+		_s->cnt++;						\
+		u64_stats_update_end (&_s->syncp);			\
+	} while (0)
+
 /* Ovelay Network Application */
 struct ovstack_app {
 
 	u8     ov_app;			/* application number */
+	struct net * net;
 	struct ovstack_net * ovnet;
 	struct ov_node * own_node;			/* self */
-	struct list_head ortable_list[ORT_HASH_SIZE];	/* routing table */
-	struct list_head ortable_chain;			/* rtable chain  */
-	struct list_head node_list[LIB_HASH_SIZE];	/* node list hash */
+	u8     encap;			/* OVSTACK_ENCAP_RAW or _UDP */
+	struct ortable_set __rcu * ortables;		/* routing table */
+	struct ortable_set * ortables_staging;		/* next routing table */
+	struct ov_hash node_hash;			/* node hash */
 	struct list_head node_chain;			/* node chain */
 
+	struct ovstack_app_pcpu_stats __percpu * stats;	/* datapath stats */
+
+	/* locator liveness probing, see ovstack_probe_work () */
+	struct delayed_work probe_work;
+	u32    probe_interval;		/* msec, 0 is disabled */
+	u8     probe_multi;
+	u32    probe_seq;
+
+	/* load-aware locator weights, see ovstack_adapt_work () */
+	struct delayed_work adapt_work;
+	u32    adapt_interval;		/* msec, 0 is disabled */
+
 	/* callback function for when a app's packet is received */
 	int (* app_recv_ops) (struct sk_buff * skb);
+
+	/* callback function for when a app's packet exceeds path MTU */
+	int (* app_pmtu_ops) (struct sk_buff * skb, unsigned int mtu);
 };
 
 #define OVSTACK_APP_OWNNODE(app) (app->own_node)
@@ -163,31 +383,376 @@ struct ovstack_app {
 		}							\
 	} while (0)							\
 
-#define OVSTACK_APP_FIRSTROUTE(app)					\
-	((app->ortable_chain.next == &app->ortable_chain) ? NULL :	\
-	 (list_entry_rcu (app->ortable_chain.next, struct ortable, chain)))
+#define OVSTACK_APP_ORTABLES(app) (rcu_dereference_raw ((app)->ortables))
 
-#define OVSTACK_APP_LASTROUTE(app)					\
-	((app->ortable_chain.prev == &app->ortable_chain) ? NULL :	\
-	 (list_entry_rcu (app->ortable_chain.prev, struct ortable, chain)))
+#define OVSTACK_ORTABLES_FIRSTROUTE(ors)				\
+	((ors->chain.next == &ors->chain) ? NULL :			\
+	 (list_entry_rcu (ors->chain.next, struct ortable, chain)))
+
+#define OVSTACK_ORTABLES_LASTROUTE(ors)					\
+	((ors->chain.prev == &ors->chain) ? NULL :			\
+	 (list_entry_rcu (ors->chain.prev, struct ortable, chain)))
 
 
 
 /* per network namespace structure */
 struct ovstack_net {
 	struct ovstack_app * apps[OVSTACK_APP_MAX + 1];	/* ov applications */
+	struct socket * sock4;			/* UDP encap, OVSTACK_PORT */
+	struct socket * sock6;
 };
 #define OVSTACK_NET_APP(ovnet, ovapp) (ovnet->apps[ovapp])
 
 
+/*****************************
+ ****	drop accounting
+ *****************************/
+
+/* per cpu drop counters, indexed by OVSTACK_DROP_* */
+struct ovstack_drop_pcpu_stats {
+	u64	drops[OVSTACK_DROP_MAX];
+	struct u64_stats_sync	syncp;
+};
+
+static DEFINE_PER_CPU (struct ovstack_drop_pcpu_stats, ovstack_drop_stats);
+
+static bool log_drops __read_mostly;
+module_param (log_drops, bool, 0644);
+MODULE_PARM_DESC (log_drops, "Log dropped packets (rate limited)");
+
+#define OVSTACK_DROP_NAME(reason, name) [OVSTACK_DROP_##reason] = name,
+
+static const char * const ovstack_drop_names[OVSTACK_DROP_MAX] = {
+	OVSTACK_DROP_REASONS (OVSTACK_DROP_NAME)
+};
+
+/*
+ * called by ovstack_drop () before the packet is freed. drops are always
+ * counted and traced, and logged only when log_drops is set.
+ */
+void
+ovstack_drop_account (struct sk_buff * skb, struct ovhdr * ovh,
+		      int reason, unsigned long location)
+{
+	struct ovstack_drop_pcpu_stats * stats;
+
+	if (unlikely (reason < 0 || reason >= OVSTACK_DROP_MAX))
+		return;
+
+	stats = this_cpu_ptr (&ovstack_drop_stats);
+	u64_stats_update_begin (&stats->syncp);
+	stats->drops[reason]++;
+	u64_stats_update_end (&stats->syncp);
+
+	trace_ovstack_drop (skb, ovh, reason, location);
+
+	if (!log_drops)
+		return;
+
+	if (ovh)
+		net_info_ratelimited ("ovstack: drop %s at %pS, app %u "
+				      "vni %u dst %pI4 src %pI4 ttl %u\n",
+				      ovstack_drop_names[reason],
+				      (void *) location, ovh->ov_app,
+				      ovh_vni (ovh), &ovh->ov_dst,
+				      &ovh->ov_src, ovh->ov_ttl);
+	else
+		net_info_ratelimited ("ovstack: drop %s at %pS\n",
+				      ovstack_drop_names[reason],
+				      (void *) location);
+}
+EXPORT_SYMBOL (ovstack_drop_account);
+
+static void
+ovstack_drop_stats_get (u64 * sum)
+{
+	int n;
+	unsigned int cpu;
+	struct ovstack_drop_pcpu_stats tmp;
+
+	memset (sum, 0, sizeof (u64) * OVSTACK_DROP_MAX);
+
+	for_each_possible_cpu (cpu) {
+		unsigned int start;
+		const struct ovstack_drop_pcpu_stats * stats
+			= &per_cpu (ovstack_drop_stats, cpu);
+
+		do {
+			start = u64_stats_fetch_begin_bh (&stats->syncp);
+			memcpy (&tmp, stats, sizeof (tmp));
+		} while (u64_stats_fetch_retry_bh (&stats->syncp, start));
+
+		for (n = 0; n < OVSTACK_DROP_MAX; n++)
+			sum[n] += tmp.drops[n];
+	}
+}
+
+
 /*****************************
  ****	node and locator operations
  *****************************/
 
-static inline struct list_head *
-node_head (struct ovstack_app * ovapp, __be32 node_id)
+static struct ov_locator *
+ov_locator_create (u8 ai_family, __be32 * addr, u8 weight)
+{
+	struct ov_locator * loc;
+
+	loc = kmalloc (sizeof (struct ov_locator), GFP_KERNEL);
+	if (!loc)
+		return NULL;
+	memset (loc, 0, sizeof (struct ov_locator));
+
+	loc->dst_cache = alloc_percpu (struct ov_dst_cache);
+	if (!loc->dst_cache) {
+		kfree (loc);
+		return NULL;
+	}
+
+	loc->stats = alloc_percpu (struct ov_locator_pcpu_stats);
+	if (!loc->stats) {
+		free_percpu (loc->dst_cache);
+		kfree (loc);
+		return NULL;
+	}
+
+	loc->remote_ip_family = ai_family;
+	loc->weight = weight;
+	loc->eff_weight = weight;
+	loc->probe_rx = jiffies;
+	memcpy (&loc->remote_ip, addr, 
+		(ai_family == AF_INET) ? sizeof (struct in_addr) :
+		sizeof (struct in6_addr));
+
+	return loc;
+}
+
+static void
+ov_locator_free_rcu (struct rcu_head * head)
+{
+	int cpu, n;
+	struct ov_dst_cache * dc;
+	struct ov_locator * loc = container_of (head, struct ov_locator, rcu);
+
+	for_each_possible_cpu (cpu) {
+		dc = per_cpu_ptr (loc->dst_cache, cpu);
+		for (n = 0; n < OV_DST_CACHE_SIZE; n++)
+			dst_release (dc->entry[n].dst);
+	}
+	free_percpu (loc->dst_cache);
+	free_percpu (loc->stats);
+	kfree (loc);
+
+	return;
+}
+
+static void
+ov_locator_destroy (struct ov_locator * loc)
+{
+	call_rcu (&(loc->rcu), ov_locator_free_rcu);
+	return;
+}
+
+/* fill slots with index of entries. keys and weights have n entries. */
+static int
+ov_maglev_build (u8 * slots, unsigned int n, u32 * keys, u8 * weights,
+		 gfp_t gfp)
+{
+	u32 * offset, * skip, * next, * credit;
+	unsigned int i, c, filled, max_weight;
+
+	if (n == 0 || n > OV_MAGLEV_MAX)
+		return -EINVAL;
+
+	offset = kmalloc (sizeof (u32) * n * 4, gfp);
+	if (!offset)
+		return -ENOMEM;
+	skip = offset + n;
+	next = skip + n;
+	credit = next + n;
+
+	max_weight = 0;
+	for (i = 0; i < n; i++) {
+		offset[i] = keys[i] % OV_MAGLEV_SIZE;
+		skip[i] = jhash_1word (keys[i], OV_MAGLEV_SIZE) %
+			(OV_MAGLEV_SIZE - 1) + 1;
+		next[i] = 0;
+		credit[i] = 0;
+		if (weights[i] > max_weight)
+			max_weight = weights[i];
+	}
+
+	/* all entries have weight 0, so they are equal */
+	if (max_weight == 0) {
+		for (i = 0; i < n; i++)
+			weights[i] = 1;
+		max_weight = 1;
+	}
+
+	memset (slots, OV_MAGLEV_EMPTY, OV_MAGLEV_SIZE);
+	filled = 0;
+
+	/* an entry takes a turn each time its credit reaches max weight */
+	while (1) {
+		for (i = 0; i < n; i++) {
+			credit[i] += weights[i];
+			while (credit[i] >= max_weight) {
+				credit[i] -= max_weight;
+				do {
+					c = (offset[i] + next[i] * skip[i]) %
+						OV_MAGLEV_SIZE;
+					next[i]++;
+				} while (slots[c] != OV_MAGLEV_EMPTY);
+
+				slots[c] = i;
+				if (++filled == OV_MAGLEV_SIZE)
+					goto out;
+			}
+		}
+	}
+
+out:
+	kfree (offset);
+	return 0;
+}
+
+static inline u32
+ov_locator_key (struct ov_locator * loc)
+{
+	if (loc->remote_ip_family == AF_INET)
+		return jhash_1word (loc->remote_ip4[0], 0);
+
+	return jhash2 (loc->remote_ip6, 4, 0);
+}
+
+/* true if any locator of the table type is not marked down by probes */
+static bool
+ov_loc_table_has_up (struct ov_node * node, int type)
+{
+	struct ov_locator * loc;
+
+	if (type != OV_LOC_TABLE_IPV6) {
+		list_for_each_entry (loc, &(node->ipv4_locator_list), list) {
+			if (!(loc->flags & OVSTACK_LOCATOR_F_DOWN))
+				return true;
+		}
+	}
+	if (type != OV_LOC_TABLE_IPV4) {
+		list_for_each_entry (loc, &(node->ipv6_locator_list), list) {
+			if (!(loc->flags & OVSTACK_LOCATOR_F_DOWN))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * locators marked down are left out of the table. If all of them are
+ * down, all are used, because probes may be lost while data is not.
+ */
+static struct ov_loc_table *
+ov_loc_table_build (struct ov_node * node, int type, gfp_t gfp)
+{
+	int rc;
+	bool skip_down;
+	unsigned int n, count;
+	u32 * keys;
+	u8 * weights;
+	struct ov_locator * loc;
+	struct ov_loc_table * t;
+
+	switch (type) {
+	case OV_LOC_TABLE_IPV4 :
+		count = node->ipv4_locator_count;
+		break;
+	case OV_LOC_TABLE_IPV6 :
+		count = node->ipv6_locator_count;
+		break;
+	default :
+		if (!node->ipv4_locator_count || !node->ipv6_locator_count)
+			return NULL;
+		count = node->ipv4_locator_count + node->ipv6_locator_count;
+	}
+
+	if (count == 0)
+		return NULL;
+	if (count > OV_MAGLEV_MAX)
+		count = OV_MAGLEV_MAX;
+
+	t = kmalloc (sizeof (struct ov_loc_table) + 
+		     sizeof (struct ov_locator *) * count, gfp);
+	if (!t)
+		return NULL;
+
+	skip_down = ov_loc_table_has_up (node, type);
+
+	n = 0;
+	if (type != OV_LOC_TABLE_IPV6) {
+		list_for_each_entry (loc, &(node->ipv4_locator_list), list) {
+			if (n == count)
+				break;
+			if (skip_down && (loc->flags & OVSTACK_LOCATOR_F_DOWN))
+				continue;
+			t->locs[n++] = loc;
+		}
+	}
+	if (type != OV_LOC_TABLE_IPV4) {
+		list_for_each_entry (loc, &(node->ipv6_locator_list), list) {
+			if (n == count)
+				break;
+			if (skip_down && (loc->flags & OVSTACK_LOCATOR_F_DOWN))
+				continue;
+			t->locs[n++] = loc;
+		}
+	}
+	count = n;
+	t->count = count;
+
+	if (count == 1)
+		return t;
+
+	keys = kmalloc ((sizeof (u32) + sizeof (u8)) * count, gfp);
+	if (!keys) {
+		kfree (t);
+		return NULL;
+	}
+	weights = (u8 *)(keys + count);
+
+	for (n = 0; n < count; n++) {
+		keys[n] = ov_locator_key (t->locs[n]);
+		weights[n] = t->locs[n]->eff_weight;
+	}
+
+	rc = ov_maglev_build (t->slots, count, keys, weights, gfp);
+	kfree (keys);
+	if (rc < 0) {
+		kfree (t);
+		return NULL;
+	}
+
+	return t;
+}
+
+/* 
+ * rebuild locator tables of the node. If a table can not be allocated,
+ * no locator is selected from the family until next update, because old
+ * table may have a deleted locator.
+ */
+static void
+ov_node_loc_table_update (struct ov_node * node, gfp_t gfp)
 {
-	return &(ovapp->node_list[hash_32 (node_id, LIB_HASH_BITS)]);
+	int type;
+	struct ov_loc_table * t, * old;
+
+	for (type = 0; type < OV_LOC_TABLE_MAX; type++) {
+		t = ov_loc_table_build (node, type, gfp);
+		old = rcu_dereference_raw (node->loc_table[type]);
+		rcu_assign_pointer (node->loc_table[type], t);
+		if (old)
+			kfree_rcu (old, rcu);
+	}
+
+	return;
 }
 
 static inline struct ov_node * 
@@ -196,6 +761,8 @@ ov_node_create (__be32 node_id)
 	struct ov_node * node;
 
 	node = kmalloc (sizeof (struct ov_node), GFP_KERNEL);
+	if (!node)
+		return NULL;
 	memset (node, 0, sizeof (struct ov_node));
 	INIT_LIST_HEAD (&(node->ipv4_locator_list));
 	INIT_LIST_HEAD (&(node->ipv6_locator_list));
@@ -206,22 +773,39 @@ ov_node_create (__be32 node_id)
 }
 
 static void
-ov_node_destroy (struct ov_node * node)
+ov_node_flush_locators (struct ov_node * node)
 {
 	struct list_head * p, * tmp;
 	struct ov_locator * loc;
 
+	/* unpublish the tables before the grace period of locators
+	 * starts. With no locators counted, the tables are empty. */
+	node->ipv4_locator_count = 0;
+	node->ipv4_locator_weight_sum = 0;
+	node->ipv6_locator_count = 0;
+	node->ipv6_locator_weight_sum = 0;
+	node->update = jiffies;
+
+	ov_node_loc_table_update (node, GFP_KERNEL);
+
 	list_for_each_safe (p, tmp, &(node->ipv4_locator_list)) {
 		loc = list_entry (p, struct ov_locator, list);
 		list_del_rcu (p);
-		kfree_rcu (loc, rcu);
+		ov_locator_destroy (loc);
 	}
 	list_for_each_safe (p, tmp, &(node->ipv6_locator_list)) {
 		loc = list_entry (p, struct ov_locator, list);
 		list_del_rcu (p);
-		kfree_rcu (loc, rcu);
+		ov_locator_destroy (loc);
 	}
-	
+
+	return;
+}
+
+static void
+ov_node_destroy (struct ov_node * node)
+{
+	ov_node_flush_locators (node);
 	kfree_rcu (node, rcu);
 
 	return;
@@ -230,17 +814,19 @@ ov_node_destroy (struct ov_node * node)
 static inline void
 ov_node_add (struct ovstack_app * ovapp, struct ov_node * node)
 {
-	list_add_rcu (&(node->list), node_head (ovapp, node->node_id));
+	ov_hash_insert (&(ovapp->node_hash), &(node->hnode), node->node_id);
 	list_add_rcu (&(node->chain), &(ovapp->node_chain));
+	ov_hash_adjust (&(ovapp->node_hash));
 	return;
 }
 
 static inline void
-ov_node_delete (struct ov_node * node) 
+ov_node_delete (struct ovstack_app * ovapp, struct ov_node * node) 
 {
-	list_del_rcu (&(node->list));
+	ov_hash_remove (&(ovapp->node_hash), &(node->hnode));
 	list_del_rcu (&(node->chain));
 	ov_node_destroy (node);
+	ov_hash_adjust (&(ovapp->node_hash));
 	return;
 }
 
@@ -248,8 +834,9 @@ static struct ov_node *
 find_ov_node_by_id (struct ovstack_app * ovapp, __be32 node_id)
 {
 	struct ov_node * node;
+	struct ov_htable * t = ov_hash_table (&(ovapp->node_hash));
 
-	list_for_each_entry_rcu (node, node_head (ovapp, node_id), list) {
+	ov_htable_for_each_possible_rcu (t, node, hnode, node_id) {
 		if (node->node_id == node_id)
 			return node;
 	}
@@ -257,6 +844,29 @@ find_ov_node_by_id (struct ovstack_app * ovapp, __be32 node_id)
 	return NULL;
 }
 
+/* node referred by route next hops is kept as a shell without locators */
+static inline void
+ov_node_put (struct ovstack_app * ovapp, struct ov_node * node)
+{
+	if (--node->refcnt == 0 &&
+	    node->ipv4_locator_count == 0 && node->ipv6_locator_count == 0)
+		ov_node_delete (ovapp, node);
+	return;
+}
+
+static inline u8
+ov_node_loc_family (struct ov_node * node)
+{
+	if (node->ipv4_locator_count && node->ipv6_locator_count)
+		return AF_UNSPEC;
+	if (node->ipv4_locator_count)
+		return AF_INET;
+	if (node->ipv6_locator_count)
+		return AF_INET6;
+
+	return OV_NODE_NO_LOCATOR;
+}
+
 static struct ov_locator *
 find_ov_locator_by_addr (struct ov_node * node, __be32 * addr, u8 ai_family)
 {
@@ -274,7 +884,7 @@ find_ov_locator_by_addr (struct ov_node * node, __be32 * addr, u8 ai_family)
 			if (memcmp (addr, loc->remote_ip4, 4) == 0)
 				return loc;
 		} else 
-			if (memcmp (addr, loc->remote_ip6, 6) == 0)
+			if (memcmp (addr, loc->remote_ip6, 16) == 0)
 				return loc;
 	}
 
@@ -284,48 +894,35 @@ find_ov_locator_by_addr (struct ov_node * node, __be32 * addr, u8 ai_family)
 static struct ov_locator *
 find_ov_locator_by_hash (struct ov_node * node, u32 hash, u8 ai_family)
 {
-	struct list_head * li;
-	struct ov_locator * loc;
-
-	if (node->ipv4_locator_count == 0 && node->ipv6_locator_count == 0)
-		return NULL;
-
-	/* both */
-	if (ai_family == AF_UNSPEC) {
-		hash %= (node->ipv4_locator_weight_sum + 
-			 node->ipv6_locator_weight_sum);
-		li = &(node->ipv4_locator_list);
-		list_for_each_entry_rcu (loc, li, list) {
-			if (hash <= loc->weight)
-				return loc;
-			hash -= loc->weight;
-		}
-		li = &(node->ipv6_locator_list);
-		list_for_each_entry_rcu (loc, li, list) {
-			if (hash <= loc->weight)
-				return loc;
-			hash -= loc->weight;
-		}
+	struct ov_loc_table * t;
+
+	switch (ai_family) {
+	case AF_INET :
+		t = rcu_dereference_raw (node->loc_table[OV_LOC_TABLE_IPV4]);
+		break;
+	case AF_INET6 :
+		t = rcu_dereference_raw (node->loc_table[OV_LOC_TABLE_IPV6]);
+		break;
+	case AF_UNSPEC :
+		t = rcu_dereference_raw (node->loc_table[OV_LOC_TABLE_ANY]);
+		if (t)
+			break;
+		t = rcu_dereference_raw (node->loc_table[OV_LOC_TABLE_IPV4]);
+		if (t)
+			break;
+		t = rcu_dereference_raw (node->loc_table[OV_LOC_TABLE_IPV6]);
+		break;
+	default :
 		return NULL;
 	}
 
-	/* ipv4 or ipv6 */
-	if (ai_family == AF_INET && node->ipv4_locator_count) {
-		li = &(node->ipv4_locator_list);
-		hash %=	node->ipv4_locator_weight_sum;
-	} else if (ai_family == AF_INET6 && node->ipv6_locator_count) {
-		li = &(node->ipv6_locator_list);
-		hash %=	node->ipv6_locator_weight_sum;
-	} else 
+	if (!t)
 		return NULL;
-	
-	list_for_each_entry_rcu (loc, li, list) {
-		if (hash <= loc->weight)
-			return loc;
-		hash -= loc->weight;
-	}
 
-	return NULL;
+	if (t->count == 1)
+		return t->locs[0];
+
+	return t->locs[t->slots[hash % OV_MAGLEV_SIZE]];
 }
 
 static void
@@ -342,6 +939,7 @@ ov_locator_add (struct ov_node * node, struct ov_locator * loc)
 	OV_NODE_LOC_WEIGHT_OPERATION (node, loc->remote_ip_family, 
 				      loc->weight);
 	node->update = jiffies;
+	ov_node_loc_table_update (node, GFP_KERNEL);
 
 	return;
 }
@@ -355,6 +953,7 @@ ov_locator_delete (struct ov_node * node, struct ov_locator * loc)
 	OV_NODE_LOC_WEIGHT_OPERATION (node, loc->remote_ip_family, 
 				      -loc->weight);
 	node->update = jiffies;
+	ov_node_loc_table_update (node, GFP_KERNEL);
 
 	return;
 }
@@ -374,6 +973,8 @@ ov_locator_weight_set (struct ov_locator * loc, u8 weight)
 	OV_NODE_LOC_WEIGHT_OPERATION (node, loc->remote_ip_family,
 				      -loc->weight);
 	loc->weight = weight;
+	loc->eff_weight = weight;
+	ov_node_loc_table_update (node, GFP_KERNEL);
 
 	return;
 }
@@ -383,292 +984,452 @@ ov_locator_weight_set (struct ov_locator * loc, u8 weight)
  *** xmit related locator operations
  ***************************/
 
-static int
-ovstack_ipv4_loc_count (struct net * net, u8 app)
+/* rc of ip_local_out (). NET_XMIT_CN counts as an error for adaptive */
+static inline void
+ov_locator_tx_account (struct ov_locator * src, struct ov_locator * dst,
+		       unsigned int len, int rc)
 {
-	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
-	struct ovstack_app * ovapp = OVSTACK_NET_APP (ovnet, app);
-
-	if (unlikely (!ovapp)) {
-		pr_debug ("%s: application %d does not exist", __func__, app);
-		return 0;
+	if (likely (rc == NET_XMIT_SUCCESS)) {
+		OV_LOCATOR_STATS_ADD (src, tx_packets, tx_bytes, len);
+		OV_LOCATOR_STATS_ADD (dst, tx_packets, tx_bytes, len);
+	} else {
+		OV_LOCATOR_STATS_INC (src, tx_errors);
+		OV_LOCATOR_STATS_INC (dst, tx_errors);
 	}
-	return OVSTACK_APP_OWNNODE(ovapp)->ipv4_locator_count;
 }
 
-static int
-ovstack_ipv6_loc_count (struct net * net, u8 app)
+/* rx is counted on the own locator of the outer destination address */
+static inline void
+ov_locator_rx_account (struct ov_node * ownnode, struct sk_buff * skb)
+{
+	struct ov_locator * loc = NULL;
+
+	if (skb->protocol == htons (ETH_P_IP))
+		loc = find_ov_locator_by_addr (ownnode,
+					       (__be32 *) &ip_hdr (skb)->daddr,
+					       AF_INET);
+	else if (skb->protocol == htons (ETH_P_IPV6))
+		loc = find_ov_locator_by_addr (ownnode,
+					       ipv6_hdr (skb)->daddr.s6_addr32,
+					       AF_INET6);
+	if (loc)
+		OV_LOCATOR_STATS_ADD (loc, rx_packets, rx_bytes, skb->len);
+}
+
+static inline int
+ov_nexthop_rpf_check (struct sk_buff * skb, struct net * net, 
+		      u8 app, __be32 node_id)
 {
+	struct iphdr * iph;
+	struct ipv6hdr * ip6h;
+	struct ov_node * node;
 	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
 	struct ovstack_app * ovapp = OVSTACK_NET_APP (ovnet, app);
 
 	if (unlikely (!ovapp)) {
 		pr_debug ("%s: application %d does not exist", __func__, app);
-		return 0;
+		return -1;
 	}
-	return OVSTACK_APP_OWNNODE(ovapp)->ipv6_locator_count;
+
+	node = find_ov_node_by_id (ovapp, node_id);
+	if (!node)
+		return -1;
+
+	if (skb->protocol == htons (ETH_P_IP)) {
+		iph = (struct iphdr *) skb_network_header (skb);
+		if (find_ov_locator_by_addr (node, (__be32 *) &iph->saddr, 
+					     AF_INET))
+			return 1;
+	}else if (skb->protocol == htons (ETH_P_IPV6)) {
+		ip6h = (struct ipv6hdr *) skb_network_header (skb);
+		if (find_ov_locator_by_addr (node, (__be32 *) &ip6h->saddr, 
+					     AF_INET6))
+			return 1;
+	} else 
+		pr_debug ("%s: invalid protocol %d", __func__, skb->protocol);
+	
+	return 0;
 }
 
-static int
-ovstack_src_loc (void * addr, struct net * net, u8 app, u32 hash)
-{
-	struct ov_locator * loc;
-	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
-	struct ovstack_app * ovapp = OVSTACK_NET_APP (ovnet, app);
 
-	if (unlikely (!ovapp)) {
-		pr_debug ("%s: application %d does not exist", __func__, app);
-		return 0;
-	}
 
-	loc = find_ov_locator_by_hash (OVSTACK_APP_OWNNODE (ovapp),
-				       hash, AF_UNSPEC);
-	if (loc == NULL)
-		return 0;
+/*****************************
+ ****	Routing table operations
+ *****************************/
 
-	memcpy (addr, &(loc->remote_ip),
-		(loc->remote_ip_family == AF_INET) ?
-		sizeof (struct in_addr) : sizeof (struct in6_addr));
+static struct ortable * 
+find_ortable (struct ortable_set * ors, __be32 dst_node_id)
+{
+	struct ortable * ort;
+	struct ov_htable * t = ov_hash_table (&(ors->hash));
+
+	ov_htable_for_each_possible_rcu (t, ort, hnode, dst_node_id) {
+		if (ort->ort_dst == dst_node_id) 
+			return ort;
+	}
 
-	return loc->remote_ip_family;
+	return NULL;
 }
 
-#if 0
-static int
-ovstack_dst_loc (void * addr, struct net * net, u8 app, 
-		 __be32 node_id, u32 hash)
+static struct ortable_plan *
+ortable_plan_build (struct ovstack_app * ovapp, struct ortable * ort)
 {
-	struct ov_node * node;
-	struct ov_locator * loc;
-	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
-	struct ovstack_app * ovapp = OVSTACK_NET_APP (ovnet, app);
+	int rc;
+	unsigned int n = 0;
+	bool ecmp;
+	u32 * keys = NULL;
+	u8 * weights = NULL;
+	struct ortable_plan * plan;
+	struct ortable_nexthop * ortnxt;
+	struct ov_node * ownnode = OVSTACK_APP_OWNNODE (ovapp);
 
-	if (unlikely (!ovapp)) {
-		pr_debug ("%s: application %d does not exist", __func__, app);
-		return 0;
+	ecmp = (ort->mode == OVSTACK_ROUTE_MODE_ECMP &&
+		ort->ort_nxt_count > 1);
+	if (ecmp && ort->ort_nxt_count > OV_MAGLEV_MAX)
+		return NULL;
+
+	plan = kzalloc (sizeof (struct ortable_plan) + 
+			sizeof (struct ortable_plan_nexthop) * 
+			ort->ort_nxt_count + (ecmp ? OV_MAGLEV_SIZE : 0),
+			GFP_KERNEL);
+	if (!plan)
+		return NULL;
+
+	if (ecmp) {
+		keys = kmalloc ((sizeof (u32) + sizeof (u8)) *
+				ort->ort_nxt_count, GFP_KERNEL);
+		if (!keys) {
+			kfree (plan);
+			return NULL;
+		}
+		weights = (u8 *)(keys + ort->ort_nxt_count);
 	}
 
-	node = find_ov_node_by_id (ovapp, node_id);
-	if (!node)
-		return 0;
+	plan->family = ov_node_loc_family (ownnode);
+	plan->mode = ort->mode;
+
+	list_for_each_entry (ortnxt, &(ort->ort_nxts), list) {
+		plan->nxts[n].nxt = ortnxt->ort_nxt;
+		plan->nxts[n].node = ortnxt->node;
+		if (ortnxt->ort_nxt == ownnode->node_id)
+			plan->nxts[n].flags |= ORT_PLAN_NXT_OWN;
+		if (ecmp) {
+			keys[n] = (__force u32) ortnxt->ort_nxt;
+			weights[n] = ortnxt->weight;
+		}
+		n++;
+	}
+	plan->nxt_count = n;
+
+	if (ecmp) {
+		plan->slots = (u8 *) &(plan->nxts[n]);
+		rc = ov_maglev_build (plan->slots, n, keys, weights,
+				      GFP_KERNEL);
+		kfree (keys);
+		if (rc < 0) {
+			kfree (plan);
+			return NULL;
+		}
+	}
 
-	loc = find_ov_locator_by_hash (node, hash, AF_UNSPEC);
-	if (loc == NULL)
-		return 0;
+	return plan;
+}
 
-	memcpy (addr, &(loc->remote_ip),
-		(loc->remote_ip_family == AF_INET) ?
-		sizeof (struct in_addr) : sizeof (struct in6_addr));
+/*
+ * next hop of an ecmp plan. hash is salted per node, so that relays do
+ * not make the same choice as the previous hop for a flow.
+ */
+static inline struct ortable_plan_nexthop *
+ortable_plan_select (struct ortable_plan * plan, __be32 hash)
+{
+	if (!plan->slots)
+		return &(plan->nxts[0]);
 
-	return loc->remote_ip_family;
+	return &(plan->nxts[plan->slots[jhash_1word ((__force u32) hash,
+						     ovstack_salt) %
+					OV_MAGLEV_SIZE]]);
 }
-#endif
 
 static int
-ovstack_ipv4_src_loc (void * addr, struct net * net, u8 app, u32 hash)
+ortable_plan_update (struct ovstack_app * ovapp, struct ortable * ort)
 {
-	struct ov_locator * loc;
-	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
-	struct ovstack_app * ovapp = OVSTACK_NET_APP (ovnet, app);
+	struct ortable_plan * plan, * old;
 
-	if (unlikely (!ovapp)) {
-		pr_debug ("%s: application %d does not exist", __func__, app);
-		return 0;
-	}
+	plan = ortable_plan_build (ovapp, ort);
+	if (!plan) 
+		pr_debug ("%s: failed to build xmit plan for %pI4\n",
+			  __func__, &ort->ort_dst);
 
-	loc = find_ov_locator_by_hash (OVSTACK_APP_OWNNODE (ovapp),
-				       hash, AF_INET);
-	if (loc == NULL)
-		return 0;
-	memcpy (addr, loc->remote_ip4, sizeof (struct in_addr));
+	/* without a plan the route drops packets until next update */
+	old = rcu_dereference_raw (ort->plan);
+	rcu_assign_pointer (ort->plan, plan);
+	if (old)
+		kfree_rcu (old, rcu);
 
-	return AF_INET;
+	return plan ? 0 : -ENOMEM;
 }
 
-static int
-ovstack_ipv4_dst_loc (void * addr, 
-		      struct net * net, u8 app, __be32 node_id, u32 hash)
+static void
+ovstack_app_plan_update (struct ovstack_app * ovapp)
 {
-	struct ov_node * node;
-	struct ov_locator * loc;
-	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
-	struct ovstack_app * ovapp = OVSTACK_NET_APP (ovnet, app);
+	struct ortable * ort;
+	struct ortable_set * ors = OVSTACK_APP_ORTABLES (ovapp);
 
-	if (unlikely (!ovapp)) {
-		pr_debug ("%s: application %d does not exist", __func__, app);
-		return 0;
-	}
+	list_for_each_entry (ort, &(ors->chain), chain)
+		ortable_plan_update (ovapp, ort);
 
-	node = find_ov_node_by_id (ovapp, node_id);
-	if (unlikely (!node)) {
-		pr_debug ("%s: node id %pI4 does not exist\n", 
-			  __func__,  &node_id);
-		return 0;
+	ors = ovapp->ortables_staging;
+	if (ors) {
+		list_for_each_entry (ort, &(ors->chain), chain)
+			ortable_plan_update (ovapp, ort);
 	}
 
-	loc = find_ov_locator_by_hash (node, hash, AF_INET);
-	if (loc == NULL)
-		return 0;
-	memcpy (addr, loc->remote_ip4, sizeof (struct in_addr));
-
-	return AF_INET;
+	return;
 }
 
-static int
-ovstack_ipv6_src_loc (void * addr, struct net * net, u8 app, u32 hash)
+static struct ortable_set *
+ortable_set_alloc (void)
 {
-	struct ov_locator * loc;
-	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
-	struct ovstack_app * ovapp = OVSTACK_NET_APP (ovnet, app);
+	struct ortable_set * ors;
 
-	if (unlikely (!ovapp)) {
-		pr_debug ("%s: application %d does not exist", __func__, app);
-		return 0;
-	}
+	ors = kmalloc (sizeof (struct ortable_set), GFP_KERNEL);
+	if (!ors)
+		return NULL;
 
-	loc = find_ov_locator_by_hash (OVSTACK_APP_OWNNODE (ovapp),
-				       hash, AF_INET6);
-	if (loc == NULL)
-		return 0;
-	memcpy (addr, loc->remote_ip6, sizeof (struct in6_addr));
+	if (ov_hash_init (&(ors->hash), ORT_HASH_MIN_BITS,
+			  ORT_HASH_MAX_BITS) < 0) {
+		kfree (ors);
+		return NULL;
+	}
+	INIT_LIST_HEAD (&(ors->chain));
 
-	return AF_INET6;
+	return ors;
 }
 
-static int
-ovstack_ipv6_dst_loc (void * addr, 
-		      struct net * net, u8 app, __be32 node_id, u32 hash)
+/*
+ * free a table which readers can not see, i.e. it was never published
+ * or a grace period has passed since it was replaced. Entries are freed
+ * at once without RCU callbacks.
+ */
+static void
+ortable_set_free (struct ovstack_app * ovapp, struct ortable_set * ors)
 {
-	struct ov_node * node;
-	struct ov_locator * loc;
-	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
-	struct ovstack_app * ovapp = OVSTACK_NET_APP (ovnet, app);
-
-	if (unlikely (!ovapp)) {
-		pr_debug ("%s: application %d does not exist", __func__, app);
-		return 0;
+	struct ortable * ort, * ort_tmp;
+	struct ortable_nexthop * ortnxt, * nxt_tmp;
+
+	list_for_each_entry_safe (ort, ort_tmp, &(ors->chain), chain) {
+		list_for_each_entry_safe (ortnxt, nxt_tmp,
+					  &(ort->ort_nxts), list) {
+			ov_node_put (ovapp, ortnxt->node);
+			kfree (ortnxt);
+		}
+		kfree (rcu_dereference_raw (ort->plan));
+		kfree (ort);
 	}
 
-	node = find_ov_node_by_id (ovapp, node_id);
-	if (unlikely (!node)) {
-		pr_debug ("%s: node id %pI4 does not exist\n", 
-			  __func__, &node_id);
-		return 0;
-	}
+	ov_htable_free (ov_hash_table (&(ors->hash)));
+	kfree (ors);
 
-	loc = find_ov_locator_by_hash (node, hash, AF_INET6);
-	if (loc == NULL)
-		return 0;
-	memcpy (addr, loc->remote_ip6, sizeof (struct in6_addr));
+	return;
+}
 
-	return AF_INET6;
+/* staging table of the app, created when first used */
+static struct ortable_set *
+ortable_staging_get (struct ovstack_app * ovapp)
+{
+	if (!ovapp->ortables_staging)
+		ovapp->ortables_staging = ortable_set_alloc ();
+
+	return ovapp->ortables_staging;
 }
 
-static inline int
-ov_nexthop_rpf_check (struct sk_buff * skb, struct net * net, 
-		      u8 app, __be32 node_id)
+/*
+ * publish the staging table. Without staging table, an empty table is
+ * published, which flushes all routes. Nodes used by both tables keep
+ * their references, so that they are not deleted while switching.
+ */
+static int
+ortable_commit (struct ovstack_app * ovapp)
 {
-	struct iphdr * iph;
-	struct ipv6hdr * ip6h;
-	struct ov_node * node;
-	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
-	struct ovstack_app * ovapp = OVSTACK_NET_APP (ovnet, app);
+	struct ortable_set * new, * old;
 
-	if (unlikely (!ovapp)) {
-		pr_debug ("%s: application %d does not exist", __func__, app);
-		return -1;
+	new = ovapp->ortables_staging;
+	if (!new) {
+		new = ortable_set_alloc ();
+		if (!new)
+			return -ENOMEM;
 	}
+	ovapp->ortables_staging = NULL;
 
-	node = find_ov_node_by_id (ovapp, node_id);
-	if (!node)
-		return -1;
+	old = OVSTACK_APP_ORTABLES (ovapp);
+	rcu_assign_pointer (ovapp->ortables, new);
+
+	synchronize_rcu ();
+	ortable_set_free (ovapp, old);
 
-	if (skb->protocol == htons (ETH_P_IP)) {
-		iph = (struct iphdr *) skb_network_header (skb);
-		if (find_ov_locator_by_addr (node, (__be32 *) &iph->saddr, 
-					     AF_INET))
-			return 1;
-	}else if (skb->protocol == htons (ETH_P_IPV6)) {
-		ip6h = (struct ipv6hdr *) skb_network_header (skb);
-		if (find_ov_locator_by_addr (node, (__be32 *) &ip6h->saddr, 
-					     AF_INET6))
-			return 1;
-	} else 
-		pr_debug ("%s: invalid protocol %d", __func__, skb->protocol);
-	
 	return 0;
 }
 
-
-
-/*****************************
- ****	Routing table operations
- *****************************/
-
-static inline struct list_head *
-ortable_head (struct ovstack_app * ovapp, __be32 dst_node_id)
+static void
+ortable_abort (struct ovstack_app * ovapp)
 {
-	return &(ovapp->ortable_list[hash_32 (dst_node_id, ORT_HASH_BITS)]);
+	if (ovapp->ortables_staging) {
+		ortable_set_free (ovapp, ovapp->ortables_staging);
+		ovapp->ortables_staging = NULL;
+	}
+
+	return;
 }
 
-static struct ortable * 
-find_ortable (struct ovstack_app * ovapp, __be32 dst_node_id)
+int
+ortable_destroy (struct ovstack_app * ovapp, struct ortable_set * ors,
+		 struct ortable * ort)
 {
-	struct ortable * ort;
+	struct list_head * p, * tmp;
+	struct ortable_nexthop * ortnxt;
+	struct ortable_plan * plan;
 
-	list_for_each_entry_rcu (ort, ortable_head (ovapp, dst_node_id), list) {
-		if (ort->ort_dst == dst_node_id) 
-			return ort;
+	list_for_each_safe (p, tmp, &(ort->ort_nxts)) {
+		ortnxt = list_entry (p, struct ortable_nexthop, list);
+		list_del_rcu (p);
+		ov_node_put (ovapp, ortnxt->node);
+		kfree_rcu (ortnxt, rcu);
+		ort->ort_nxt_count--;
 	}
+	
+	ov_hash_remove (&(ors->hash), &(ort->hnode));
+	list_del_rcu (&(ort->chain));
 
-	return NULL;
+	plan = rcu_dereference_raw (ort->plan);
+	if (plan)
+		kfree_rcu (plan, rcu);
+	kfree_rcu (ort, rcu);
+
+	ov_hash_adjust (&(ors->hash));
+
+	return 0;
 }
 
+/*
+ * mode is OVSTACK_ROUTE_MODE_UNSPEC to keep the mode of the route, and
+ * weight is -1 for the default. For an existing next hop, mode and weight
+ * are updated if specified.
+ */
 int
-ortable_add (struct ovstack_app * ovapp, __be32 dst_node_id, __be32 nxt_node_id)
+ortable_add (struct ovstack_app * ovapp, struct ortable_set * ors,
+	     __be32 dst_node_id, __be32 nxt_node_id, u8 mode, int weight)
 {
+	u8 old_mode, old_weight;
 	struct ortable * ort;
 	struct ortable_nexthop * ortnxt;
+	struct ov_node * node;
+
+	ort = find_ortable (ors, dst_node_id);
+	if (ort) {
+		list_for_each_entry_rcu (ortnxt, &(ort->ort_nxts), list) {
+			if (ortnxt->ort_nxt != nxt_node_id)
+				continue;
+
+			if (mode == OVSTACK_ROUTE_MODE_UNSPEC && weight < 0) {
+				pr_debug ("%s: dest node %pI4 already "
+					  "has next hop %pI4", __func__, 
+					  &dst_node_id, &nxt_node_id);
+				return -EEXIST;
+			}
+
+			if (mode == OVSTACK_ROUTE_MODE_ECMP &&
+			    ort->ort_nxt_count > OV_MAGLEV_MAX) {
+				pr_debug ("%s: ecmp route %pI4 has too many "
+					  "next hops", __func__, &dst_node_id);
+				return -ENOSPC;
+			}
+
+			/* keep config and published plan consistent */
+			old_mode = ort->mode;
+			old_weight = ortnxt->weight;
+			if (mode != OVSTACK_ROUTE_MODE_UNSPEC)
+				ort->mode = mode;
+			if (weight >= 0)
+				ortnxt->weight = weight;
+
+			if (ortable_plan_update (ovapp, ort) < 0) {
+				ort->mode = old_mode;
+				ortnxt->weight = old_weight;
+				return -ENOMEM;
+			}
+
+			return 1;
+		}
+
+		if ((mode == OVSTACK_ROUTE_MODE_ECMP ||
+		     ort->mode == OVSTACK_ROUTE_MODE_ECMP) &&
+		    ort->ort_nxt_count >= OV_MAGLEV_MAX) {
+			pr_debug ("%s: ecmp route %pI4 has too many next hops",
+				  __func__, &dst_node_id);
+			return -ENOSPC;
+		}
+	}
+
+	/* next hop node may be added after the route */
+	node = find_ov_node_by_id (ovapp, nxt_node_id);
+	if (!node) {
+		node = ov_node_create (nxt_node_id);
+		if (!node)
+			return -ENOMEM;
+		ov_node_add (ovapp, node);
+	}
+
+	ortnxt = kmalloc (sizeof (struct ortable_nexthop), GFP_KERNEL);
+	if (!ortnxt) {
+		node->refcnt++;
+		ov_node_put (ovapp, node);
+		return -ENOMEM;
+	}
+	memset (ortnxt, 0, sizeof (struct ortable_nexthop));
+	ortnxt->ort_nxt = nxt_node_id;
+	ortnxt->node = node;
+	ortnxt->weight = (weight < 0) ? OVSTACK_DEFAULT_WEIGHT : weight;
+	node->refcnt++;
 
-	ort = find_ortable (ovapp, dst_node_id);
 	if (!ort) {
 		ort = kmalloc (sizeof (struct ortable), GFP_KERNEL);
+		if (!ort) {
+			kfree (ortnxt);
+			ov_node_put (ovapp, node);
+			return -ENOMEM;
+		}
 		memset (ort, 0, sizeof (struct ortable));
 		ort->ort_dst = dst_node_id;
+		ort->mode = OVSTACK_ROUTE_MODE_REPLICATE;
 		INIT_LIST_HEAD (&(ort->ort_nxts));
-		list_add_rcu (&(ort->list), ortable_head (ovapp, dst_node_id));
-		list_add_rcu (&(ort->chain), &(ovapp->ortable_chain));
+		ov_hash_insert (&(ors->hash), &(ort->hnode), dst_node_id);
+		list_add_rcu (&(ort->chain), &(ors->chain));
+		ov_hash_adjust (&(ors->hash));
 	}
 
-	list_for_each_entry_rcu (ortnxt, &(ort->ort_nxts), list) {
-		if (ortnxt->ort_nxt == nxt_node_id) {
-			pr_debug ("%s: dest node %pI4 already "
-				  "has next hop %pI4", __func__, 
-				  &dst_node_id, &nxt_node_id);
-			return -EEXIST;
-		}
-	}
-	
-	ortnxt = kmalloc (sizeof (struct ortable_nexthop), GFP_KERNEL);
-	memset (ortnxt, 0, sizeof (struct ortable_nexthop));
-	ortnxt->ort_nxt = nxt_node_id;
+	if (mode != OVSTACK_ROUTE_MODE_UNSPEC)
+		ort->mode = mode;
+
 	ortnxt->ort = ort;
 	list_add_rcu (&(ortnxt->list), &(ort->ort_nxts));
 	ort->ort_nxt_count++;
 
+	if (ortable_plan_update (ovapp, ort) < 0)
+		return -ENOMEM;
+
 	return 1;
 }
 
 
 int
-ortable_delete (struct ovstack_app * ovapp, 
+ortable_delete (struct ovstack_app * ovapp, struct ortable_set * ors,
 		__be32 dst_node_id, __be32 nxt_node_id)
 {
 	struct list_head * p, * tmp;
 	struct ortable * ort;
 	struct ortable_nexthop * ortnxt;
 
-	ort = find_ortable (ovapp, dst_node_id);
+	ort = find_ortable (ors, dst_node_id);
 	if (!ort) {
 		pr_debug ("%s: dst node %pI4 does not exist", 
 			  __func__, &dst_node_id);
@@ -679,14 +1440,18 @@ ortable_delete (struct ovstack_app * ovapp,
 		ortnxt = list_entry (p, struct ortable_nexthop, list);
 		if (ortnxt->ort_nxt == nxt_node_id) {
 			list_del_rcu (p);
-			kfree_rcu (ortnxt, rcu);
 			ort->ort_nxt_count--;
 
-			if (ort->ort_nxt_count == 0) {
-				list_del_rcu (&(ort->list));
-				list_del_rcu (&(ort->chain));
-				kfree_rcu (ort, rcu);
-			}
+			if (ort->ort_nxt_count == 0) 
+				ortable_destroy (ovapp, ors, ort);
+			else 
+				ortable_plan_update (ovapp, ort);
+
+			/* node is freed by kfree_rcu () as well, so readers
+			 * of the old plan never see a freed node. */
+			ov_node_put (ovapp, ortnxt->node);
+			kfree_rcu (ortnxt, rcu);
+
 			return 1;
 		}
 	}
@@ -697,30 +1462,15 @@ ortable_delete (struct ovstack_app * ovapp,
 	return -ENOENT;
 }
 
-int
-ortable_destroy (struct ortable * ort)
-{
-	struct list_head * p, * tmp;
-	struct ortable_nexthop * ortnxt;
-
-	list_for_each_safe (p, tmp, &(ort->ort_nxts)) {
-		ortnxt = list_entry (p, struct ortable_nexthop, list);
-		list_del_rcu (p);
-		kfree_rcu (ortnxt, rcu);
-		ort->ort_nxt_count--;
-	}
-	
-	list_del_rcu (&(ort->list));
-	list_del_rcu (&(ort->chain));
-	kfree_rcu (ort, rcu);
-
-	return 0;
-}
-
 /*****************************
  ****	pernet operations
  *****************************/
 
+static netdev_tx_t ovstack_forward (struct sk_buff * skb,
+				    struct ovstack_app * ovapp);
+static int ovstack_probe_recv (struct sk_buff * skb,
+			       struct ovstack_app * ovapp, struct ovhdr * ovh);
+
 static int
 ovstack_recv (struct sk_buff * skb)
 {
@@ -728,7 +1478,8 @@ ovstack_recv (struct sk_buff * skb)
 	 * call function pointer according to ovstack protocl number
 	 */
 
-	struct ovhdr * ovh;
+	int reason;
+	struct ovhdr * ovh = NULL;
 	struct net * net = dev_net (skb->dev);
 	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
 	struct ovstack_app * ovapp;
@@ -736,39 +1487,138 @@ ovstack_recv (struct sk_buff * skb)
 
 	/* need ov and inner ether header to present */
 	if (!pskb_may_pull (skb, sizeof (struct ovhdr))) {
-		return 1;
+		reason = OVSTACK_DROP_TRUNCATED;
+		goto drop;
 	}
 
 	ovh = (struct ovhdr *) skb->data;
 
+	trace_ovstack_recv (skb, ovh);
+
 	/* application check */
 	if (!OVSTACK_NET_APP (ovnet, ovh->ov_app)) {
-		netdev_dbg (skb->dev, "unknown application %d\n", ovh->ov_app);
-		return 0;
+		reason = OVSTACK_DROP_UNKNOWN_APP;
+		goto drop;
 	}
 	ovapp = OVSTACK_NET_APP (ovnet, ovh->ov_app);
 	ownnode = OVSTACK_APP_OWNNODE (ovapp);
 
+	if (unlikely (ovh->ov_flags &
+		      (OVSTACK_FLAG_PROBE | OVSTACK_FLAG_PROBE_REPLY)))
+		return ovstack_probe_recv (skb, ovapp, ovh);
+
+	OVSTACK_APP_STATS_ADD (ovapp, rx_packets, rx_bytes, skb->len);
+	ov_locator_rx_account (ownnode, skb);
+
 	/* this packet is not for me. routing ! */
 	if (ovh->ov_dst != ownnode->node_id) {
 		ovh->ov_ttl--;
 		if (ovh->ov_ttl < 1) {
-			printk (KERN_INFO "ovstack : TTL exceed!\n");
-			return 0;
+			reason = OVSTACK_DROP_TTL_EXCEEDED;
+			goto app_drop;
 		}
 
-		ovstack_xmit (skb, skb->dev);
+		OVSTACK_APP_STATS_ADD (ovapp, fwd_packets, fwd_bytes,
+				       skb->len);
+		trace_ovstack_recv_dispatch (skb, ovh, true);
+		ovstack_forward (skb, ovapp);
 		return 0;
 	}
 
 	/* callback function for overlay applicaitons */
 	if (ovapp->app_recv_ops == NULL) {
-		netdev_dbg (skb->dev, "application %d does not "
-			    "register callback function\n", ovh->ov_app);
-		return 0;
+		reason = OVSTACK_DROP_NO_APP_RECV;
+		goto app_drop;
 	}
 
+	OVSTACK_APP_STATS_ADD (ovapp, local_packets, local_bytes, skb->len);
+	trace_ovstack_recv_dispatch (skb, ovh, false);
+
 	return ovapp->app_recv_ops (skb);
+
+app_drop:
+	OVSTACK_APP_STATS_INC (ovapp, rx_dropped);
+drop:
+	ovstack_drop (skb, ovh, reason);
+	return 0;
+}
+
+/* encap_rcv of UDP encapsulation sockets. skb->data is UDP header. */
+static int
+ovstack_udp_encap_recv (struct sock * sk, struct sk_buff * skb)
+{
+	if (!pskb_may_pull (skb, sizeof (struct udphdr) +
+			    sizeof (struct ovhdr))) {
+		ovstack_drop (skb, NULL, OVSTACK_DROP_TRUNCATED);
+		return 0;
+	}
+
+	if (udp_lib_checksum_complete (skb)) {
+		ovstack_drop (skb, NULL, OVSTACK_DROP_UDP_CSUM);
+		return 0;
+	}
+
+	__skb_pull (skb, sizeof (struct udphdr));
+	skb_reset_transport_header (skb);
+
+	/* ovstack_recv () consumes skb */
+	ovstack_recv (skb);
+
+	return 0;
+}
+
+static struct socket *
+ovstack_udp_sock_create (struct net * net, int family)
+{
+	int rc, one = 1;
+	struct socket * sock;
+	struct sock * sk;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+
+	rc = sock_create_kern (family, SOCK_DGRAM, IPPROTO_UDP, &sock);
+	if (rc < 0)
+		return ERR_PTR (rc);
+
+	sk = sock->sk;
+	sk_change_net (sk, net);
+
+	if (family == AF_INET) {
+		memset (&sin, 0, sizeof (sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl (INADDR_ANY);
+		sin.sin_port = htons (OVSTACK_PORT);
+		rc = kernel_bind (sock, (struct sockaddr *) &sin,
+				  sizeof (sin));
+	} else {
+		rc = kernel_setsockopt (sock, SOL_IPV6, IPV6_V6ONLY,
+					(char *) &one, sizeof (one));
+		if (rc < 0)
+			goto err_out;
+
+		memset (&sin6, 0, sizeof (sin6));
+		sin6.sin6_family = AF_INET6;
+		sin6.sin6_addr = in6addr_any;
+		sin6.sin6_port = htons (OVSTACK_PORT);
+		rc = kernel_bind (sock, (struct sockaddr *) &sin6,
+				  sizeof (sin6));
+	}
+	if (rc < 0)
+		goto err_out;
+
+	udp_sk (sk)->encap_type = 1;
+	udp_sk (sk)->encap_rcv = ovstack_udp_encap_recv;
+
+	if (family == AF_INET)
+		udp_encap_enable ();
+	else
+		udpv6_encap_enable ();
+
+	return sock;
+
+err_out:
+	sk_release_kernel (sk);
+	return ERR_PTR (rc);
 }
 
 static int
@@ -788,7 +1638,7 @@ ovstack_mcast_recv (struct sk_buff * skb)
 
 	/* application check */
 	if (!OVSTACK_NET_APP (ovnet, ovh->ov_app)) {
-		netdev_dbg (skb->dev, "unknown application %d\n", ovh->ov_app);
+		ovstack_drop (skb, ovh, OVSTACK_DROP_UNKNOWN_APP);
 		return 0;
 	}
 	ovapp = OVSTACK_NET_APP (ovnet, ovh->ov_app);
@@ -797,67 +1647,273 @@ ovstack_mcast_recv (struct sk_buff * skb)
 
 	/* callback function for overlay applicaitons */
 	if (ovapp->app_recv_ops == NULL) {
-		netdev_dbg (skb->dev, "application %d does not "
-			    "register callback function\n", ovh->ov_app);
+		OVSTACK_APP_STATS_INC (ovapp, rx_dropped);
+		ovstack_drop (skb, ovh, OVSTACK_DROP_NO_APP_RECV);
 		return 0;
 	}
 
+	OVSTACK_APP_STATS_ADD (ovapp, local_packets, local_bytes, skb->len);
+
 	return ovapp->app_recv_ops (skb);
-	
 }
 
 
-static inline netdev_tx_t
-ovstack_xmit_ipv4_loc (struct sk_buff * skb, struct net_device * dev,
-		       struct in_addr * saddr, struct in_addr * daddr)
+static inline struct ov_dst_cache_entry *
+ov_dst_cache_slot (struct ov_locator * dst, __be32 * saddr, u8 ai_family)
+{
+	u32 key;
+	struct ov_dst_cache * dc = this_cpu_ptr (dst->dst_cache);
+
+	key = (ai_family == AF_INET) ? saddr[0] :
+		saddr[0] ^ saddr[1] ^ saddr[2] ^ saddr[3];
+
+	return &(dc->entry[hash_32 (key, OV_DST_CACHE_BITS)]);
+}
+
+static inline struct dst_entry *
+ov_dst_cache_get (struct ov_dst_cache_entry * ent, __be32 * saddr,
+		  size_t len)
+{
+	struct dst_entry * dst = ent->dst;
+
+	if (!dst || memcmp (&ent->src_ip, saddr, len) != 0)
+		return NULL;
+
+	/* route genid is changed or fib6 node is updated */
+	if (!dst_check (dst, ent->cookie)) {
+		ent->dst = NULL;
+		dst_release (dst);
+		return NULL;
+	}
+
+	dst_hold (dst);
+	return dst;
+}
+
+static inline void
+ov_dst_cache_set (struct ov_dst_cache_entry * ent, struct dst_entry * dst,
+		  __be32 * saddr, size_t len, u32 cookie)
+{
+	dst_release (ent->dst);
+	dst_hold (dst);
+	ent->dst = dst;
+	ent->cookie = cookie;
+	memcpy (&ent->src_ip, saddr, len);
+
+	return;
+}
+
+static inline __be16
+ovstack_udp_src_port (__be32 hash)
+{
+	u32 range = OVSTACK_UDP_SPORT_MAX - OVSTACK_UDP_SPORT_MIN + 1;
+	u32 h = jhash_1word ((__force u32) hash, ovstack_salt);
+
+	return htons ((((u64) h * range) >> 32) + OVSTACK_UDP_SPORT_MIN);
+}
+
+static inline struct udphdr *
+ovstack_push_udp (struct sk_buff * skb, __be16 sport)
+{
+	struct udphdr * uh;
+
+	__skb_push (skb, sizeof (struct udphdr));
+	skb_reset_transport_header (skb);
+	uh		= udp_hdr (skb);
+	uh->source	= sport;
+	uh->dest	= htons (OVSTACK_PORT);
+	uh->len		= htons (skb->len);
+	uh->check	= 0;
+
+	return uh;
+}
+
+/* route to the dst locator from the src locator through per-cpu cache */
+static inline struct rtable *
+ovstack_route4 (struct net_device * dev, struct ov_locator * src,
+		struct ov_locator * dst)
 {
-	int rc;
-	struct iphdr * iph;
 	struct flowi4 fl4;
 	struct rtable * rt;
+	struct ov_dst_cache_entry * ent;
+
+	ent = ov_dst_cache_slot (dst, src->remote_ip4, AF_INET);
+	rt = (struct rtable *) ov_dst_cache_get (ent, src->remote_ip4,
+						 sizeof (struct in_addr));
+	if (rt)
+		return rt;
 
 	memset (&fl4, 0, sizeof (fl4));
-	fl4.saddr = *((__be32 *)(saddr));
-	fl4.daddr = *((__be32 *)(daddr));
+	fl4.saddr = *(src->remote_ip4);
+	fl4.daddr = *(dst->remote_ip4);
 
 	rt = ip_route_output_key (dev_net (dev), &fl4);
 	if (IS_ERR (rt)) {
-		netdev_dbg (dev, "no route to %pI4\n", daddr);
+		netdev_dbg (dev, "no route to %pI4\n", dst->remote_ip4);
 		dev->stats.tx_carrier_errors++;
-		dev->stats.tx_dropped++;
-		return NETDEV_TX_OK;
+		return NULL;
 	}
-	
+	ov_dst_cache_set (ent, &rt->dst, src->remote_ip4,
+			  sizeof (struct in_addr), 0);
+
+	return rt;
+}
+
+static inline struct dst_entry *
+ovstack_route6 (struct net_device * dev, struct ov_locator * src,
+		struct ov_locator * dst)
+{
+	u32 cookie;
+	struct flowi6 fl6;
+	struct rt6_info * rt6;
+	struct dst_entry * dste;
+	struct ov_dst_cache_entry * ent;
+
+	ent = ov_dst_cache_slot (dst, src->remote_ip6, AF_INET6);
+	dste = ov_dst_cache_get (ent, src->remote_ip6,
+				 sizeof (struct in6_addr));
+	if (dste)
+		return dste;
+
+	memset (&fl6, 0, sizeof (fl6));
+	fl6.saddr = *((struct in6_addr *)src->remote_ip6);
+	fl6.daddr = *((struct in6_addr *)dst->remote_ip6);
+
+	/* cached dst is shared by all flows. do not route by skb->sk */
+	dste = ip6_route_output (dev_net (dev), NULL, &fl6);
+	if (dste->error) {
+		netdev_dbg (dev, "no route to %pI6\n", dst->remote_ip6);
+		dst_release (dste);
+		dev->stats.tx_carrier_errors++;
+		return NULL;
+	}
+
+	if (dste->dev == dev){
+		netdev_dbg (dev, "circular route to %pI6\n", dst->remote_ip6);
+		dst_release (dste);
+		dev->stats.collisions++;
+		return NULL;
+	}
+
+	rt6 = (struct rt6_info *) dste;
+	cookie = rt6->rt6i_node ? rt6->rt6i_node->fn_sernum : 0;
+	ov_dst_cache_set (ent, dste, src->remote_ip6,
+			  sizeof (struct in6_addr), cookie);
+
+	return dste;
+}
+
 /*
-	memset (&(IPCB (skb)->opt), 0, sizeof (IPCB (skb)->opt));
-	IPCB(skb)->flags &= ~(IPSKB_XFRM_TUNNEL_SIZE | IPSKB_XFRM_TRANSFORMED |
-			      IPSKB_REROUTED);
-*/
+ * path MTU check of an outer packet. skb->data is ovhdr, and mtu is the
+ * largest packet after the outer IP and UDP headers. Returns 0 to send
+ * with DF, 1 to send without DF (fragmented by the underlay), or -1 when
+ * the app sending skb was told the MTU and skb must be dropped.
+ * Transit packets are fragmented because their sender is not here.
+ */
+static inline int
+ovstack_pmtu_check (struct sk_buff * skb, struct net_device * dev,
+		    struct ov_locator * dst, unsigned int mtu)
+{
+	unsigned int len;
+	struct ovhdr * ovh = (struct ovhdr *) skb->data;
+	struct ovstack_app * ovapp;
+	struct ovstack_net * ovnet;
+
+	if (unlikely (dst->pmtu != mtu))
+		dst->pmtu = mtu;
+
+	len = skb_is_gso (skb) ?
+		skb_gso_network_seglen (skb) + skb_network_offset (skb) :
+		skb->len;
+	if (likely (len <= mtu))
+		return 0;
+
+	ovnet = net_generic (dev_net (dev), ovstack_net_id);
+	ovapp = OVSTACK_NET_APP (ovnet, ovh->ov_app);
+	if (!ovapp || !ovapp->app_pmtu_ops ||
+	    ovh->ov_src != OVSTACK_APP_OWNNODE (ovapp)->node_id ||
+	    mtu <= sizeof (struct ovhdr))
+		return 1;
+
+	if (ovapp->app_pmtu_ops (skb, mtu - sizeof (struct ovhdr)) != 0)
+		return 1;
+
+	pr_debug ("%s: app %d packet %u exceeds path mtu %u\n",
+		  __func__, ovh->ov_app, len, mtu);
+
+	return -1;
+}
+
+/* sport is UDP source port for UDP encapsulation, or 0 for raw ovstack */
+static inline netdev_tx_t
+ovstack_xmit_ipv4_loc (struct sk_buff * skb, struct net_device * dev,
+		       struct ov_locator * src, struct ov_locator * dst,
+		       __be16 sport)
+{
+	int rc, frag, reason;
+	unsigned int len;
+	struct iphdr * iph;
+	struct rtable * rt;
+
+	rt = ovstack_route4 (dev, src, dst);
+	if (!rt) {
+		reason = OVSTACK_DROP_UNDERLAY_ROUTE;
+		goto drop;
+	}
+
+	frag = ovstack_pmtu_check (skb, dev, dst, dst_mtu (&rt->dst) -
+				   sizeof (struct iphdr) -
+				   (sport ? sizeof (struct udphdr) : 0));
+	if (frag < 0) {
+		ip_rt_put (rt);
+		reason = OVSTACK_DROP_TOO_BIG;
+		goto drop;
+	}
+
+	/* transit packets carry control block of the received family */
+	memset (IPCB (skb), 0, sizeof (*IPCB (skb)));
+
 	skb_dst_drop (skb);
 	skb_dst_set (skb, &rt->dst);
 	
 	/* setup ip header */
-	if (skb_cow_head (skb, OVSTACK_IPV4_HEADROOM)) {
-		dev->stats.tx_dropped++;
-		return NETDEV_TX_OK;
+	if (skb_cow_head (skb, OVSTACK_IPV4_HEADROOM + OVSTACK_UDP_HEADROOM)) {
+		reason = OVSTACK_DROP_NOMEM;
+		goto drop;
+	}
+
+	/* GSO skb is segmented by UDP tunnel GSO of the underlay device.
+	 * mac header of the skb is the inner ethernet header. */
+	if (sport && skb_is_gso (skb)) {
+		skb_reset_inner_headers (skb);
+		skb->encapsulation = 1;
+		skb_shinfo (skb)->gso_type |= SKB_GSO_UDP_TUNNEL;
 	}
+
+	/* checksum of UDP over IPv4 is not used */
+	if (sport)
+		ovstack_push_udp (skb, sport);
 	
 	__skb_push (skb, sizeof (struct iphdr));
 	skb_reset_network_header (skb);
 	iph		= ip_hdr (skb);
 	iph->version	= 4;
 	iph->ihl	= sizeof (struct iphdr) >> 2;
-	iph->frag_off	= 0;
-	iph->protocol	= IPPROTO_OVSTACK;
+	iph->frag_off	= frag ? 0 : htons (IP_DF);
+	iph->protocol	= sport ? IPPROTO_UDP : IPPROTO_OVSTACK;
 	iph->tos	= 0;
-	iph->saddr	= *((__be32 *)(saddr));
-	iph->daddr	= *((__be32 *)(daddr));
-	iph->ttl	= 16;
+	iph->saddr	= *(src->remote_ip4);
+	iph->daddr	= *(dst->remote_ip4);
+	iph->ttl	= OVSTACK_OUTER_TTL;
+	__ip_select_ident (iph, &rt->dst, (skb_shinfo (skb)->gso_segs ?: 1) - 1);
 
-	skb->ip_summed = CHECKSUM_NONE;
+	if (!skb_is_gso (skb))
+		skb->ip_summed = CHECKSUM_NONE;
 	//skb->pkt_type = PACKET_HOST;
 
+	len = skb->len;
 	rc = ip_local_out (skb);
+	ov_locator_tx_account (src, dst, len, rc);
 
 	if (net_xmit_eval (rc) == 0) 
 		return rc;
@@ -867,50 +1923,66 @@ ovstack_xmit_ipv4_loc (struct sk_buff * skb, struct net_device * dev,
 	}
 	
 	return NETDEV_TX_OK;
+
+drop:
+	dev->stats.tx_dropped++;
+	ovstack_drop (skb, (struct ovhdr *) skb->data, reason);
+	return NETDEV_TX_OK;
 }
 
 static inline netdev_tx_t
 ovstack_xmit_ipv6_loc (struct sk_buff * skb, struct net_device * dev,
-		       struct in6_addr * saddr, struct in6_addr * daddr)
+		       struct ov_locator * src, struct ov_locator * dst,
+		       __be16 sport)
 {
-	int rc;
+	int rc, frag, reason;
+	unsigned int len;
+	struct udphdr * uh;
 	struct ipv6hdr * ip6h;
-	struct flowi6 fl6;
-	struct dst_entry * dst;
-	
-	memset (&fl6, 0, sizeof (fl6));
-	fl6.saddr = *saddr;
-	fl6.daddr = *daddr;
+	struct dst_entry * dste;
 
-	dst = ip6_route_output (dev_net (dev), skb->sk, &fl6);
-	if (dst->error) {
-		netdev_dbg (dev, "no route to %pI6\n", daddr);
-		dev->stats.tx_carrier_errors++;
-		dev->stats.tx_dropped++;
-		return NETDEV_TX_OK;
+	dste = ovstack_route6 (dev, src, dst);
+	if (!dste) {
+		reason = OVSTACK_DROP_UNDERLAY_ROUTE;
+		goto drop;
 	}
 
-	if (dst->dev == dev){
-		netdev_dbg (dev, "circular route to %pI6\n", daddr);
-		dst_free (dst);
-		dev->stats.collisions++;
-		dev->stats.tx_dropped++;
-		return NETDEV_TX_OK;
+	frag = ovstack_pmtu_check (skb, dev, dst, dst_mtu (dste) -
+				   sizeof (struct ipv6hdr) -
+				   (sport ? sizeof (struct udphdr) : 0));
+	if (frag < 0) {
+		dst_release (dste);
+		reason = OVSTACK_DROP_TOO_BIG;
+		goto drop;
 	}
 
-/*
-        memset (&(IPCB (skb)->opt), 0, sizeof (IPCB (skb)->opt));
-	IPCB(skb)->flags &= ~(IPSKB_XFRM_TUNNEL_SIZE | IPSKB_XFRM_TRANSFORMED |
-			      IPSKB_REROUTED);
-*/
+	memset (IP6CB (skb), 0, sizeof (*IP6CB (skb)));
 
 	skb_dst_drop (skb);
-	skb_dst_set (skb, dst);
+	skb_dst_set (skb, dste);
 
 	/* setup ipv6 header */
-	if (skb_cow_head (skb, OVSTACK_IPV6_HEADROOM)) {
-		dev->stats.tx_dropped++;
-		return NETDEV_TX_OK;
+	if (skb_cow_head (skb, OVSTACK_IPV6_HEADROOM + OVSTACK_UDP_HEADROOM)) {
+		reason = OVSTACK_DROP_NOMEM;
+		goto drop;
+	}
+
+	/* UDP over IPv6 requires checksum */
+	if (sport) {
+		if (skb->ip_summed == CHECKSUM_PARTIAL &&
+		    skb_checksum_help (skb)) {
+			reason = OVSTACK_DROP_CSUM;
+			goto drop;
+		}
+
+		uh = ovstack_push_udp (skb, sport);
+		uh->check = csum_ipv6_magic ((struct in6_addr *)src->remote_ip6,
+					     (struct in6_addr *)dst->remote_ip6,
+					     skb->len, IPPROTO_UDP,
+					     skb_checksum (skb, 0, skb->len, 0));
+		if (uh->check == 0)
+			uh->check = CSUM_MANGLED_0;
+		skb->ip_summed = CHECKSUM_NONE;
 	}
 
 	__skb_push (skb, sizeof (struct ipv6hdr));
@@ -922,14 +1994,19 @@ ovstack_xmit_ipv6_loc (struct sk_buff * skb, struct net_device * dev,
 	ip6h->flow_lbl[1]	= 0l;
 	ip6h->flow_lbl[2]	= 0l;
 	ip6h->payload_len	= htons (skb->len);
-	ip6h->nexthdr		= IPPROTO_OVSTACK;
-	ip6h->daddr		= *daddr;
-	ip6h->saddr		= *saddr;
-	ip6h->hop_limit		= 16;
+	ip6h->nexthdr		= sport ? IPPROTO_UDP : IPPROTO_OVSTACK;
+	ip6h->daddr		= *((struct in6_addr *)dst->remote_ip6);
+	ip6h->saddr		= *((struct in6_addr *)src->remote_ip6);
+	ip6h->hop_limit		= OVSTACK_OUTER_TTL;
+
+	/* ip6_fragment () sends PTB to ourselves unless local_df */
+	skb->local_df = frag;
 
 	//skb->pkt_type = PACKET_HOST;
 
+	len = skb->len;
 	rc = ip6_local_out (skb);
+	ov_locator_tx_account (src, dst, len, rc);
 
 	if (net_xmit_eval (rc) == 0) {
 		return rc;
@@ -939,160 +2016,907 @@ ovstack_xmit_ipv6_loc (struct sk_buff * skb, struct net_device * dev,
 	}
 
 	return NETDEV_TX_OK;
+
+drop:
+	dev->stats.tx_dropped++;
+	ovstack_drop (skb, (struct ovhdr *) skb->data, reason);
+	return NETDEV_TX_OK;
+}
+
+/*
+ * GSO skb is segmented after its route and locators are resolved, so that
+ * routing is done once per super packet and each segment only gets outer
+ * headers. skb->data is ovhdr, network header is the inner one.
+ */
+static netdev_tx_t
+ovstack_xmit_gso_segment (struct sk_buff * skb, struct net_device * dev,
+			  struct ov_locator * src, struct ov_locator * dst,
+			  __be16 sport)
+{
+	struct ovhdr ovh;
+	struct sk_buff * segs, * next;
+
+	memcpy (&ovh, skb->data, sizeof (struct ovhdr));
+	__skb_pull (skb, sizeof (struct ovhdr));
+
+	/* segments have the full inner checksum */
+	segs = skb_gso_segment (skb, 0);
+	if (IS_ERR_OR_NULL (segs)) {
+		dev->stats.tx_dropped++;
+		ovstack_drop (skb, &ovh, OVSTACK_DROP_GSO_SEGMENT);
+		return NETDEV_TX_OK;
+	}
+	consume_skb (skb);
+
+	for (; segs; segs = next) {
+		next = segs->next;
+		segs->next = NULL;
+
+		if (skb_cow_head (segs, sizeof (struct ovhdr))) {
+			dev->stats.tx_dropped++;
+			ovstack_drop (segs, &ovh, OVSTACK_DROP_NOMEM);
+			continue;
+		}
+		memcpy (__skb_push (segs, sizeof (struct ovhdr)), &ovh,
+			sizeof (struct ovhdr));
+
+		if (src->remote_ip_family == AF_INET)
+			ovstack_xmit_ipv4_loc (segs, dev, src, dst, sport);
+		else
+			ovstack_xmit_ipv6_loc (segs, dev, src, dst, sport);
+	}
+
+	return NETDEV_TX_OK;
+}
+
+/*
+ * select src and dst locators for the next hop. returns encapsulation of
+ * the dst locator, or -ENOENT if there is no locator.
+ */
+static inline int
+ovstack_select_locators (struct ovstack_app * ovapp,
+			 struct ortable_plan * plan,
+			 struct ortable_plan_nexthop * pnxt, __be32 hash,
+			 struct ov_locator ** srcp, struct ov_locator ** dstp)
+{
+	struct ov_locator * src, * dst;
+
+	/* set src locator address */
+	if (plan->family == OV_NODE_NO_LOCATOR)
+		return -ENOENT;
+
+	src = find_ov_locator_by_hash (OVSTACK_APP_OWNNODE (ovapp),
+				       hash, plan->family);
+	if (!src)
+		return -ENOENT;
+
+	/* set dst locator address */
+	dst = find_ov_locator_by_hash (pnxt->node, hash,
+				       src->remote_ip_family);
+	if (!dst) {
+		pr_debug ("%s: node id %pI4 has no locator\n",
+			  __func__, &pnxt->nxt);
+		return -ENOENT;
+	}
+
+	*srcp = src;
+	*dstp = dst;
+
+	/* encapsulation of the dst locator overrides the app */
+	return (dst->encap != OVSTACK_ENCAP_DEFAULT) ? dst->encap :
+		ovapp->encap;
 }
 
 static inline netdev_tx_t
-ovstack_xmit_node (struct sk_buff * skb, struct net_device * dev, __be32 nxt)
+ovstack_xmit_node (struct sk_buff * skb, struct net_device * dev,
+		   struct ovstack_app * ovapp, struct ortable_plan * plan,
+		   struct ortable_plan_nexthop * pnxt)
 {
-	int ret;
-	u8 loc4count = 0, loc6count = 0, ai_family = 0;
-	struct net * net = dev_net (dev);
+	int encap, reason;
+	__be16 sport;
 	struct ovhdr * ovh;
-	
-	union addr {
-		struct in_addr addr4;
-		struct in6_addr addr6;
-	} src_addr, dst_addr;
+	struct ov_locator * src, * dst;
 
 	ovh = (struct ovhdr *) skb->data;
 
 	/* XXX: rpf check
-	if (ov_nexthop_rpf_check (skb, net, ovh->ov_app, nxt))
+	if (ov_nexthop_rpf_check (skb, dev_net (dev), ovh->ov_app, pnxt->nxt))
 		goto rpfcheck_drop;
 	*/
 
-	loc4count = ovstack_ipv4_loc_count (net, ovh->ov_app);
-	loc6count = ovstack_ipv6_loc_count (net, ovh->ov_app);
-
-	/* set src locator address */
-	if (loc4count && loc6count)
-		ai_family = ovstack_src_loc (&src_addr, net, 
-					     ovh->ov_app, ovh->ov_hash);
-	else if (loc4count)
-		ai_family = ovstack_ipv4_src_loc (&src_addr, net, 
-						  ovh->ov_app, ovh->ov_hash);
-	else if (loc6count)
-		ai_family = ovstack_ipv6_src_loc (&src_addr, net, 
-						  ovh->ov_app, ovh->ov_hash);
-	else 
+	encap = ovstack_select_locators (ovapp, plan, pnxt, ovh->ov_hash,
+					 &src, &dst);
+	if (encap < 0) {
+		reason = OVSTACK_DROP_NO_LOCATOR;
 		goto noroute_drop;
-	
-	/* set dst locator address */
-	if (ai_family == AF_INET) {
-		ret = ovstack_ipv4_dst_loc (&dst_addr, net, ovh->ov_app,
-					    nxt, ovh->ov_hash);
-		if (!ret)
-			goto noroute_drop;
-
-		return ovstack_xmit_ipv4_loc (skb, dev, &src_addr.addr4,
-					      &dst_addr.addr4);
+	}
 
-	} else if (ai_family == AF_INET6) {
-		ret = ovstack_ipv6_dst_loc (&dst_addr, net, ovh->ov_app,
-					    nxt, ovh->ov_hash);
-		if (!ret)
+	sport = (encap == OVSTACK_ENCAP_UDP) ?
+		ovstack_udp_src_port (ovh->ov_hash) : 0;
+
+	OVSTACK_APP_STATS_ADD (ovapp, tx_packets, tx_bytes, skb->len);
+	trace_ovstack_xmit_node (skb, ovh, pnxt->nxt, src->remote_ip_family,
+				 src->remote_ip6, dst->remote_ip6, encap);
+
+	if (skb_is_gso (skb)) {
+		/* UDP tunnel GSO of the kernel handles ethernet over UDP
+		 * over IPv4. Others are segmented here. */
+		if (!sport || src->remote_ip_family != AF_INET ||
+		    ovh->ov_app != OVAPP_ETHERNET)
+			return ovstack_xmit_gso_segment (skb, dev, src, dst,
+							 sport);
+	} else if (skb->ip_summed == CHECKSUM_PARTIAL) {
+		/* outer headers hide the inner checksum from devices */
+		if (skb_checksum_help (skb)) {
+			reason = OVSTACK_DROP_CSUM;
 			goto noroute_drop;
-
-		return ovstack_xmit_ipv6_loc (skb, dev, &src_addr.addr6,
-					      &dst_addr.addr6);
-	} else  {
-		pr_debug ("%s: unknwon locator family %d", 
-			  __func__, ai_family);
-		goto error_drop;
+		}
 	}
-	
-error_drop:
+
+	if (src->remote_ip_family == AF_INET) 
+		return ovstack_xmit_ipv4_loc (skb, dev, src, dst, sport);
+	else if (src->remote_ip_family == AF_INET6) 
+		return ovstack_xmit_ipv6_loc (skb, dev, src, dst, sport);
+
+	pr_debug ("%s: unknwon locator family %d", 
+		  __func__, src->remote_ip_family);
 	dev->stats.tx_errors++;
 	dev->stats.tx_aborted_errors++;
-rpfcheck_drop:
+	reason = OVSTACK_DROP_NO_LOCATOR;
+
 noroute_drop:
+	OVSTACK_APP_STATS_INC (ovapp, tx_dropped);
+	ovstack_drop (skb, ovh, reason);
 	return NETDEV_TX_OK;
 }
 
+/*
+ * Replica of a multi-destination packet. The linear part is copied into
+ * a new head with room for any outer headers, and paged data is shared
+ * with the original skb. So outer headers are pushed without
+ * skb_cow_head () reallocation. A linear skb (ARP, ND and the like) is
+ * copied whole; its head must be written for the outer headers anyway.
+ */
+static inline struct sk_buff *
+ovstack_replicate (struct sk_buff * skb)
+{
+	return __pskb_copy (skb, max_t (unsigned int, skb_headroom (skb),
+					OVSTACK_REPLICA_HEADROOM),
+			    GFP_ATOMIC);
+}
+
 inline netdev_tx_t 
 ovstack_xmit (struct sk_buff * skb, struct net_device * dev)
 {
-	int ret, cloned = 0;
+	int local, reason;
+	unsigned int n;
+	__be32 own_id;
 	struct ovhdr * ovh;
 	struct net * net = dev_net (dev);
 	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
 	struct ovstack_app * ovapp;
 	struct ortable * ort;
-	struct ortable_nexthop * ortnxt;
+	struct ortable_plan * plan;
+	struct ortable_plan_nexthop * pnxt;
 	struct sk_buff * mskb;
+	struct sk_buff_head legs;
 
 	ovh = (struct ovhdr *) skb->data;
 	ovapp = OVSTACK_NET_APP (ovnet, ovh->ov_app);
 
-	if (!ovapp) {
-		pr_debug ("%s: unregisterd ovstack app %d", 
-			  __func__, ovh->ov_app);
-		return NETDEV_TX_OK;
+	if (!ovapp) {
+		reason = OVSTACK_DROP_UNKNOWN_APP;
+		goto drop;
+	}
+
+	ort = find_ortable (OVSTACK_APP_ORTABLES (ovapp), ovh->ov_dst);
+	plan = (ort) ? rcu_dereference_raw (ort->plan) : NULL;
+	trace_ovstack_xmit_route (skb, ovh, plan ? plan->nxt_count : 0);
+	if (!plan || plan->nxt_count == 0) {
+		reason = OVSTACK_DROP_NO_ROUTE;
+		goto app_drop;
+	}
+
+	/* unicast, or one next hop of ecmp chosen by the flow.
+	 * hand the skb to the next hop as is */
+	if (plan->mode == OVSTACK_ROUTE_MODE_ECMP) {
+		pnxt = ortable_plan_select (plan, ovh->ov_hash);
+		if (!(pnxt->flags & ORT_PLAN_NXT_OWN))
+			return ovstack_xmit_node (skb, dev, ovapp, plan, pnxt);
+
+		/* own node is chosen. deliver it unless it is from me */
+		if (OVSTACK_APP_OWNNODE (ovapp)->node_id == ovh->ov_src) {
+			reason = OVSTACK_DROP_LOOP;
+			goto app_drop;
+		}
+		ovstack_mcast_recv (skb);
+		return NETDEV_TX_OK;
+	}
+
+	if (plan->nxt_count == 1 && !(plan->nxts[0].flags & ORT_PLAN_NXT_OWN))
+		return ovstack_xmit_node (skb, dev, ovapp, plan, &plan->nxts[0]);
+
+	/* resolve checksum once, instead of for each replica */
+	if (!skb_is_gso (skb) && skb->ip_summed == CHECKSUM_PARTIAL) {
+		if (skb_checksum_help (skb)) {
+			reason = OVSTACK_DROP_CSUM;
+			goto app_drop;
+		}
+	}
+
+	own_id = OVSTACK_APP_OWNNODE (ovapp)->node_id;
+	local = 0;
+
+	/* make all replicas first, and then send them as a batch */
+	__skb_queue_head_init (&legs);
+
+	for (n = 0; n < plan->nxt_count; n++) {
+		pnxt = &plan->nxts[n];
+
+		if (pnxt->flags & ORT_PLAN_NXT_OWN) {
+			/* to me and from me. this is mcast echo -> drop */
+			if (own_id != ovh->ov_src)
+				local = 1;
+			continue;
+		}
+
+		mskb = ovstack_replicate (skb);
+		if (unlikely (!mskb)) {
+			/* the replica is lost, the original is not freed */
+			OVSTACK_APP_STATS_INC (ovapp, tx_dropped);
+			ovstack_drop_account (skb, ovh, OVSTACK_DROP_NOMEM,
+					      _THIS_IP_);
+			continue;
+		}
+
+		OVSTACK_APP_STATS_INC (ovapp, mcast_replicas);
+		OVSTACK_XMIT_CB (mskb)->pnxt = pnxt;
+		__skb_queue_tail (&legs, mskb);
+	}
+
+	/* a failed leg is counted by ovstack_xmit_node (), and does not
+	 * stop the others */
+	while ((mskb = __skb_dequeue (&legs)) != NULL)
+		ovstack_xmit_node (mskb, dev, ovapp, plan,
+				   OVSTACK_XMIT_CB (mskb)->pnxt);
+
+	/* mcast packet, to me and not from me -> recv. replicas do not
+	 * refer to the head of the original skb, so it is delivered. */
+	if (local) {
+		if (skb_unclone (skb, GFP_ATOMIC)) {
+			reason = OVSTACK_DROP_NOMEM;
+			goto app_drop;
+		}
+		ovstack_mcast_recv (skb);
+		return NETDEV_TX_OK;
+	}
+
+	/* all replicas are sent, the original is not a drop */
+	consume_skb (skb);
+	return NETDEV_TX_OK;
+
+app_drop:
+	OVSTACK_APP_STATS_INC (ovapp, tx_dropped);
+drop:
+	ovstack_drop (skb, ovh, reason);
+	return NETDEV_TX_OK;
+}
+EXPORT_SYMBOL (ovstack_xmit);
+
+/*
+ * Transit fast path. Outer headers of the received packet are still in
+ * front of skb->data, so they are rewritten in place for the next hop
+ * when the next hop uses the same family and encapsulation. The packet
+ * does not pass through ip_local_out (). Others go to ovstack_xmit ().
+ */
+static netdev_tx_t
+ovstack_forward (struct sk_buff * skb, struct ovstack_app * ovapp)
+{
+	int rc, encap, reason;
+	unsigned int len, hlen, olen;
+	__be16 sport;
+	struct ovhdr * ovh;
+	struct net_device * dev = skb->dev;
+	struct ortable * ort;
+	struct ortable_plan * plan;
+	struct ortable_plan_nexthop * pnxt;
+	struct ov_locator * src, * dst;
+	struct iphdr * iph;
+	struct ipv6hdr * ip6h;
+	struct udphdr * uh;
+	struct rtable * rt;
+	struct dst_entry * dste;
+
+	if (skb_is_gso (skb) || skb->ip_summed == CHECKSUM_PARTIAL)
+		goto slow_path;
+
+	ovh = (struct ovhdr *) skb->data;
+	ort = find_ortable (OVSTACK_APP_ORTABLES (ovapp), ovh->ov_dst);
+	plan = (ort) ? rcu_dereference_raw (ort->plan) : NULL;
+	if (!plan || plan->nxt_count == 0 ||
+	    (plan->nxt_count > 1 && plan->mode != OVSTACK_ROUTE_MODE_ECMP))
+		goto slow_path;
+
+	pnxt = ortable_plan_select (plan, ovh->ov_hash);
+	if (pnxt->flags & ORT_PLAN_NXT_OWN)
+		goto slow_path;
+
+	encap = ovstack_select_locators (ovapp, plan, pnxt,
+					 ovh->ov_hash, &src, &dst);
+	if (encap < 0)
+		goto slow_path;
+
+	/* received outer headers must be the same as the next hop */
+	hlen = skb->data - skb_network_header (skb);
+	if (encap == OVSTACK_ENCAP_UDP) {
+		sport = ovstack_udp_src_port (ovh->ov_hash);
+		hlen -= sizeof (struct udphdr);
+	} else
+		sport = 0;
+
+	if (src->remote_ip_family == AF_INET) {
+		if (skb->protocol != htons (ETH_P_IP) ||
+		    hlen != sizeof (struct iphdr) ||
+		    ip_hdr (skb)->protocol !=
+		    (sport ? IPPROTO_UDP : IPPROTO_OVSTACK))
+			goto slow_path;
+	} else {
+		if (skb->protocol != htons (ETH_P_IPV6) ||
+		    hlen != sizeof (struct ipv6hdr) ||
+		    ipv6_hdr (skb)->nexthdr !=
+		    (sport ? IPPROTO_UDP : IPPROTO_OVSTACK))
+			goto slow_path;
+	}
+
+	if (skb_cow_head (skb, 0)) {
+		reason = OVSTACK_DROP_NOMEM;
+		goto drop;
+	}
+	ovh = (struct ovhdr *) skb->data;
+
+	olen = skb->data - skb_network_header (skb);
+	__skb_push (skb, olen);
+	uh = (struct udphdr *) (skb->data + hlen);
+	skb->ip_summed = CHECKSUM_NONE;
+
+	if (src->remote_ip_family == AF_INET) {
+		rt = ovstack_route4 (dev, src, dst);
+		if (!rt) {
+			reason = OVSTACK_DROP_UNDERLAY_ROUTE;
+			goto drop;
+		}
+		if (skb->len > dst_mtu (&rt->dst)) {
+			/* DF and path MTU are handled by the slow path */
+			ip_rt_put (rt);
+			__skb_pull (skb, olen);
+			goto slow_path;
+		}
+
+		iph = ip_hdr (skb);
+		csum_replace4 (&iph->check, iph->saddr, *(src->remote_ip4));
+		csum_replace4 (&iph->check, iph->daddr, *(dst->remote_ip4));
+		csum_replace2 (&iph->check, htons (iph->ttl << 8),
+			       htons (OVSTACK_OUTER_TTL << 8));
+		iph->saddr	= *(src->remote_ip4);
+		iph->daddr	= *(dst->remote_ip4);
+		iph->ttl	= OVSTACK_OUTER_TTL;
+
+		/* checksum of UDP over IPv4 is not used */
+		if (sport) {
+			uh->source	= sport;
+			uh->check	= 0;
+		}
+
+		memset (IPCB (skb), 0, sizeof (*IPCB (skb)));
+		skb_dst_drop (skb);
+		skb_dst_set (skb, &rt->dst);
+	} else {
+		dste = ovstack_route6 (dev, src, dst);
+		if (!dste) {
+			reason = OVSTACK_DROP_UNDERLAY_ROUTE;
+			goto drop;
+		}
+		if (skb->len > dst_mtu (dste)) {
+			dst_release (dste);
+			__skb_pull (skb, olen);
+			goto slow_path;
+		}
+
+		ip6h = ipv6_hdr (skb);
+		if (sport) {
+			inet_proto_csum_replace16 (&uh->check, skb,
+						   ip6h->saddr.s6_addr32,
+						   src->remote_ip6, 1);
+			inet_proto_csum_replace16 (&uh->check, skb,
+						   ip6h->daddr.s6_addr32,
+						   dst->remote_ip6, 1);
+			inet_proto_csum_replace2 (&uh->check, skb,
+						  uh->source, sport, 0);
+			/* ov_ttl is decremented by ovstack_recv () */
+			inet_proto_csum_replace2 (&uh->check, skb,
+						  htons ((ovh->ov_ttl + 1) << 8),
+						  htons (ovh->ov_ttl << 8), 0);
+			if (uh->check == 0)
+				uh->check = CSUM_MANGLED_0;
+			uh->source = sport;
+		}
+		ip6h->saddr	= *((struct in6_addr *)src->remote_ip6);
+		ip6h->daddr	= *((struct in6_addr *)dst->remote_ip6);
+		ip6h->hop_limit	= OVSTACK_OUTER_TTL;
+
+		memset (IP6CB (skb), 0, sizeof (*IP6CB (skb)));
+		skb_dst_drop (skb);
+		skb_dst_set (skb, dste);
+	}
+
+	nf_reset (skb);
+
+	OVSTACK_APP_STATS_ADD (ovapp, tx_packets, tx_bytes, skb->len);
+	trace_ovstack_xmit_node (skb, ovh, pnxt->nxt,
+				 src->remote_ip_family, src->remote_ip6,
+				 dst->remote_ip6, encap);
+
+	/* dev is the receiving underlay device, so charge the app */
+	len = skb->len;
+	rc = dst_output (skb);
+	ov_locator_tx_account (src, dst, len, rc);
+	if (net_xmit_eval (rc) != 0)
+		OVSTACK_APP_STATS_INC (ovapp, tx_dropped);
+
+	return NETDEV_TX_OK;
+
+slow_path:
+	return ovstack_xmit (skb, dev);
+
+drop:
+	OVSTACK_APP_STATS_INC (ovapp, tx_dropped);
+	ovstack_drop (skb, ovh, reason);
+	return NETDEV_TX_OK;
+}
+
+
+/*****************************
+ ****	locator liveness probing
+ *****************************/
+
+/*
+ * A probe is an ovhdr with OVSTACK_FLAG_PROBE sent from each own locator
+ * to each locator of the same family of other nodes, and is answered by
+ * any node of the app with OVSTACK_FLAG_PROBE_REPLY in the reverse
+ * direction. A reply refreshes both locators of the pair. A locator that
+ * is not refreshed within the detection time is marked down and left out
+ * of locator tables, and a LOCATOR_UPDATE event is sent.
+ */
+
+static int ovstack_notify_locator (int cmd, __u8 app, struct ov_locator * loc,
+				   gfp_t flags);
+
+/* probes are built from scratch, there is no upper device */
+static int
+ovstack_probe_send (struct net * net, u8 family, __be32 * saddr,
+		    __be32 * daddr, int encap, struct ovhdr * ovh)
+{
+	int reason;
+	__be16 sport = 0;
+	struct sk_buff * skb;
+	struct udphdr * uh;
+	struct iphdr * iph;
+	struct ipv6hdr * ip6h;
+	struct flowi4 fl4;
+	struct flowi6 fl6;
+	struct rtable * rt;
+	struct dst_entry * dste;
+
+	skb = alloc_skb (OVSTACK_REPLICA_HEADROOM + sizeof (struct ovhdr),
+			 GFP_ATOMIC);
+	if (!skb)
+		return -ENOMEM;
+
+	skb_reserve (skb, OVSTACK_REPLICA_HEADROOM);
+	memcpy (skb_put (skb, sizeof (struct ovhdr)), ovh,
+		sizeof (struct ovhdr));
+
+	if (encap == OVSTACK_ENCAP_UDP)
+		sport = ovstack_udp_src_port (ovh->ov_hash);
+
+	if (family == AF_INET) {
+		memset (&fl4, 0, sizeof (fl4));
+		fl4.saddr = *saddr;
+		fl4.daddr = *daddr;
+
+		rt = ip_route_output_key (net, &fl4);
+		if (IS_ERR (rt)) {
+			reason = OVSTACK_DROP_UNDERLAY_ROUTE;
+			goto drop;
+		}
+		skb_dst_set (skb, &rt->dst);
+
+		if (sport)
+			ovstack_push_udp (skb, sport);
+
+		__skb_push (skb, sizeof (struct iphdr));
+		skb_reset_network_header (skb);
+		iph		= ip_hdr (skb);
+		iph->version	= 4;
+		iph->ihl	= sizeof (struct iphdr) >> 2;
+		iph->frag_off	= htons (IP_DF);
+		iph->protocol	= sport ? IPPROTO_UDP : IPPROTO_OVSTACK;
+		iph->tos	= 0;
+		iph->saddr	= *saddr;
+		iph->daddr	= *daddr;
+		iph->ttl	= OVSTACK_OUTER_TTL;
+		skb->ip_summed	= CHECKSUM_NONE;
+
+		return net_xmit_eval (ip_local_out (skb));
+	}
+
+	memset (&fl6, 0, sizeof (fl6));
+	fl6.saddr = *((struct in6_addr *) saddr);
+	fl6.daddr = *((struct in6_addr *) daddr);
+
+	dste = ip6_route_output (net, NULL, &fl6);
+	if (dste->error) {
+		dst_release (dste);
+		reason = OVSTACK_DROP_UNDERLAY_ROUTE;
+		goto drop;
+	}
+	skb_dst_set (skb, dste);
+
+	if (sport) {
+		uh = ovstack_push_udp (skb, sport);
+		uh->check = csum_ipv6_magic ((struct in6_addr *) saddr,
+					     (struct in6_addr *) daddr,
+					     skb->len, IPPROTO_UDP,
+					     skb_checksum (skb, 0, skb->len, 0));
+		if (uh->check == 0)
+			uh->check = CSUM_MANGLED_0;
+	}
+
+	__skb_push (skb, sizeof (struct ipv6hdr));
+	skb_reset_network_header (skb);
+	ip6h			= ipv6_hdr (skb);
+	ip6h->version		= 6;
+	ip6h->priority		= 0;
+	ip6h->flow_lbl[0]	= 0;
+	ip6h->flow_lbl[1]	= 0;
+	ip6h->flow_lbl[2]	= 0;
+	ip6h->payload_len	= htons (skb->len - sizeof (struct ipv6hdr));
+	ip6h->nexthdr		= sport ? IPPROTO_UDP : IPPROTO_OVSTACK;
+	ip6h->saddr		= *((struct in6_addr *) saddr);
+	ip6h->daddr		= *((struct in6_addr *) daddr);
+	ip6h->hop_limit		= OVSTACK_OUTER_TTL;
+	skb->ip_summed		= CHECKSUM_NONE;
+
+	return net_xmit_eval (ip6_local_out (skb));
+
+drop:
+	ovstack_drop (skb, (struct ovhdr *) skb->data, reason);
+	return -EHOSTUNREACH;
+}
+
+/* skb->data is ovhdr, and network header is the outer IP header */
+static int
+ovstack_probe_recv (struct sk_buff * skb, struct ovstack_app * ovapp,
+		    struct ovhdr * ovh)
+{
+	u8 family;
+	int encap;
+	__be32 * saddr, * daddr;
+	struct iphdr * iph = ip_hdr (skb);
+	struct ipv6hdr * ip6h;
+	struct ovhdr reply;
+	struct ov_node * node;
+	struct ov_locator * loc;
+
+	if (iph->version == 4) {
+		family = AF_INET;
+		saddr = &iph->saddr;
+		daddr = &iph->daddr;
+		encap = (iph->protocol == IPPROTO_UDP) ?
+			OVSTACK_ENCAP_UDP : OVSTACK_ENCAP_RAW;
+	} else {
+		ip6h = ipv6_hdr (skb);
+		family = AF_INET6;
+		saddr = ip6h->saddr.s6_addr32;
+		daddr = ip6h->daddr.s6_addr32;
+		encap = (ip6h->nexthdr == IPPROTO_UDP) ?
+			OVSTACK_ENCAP_UDP : OVSTACK_ENCAP_RAW;
+	}
+
+	if (ovh->ov_flags & OVSTACK_FLAG_PROBE) {
+		reply = *ovh;
+		reply.ov_flags = OVSTACK_FLAG_PROBE_REPLY;
+		reply.ov_dst = ovh->ov_src;
+		reply.ov_src = OVSTACK_APP_OWNNODE (ovapp)->node_id;
+		ovstack_probe_send (dev_net (skb->dev), family, daddr, saddr,
+				    encap, &reply);
+		consume_skb (skb);
+		return 0;
+	}
+
+	/* reply to our probe. both locators of the pair are alive */
+	node = find_ov_node_by_id (ovapp, ovh->ov_src);
+	loc = find_ov_locator_by_addr (node, saddr, family);
+	if (loc)
+		loc->probe_rx = jiffies;
+
+	loc = find_ov_locator_by_addr (OVSTACK_APP_OWNNODE (ovapp), daddr,
+				       family);
+	if (loc)
+		loc->probe_rx = jiffies;
+
+	consume_skb (skb);
+	return 0;
+}
+
+static void
+ovstack_probe_node (struct ovstack_app * ovapp, struct ov_node * node)
+{
+	int encap;
+	struct ovhdr ovh;
+	struct ov_locator * src, * dst;
+	struct ov_node * ownnode = OVSTACK_APP_OWNNODE (ovapp);
+
+	memset (&ovh, 0, sizeof (ovh));
+	ovh.ov_version	= OVSTACK_HEADER_VERSION;
+	ovh.ov_app	= ovapp->ov_app;
+	ovh.ov_ttl	= 1;
+	ovh.ov_flags	= OVSTACK_FLAG_PROBE;
+	ovh.ov_dst	= node->node_id;
+	ovh.ov_src	= ownnode->node_id;
+
+	list_for_each_entry (dst, &(node->ipv4_locator_list), list) {
+		encap = (dst->encap != OVSTACK_ENCAP_DEFAULT) ? dst->encap :
+			ovapp->encap;
+		list_for_each_entry (src, &(ownnode->ipv4_locator_list),
+				     list) {
+			ovh.ov_hash = htonl (ovapp->probe_seq++);
+			ovstack_probe_send (ovapp->net, AF_INET,
+					    src->remote_ip4, dst->remote_ip4,
+					    encap, &ovh);
+		}
+	}
+
+	list_for_each_entry (dst, &(node->ipv6_locator_list), list) {
+		encap = (dst->encap != OVSTACK_ENCAP_DEFAULT) ? dst->encap :
+			ovapp->encap;
+		list_for_each_entry (src, &(ownnode->ipv6_locator_list),
+				     list) {
+			ovh.ov_hash = htonl (ovapp->probe_seq++);
+			ovstack_probe_send (ovapp->net, AF_INET6,
+					    src->remote_ip6, dst->remote_ip6,
+					    encap, &ovh);
+		}
+	}
+
+	return;
+}
+
+/*
+ * update down flags of locators of the node. If detect is 0, all
+ * locators are reset to up. Locator tables are rebuilt on a change.
+ */
+static void
+ov_node_probe_check (struct ovstack_app * ovapp, struct ov_node * node,
+		     unsigned long detect)
+{
+	int n;
+	u8 flags;
+	bool changed = false;
+	struct ov_locator * loc;
+	struct list_head * lists[] = {
+		&(node->ipv4_locator_list), &(node->ipv6_locator_list),
+	};
+
+	for (n = 0; n < ARRAY_SIZE (lists); n++) {
+		list_for_each_entry (loc, lists[n], list) {
+			if (!detect)
+				loc->probe_rx = jiffies;
+
+			flags = loc->flags & ~OVSTACK_LOCATOR_F_DOWN;
+			if (detect && time_after (jiffies,
+						  loc->probe_rx + detect))
+				flags |= OVSTACK_LOCATOR_F_DOWN;
+
+			if (flags == loc->flags)
+				continue;
+
+			loc->flags = flags;
+			changed = true;
+			pr_debug ("%s: node %pI4 locator is %s\n", __func__,
+				  &node->node_id,
+				  (flags & OVSTACK_LOCATOR_F_DOWN) ?
+				  "down" : "up");
+			ovstack_notify_locator (OVSTACK_EVENT_LOCATOR_UPDATE,
+						ovapp->ov_app, loc, GFP_KERNEL);
+		}
+	}
+
+	if (changed)
+		ov_node_loc_table_update (node, GFP_KERNEL);
+
+	return;
+}
+
+static void
+ovstack_probe_reset (struct ovstack_app * ovapp)
+{
+	struct ov_node * node;
+
+	ov_node_probe_check (ovapp, OVSTACK_APP_OWNNODE (ovapp), 0);
+	list_for_each_entry (node, &(ovapp->node_chain), chain)
+		ov_node_probe_check (ovapp, node, 0);
+
+	return;
+}
+
+/* per app timer of probing. runs under genl_lock as control plane */
+static void
+ovstack_probe_work (struct work_struct * work)
+{
+	unsigned long detect;
+	struct ov_node * node;
+	struct ovstack_app * ovapp;
+
+	ovapp = container_of (to_delayed_work (work), struct ovstack_app,
+			      probe_work);
+
+	genl_lock ();
+
+	if (!ovapp->probe_interval)
+		goto out;
+
+	detect = msecs_to_jiffies (ovapp->probe_interval *
+				   ovapp->probe_multi);
+
+	ov_node_probe_check (ovapp, OVSTACK_APP_OWNNODE (ovapp), detect);
+
+	list_for_each_entry (node, &(ovapp->node_chain), chain) {
+		ov_node_probe_check (ovapp, node, detect);
+		ovstack_probe_node (ovapp, node);
+	}
+
+	schedule_delayed_work (&(ovapp->probe_work),
+			       msecs_to_jiffies (ovapp->probe_interval));
+out:
+	genl_unlock ();
+	return;
+}
+
+
+/*****************************
+ ****	load-aware locator weights
+ *****************************/
+
+/*
+ * Every adaptive interval, a locator whose underlay egress failed more
+ * than 1/2^OV_ADAPT_ERR_SHIFT of its packets since the last run loses a
+ * quarter of its effective weight, and a locator without such failures
+ * gets back 1/8 of its configured weight. Maglev tables move only the
+ * flows of the changed slots, so flows of other locators stay.
+ */
+#define OV_ADAPT_ERR_SHIFT	6
+
+static void
+ov_locator_stats_get (struct ov_locator * loc,
+		      struct ovstack_locator_stats * sum)
+{
+	unsigned int cpu;
+	struct ov_locator_pcpu_stats tmp;
+
+	memset (sum, 0, sizeof (*sum));
+
+	for_each_possible_cpu (cpu) {
+		unsigned int start;
+		const struct ov_locator_pcpu_stats * stats
+			= per_cpu_ptr (loc->stats, cpu);
+
+		do {
+			start = u64_stats_fetch_begin_bh (&stats->syncp);
+			memcpy (&tmp, stats, sizeof (tmp));
+		} while (u64_stats_fetch_retry_bh (&stats->syncp, start));
+
+		sum->tx_packets	+= tmp.tx_packets;
+		sum->tx_bytes	+= tmp.tx_bytes;
+		sum->tx_errors	+= tmp.tx_errors;
+		sum->rx_packets	+= tmp.rx_packets;
+		sum->rx_bytes	+= tmp.rx_bytes;
+	}
+}
+
+/* returns true if the effective weight is changed */
+static bool
+ov_locator_adapt (struct ov_locator * loc, bool reset)
+{
+	u64 pkts, errs;
+	unsigned int eff = loc->eff_weight;
+	struct ovstack_locator_stats stats;
+
+	ov_locator_stats_get (loc, &stats);
+	pkts = stats.tx_packets - loc->adapt_tx_packets;
+	errs = stats.tx_errors - loc->adapt_tx_errors;
+	loc->adapt_tx_packets = stats.tx_packets;
+	loc->adapt_tx_errors = stats.tx_errors;
+
+	if (reset || !loc->weight)
+		eff = loc->weight;
+	else if ((errs << OV_ADAPT_ERR_SHIFT) > pkts + errs)
+		eff = (eff > 1) ? eff - max_t (unsigned int, eff >> 2, 1) : 1;
+	else
+		eff = min_t (unsigned int, loc->weight,
+			     eff + max_t (unsigned int, loc->weight >> 3, 1));
+
+	if (eff == loc->eff_weight)
+		return false;
+
+	loc->eff_weight = eff;
+	return true;
+}
+
+static void
+ov_node_adapt (struct ov_node * node, bool reset)
+{
+	int n;
+	bool changed = false;
+	struct ov_locator * loc;
+	struct list_head * lists[] = {
+		&(node->ipv4_locator_list), &(node->ipv6_locator_list),
+	};
+
+	for (n = 0; n < ARRAY_SIZE (lists); n++) {
+		list_for_each_entry (loc, lists[n], list) {
+			if (ov_locator_adapt (loc, reset))
+				changed = true;
+		}
 	}
 
-	ort = find_ortable (ovapp, ovh->ov_dst);
-	if (!ort || ort->ort_nxt_count == 0) {
-		pr_debug ("%s: no route to host %pI4", __func__, &ovh->ov_dst);
-		return NETDEV_TX_OK;
+	if (changed) {
+		pr_debug ("%s: node %pI4 locator weights are adapted\n",
+			  __func__, &node->node_id);
+		ov_node_loc_table_update (node, GFP_KERNEL);
 	}
 
+	return;
+}
 
-	if (ort->ort_nxt_count > 1)
-		cloned = 1;
-
-	list_for_each_entry_rcu (ortnxt, &(ort->ort_nxts), list) {
-
-		/* mcast packet  */
-		if (OVSTACK_APP_OWNNODE (ovapp)->node_id != ovh->ov_src &&
-		    OVSTACK_APP_OWNNODE (ovapp)->node_id == ortnxt->ort_nxt) {
-			/* to me and not from me -> recv */
-			cloned = 1;
-			mskb = skb_copy (skb, GFP_ATOMIC);
-			if (!mskb) {
-				printk (KERN_INFO "ovstack : no buffer space "
-					"available for mcast packet\n");
-				goto skip;
-			}
-			ovstack_mcast_recv (mskb);
-			goto skip;
-		}
+static void
+ovstack_adapt_reset (struct ovstack_app * ovapp)
+{
+	struct ov_node * node;
 
-		/* mcast echo */
-		if (OVSTACK_APP_OWNNODE (ovapp)->node_id == ovh->ov_src &&
-		    OVSTACK_APP_OWNNODE (ovapp)->node_id == ortnxt->ort_nxt) {
-			/* to me and from me. this is mcast echo -> drop */
-			goto skip;
-		}
+	ov_node_adapt (OVSTACK_APP_OWNNODE (ovapp), true);
+	list_for_each_entry (node, &(ovapp->node_chain), chain)
+		ov_node_adapt (node, true);
 
-		if (ort->ort_nxt_count > 1) 
-			mskb = skb_clone (skb, GFP_ATOMIC);
-		else 
-			mskb = skb;
+	return;
+}
 
-		if (unlikely (!mskb)) {
-			dev->stats.tx_errors++;
-			dev->stats.tx_aborted_errors++;
-			printk (KERN_ERR "ovstack: failed to alloc skb\n");
-			goto skip;
-		}
+/* per app timer of adaptive weights. runs under genl_lock */
+static void
+ovstack_adapt_work (struct work_struct * work)
+{
+	struct ov_node * node;
+	struct ovstack_app * ovapp;
 
-		ret = ovstack_xmit_node (mskb, dev, ortnxt->ort_nxt);
+	ovapp = container_of (to_delayed_work (work), struct ovstack_app,
+			      adapt_work);
 
-		if (ret != NETDEV_TX_OK) {
-			if (cloned)
-				kfree_skb (skb);
-			return ret;
-		}
+	genl_lock ();
 
-	skip:;
-	}
+	if (!ovapp->adapt_interval)
+		goto out;
 
-	if (cloned)
-		kfree_skb (skb);
+	ov_node_adapt (OVSTACK_APP_OWNNODE (ovapp), false);
+	list_for_each_entry (node, &(ovapp->node_chain), chain)
+		ov_node_adapt (node, false);
 
-	return NETDEV_TX_OK;
+	schedule_delayed_work (&(ovapp->adapt_work),
+			       msecs_to_jiffies (ovapp->adapt_interval));
+out:
+	genl_unlock ();
+	return;
 }
-EXPORT_SYMBOL (ovstack_xmit);
+
 
 static __net_init int
 ovstack_init_net (struct net * net)
@@ -1105,13 +2929,34 @@ ovstack_init_net (struct net * net)
 	for (n = 0; n < OVSTACK_APP_MAX + 1; n++) 
 		ovnet->apps[n] = NULL;
 
+	/* packets can be received without UDP encapsulation sockets */
+	ovnet->sock4 = ovstack_udp_sock_create (net, AF_INET);
+	if (IS_ERR (ovnet->sock4)) {
+		printk (KERN_INFO "ovstack: failed to bind UDP port "
+			"%d (%ld)\n", OVSTACK_PORT, PTR_ERR (ovnet->sock4));
+		ovnet->sock4 = NULL;
+	}
+	ovnet->sock6 = ovstack_udp_sock_create (net, AF_INET6);
+	if (IS_ERR (ovnet->sock6)) {
+		printk (KERN_INFO "ovstack: failed to bind UDP6 port "
+			"%d (%ld)\n", OVSTACK_PORT, PTR_ERR (ovnet->sock6));
+		ovnet->sock6 = NULL;
+	}
+
 	return 0;
 }
 
 static __net_exit void
 ovstack_exit_net (struct net * net)
 {
+	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
+
 	/* XXX: destroy apps */
+
+	if (ovnet->sock4)
+		sk_release_kernel (ovnet->sock4->sk);
+	if (ovnet->sock6)
+		sk_release_kernel (ovnet->sock6->sk);
 	
 	return;
 }
@@ -1165,11 +3010,24 @@ static struct nla_policy ovstack_nl_policy[OVSTACK_ATTR_MAX + 1] = {
 	[OVSTACK_ATTR_EVENT]		= { .type = NLA_BINARY,
 					    .len = sizeof 
 					    (struct ovstack_genl_event)},
+	[OVSTACK_ATTR_ENCAP]		= { .type = NLA_U8, },
+	[OVSTACK_ATTR_STATS]		= { .type = NLA_BINARY,
+					    .len = sizeof
+					    (struct ovstack_app_stats)},
+	[OVSTACK_ATTR_DROP_STATS]	= { .type = NLA_BINARY,
+					    .len = sizeof (__u64) *
+					    OVSTACK_DROP_MAX },
+	[OVSTACK_ATTR_ROUTE_MODE]	= { .type = NLA_U8, },
+	[OVSTACK_ATTR_NXT_WEIGHT]	= { .type = NLA_U8, },
+	[OVSTACK_ATTR_BULK_ENTRY]	= { .type = NLA_NESTED, },
+	[OVSTACK_ATTR_BULK_CMD]		= { .type = NLA_U8, },
+	[OVSTACK_ATTR_ROUTE_STAGING]	= { .type = NLA_FLAG, },
+	[OVSTACK_ATTR_PROBE_INTERVAL]	= { .type = NLA_U32, },
+	[OVSTACK_ATTR_PROBE_MULTI]	= { .type = NLA_U8, },
+	[OVSTACK_ATTR_ADAPTIVE_INTERVAL] = { .type = NLA_U32, },
 };
 
 static int ovstack_notify_node_id_set (__u8 app, __be32 node_id, gfp_t flags);
-static int ovstack_notify_locator (int cmd, __u8 app, struct ov_locator * loc,
-				   gfp_t flags);
 
 static int
 ovstack_nl_cmd_node_id_set (struct sk_buff * skb, struct genl_info * info)
@@ -1196,6 +3054,7 @@ ovstack_nl_cmd_node_id_set (struct sk_buff * skb, struct genl_info * info)
 	node_id = nla_get_be32 (info->attrs[OVSTACK_ATTR_NODE_ID]);
 
 	OVSTACK_APP_OWNNODE (OVSTACK_NET_APP(ovnet, app))->node_id = node_id;
+	ovstack_app_plan_update (OVSTACK_NET_APP (ovnet, app));
 
 	ovstack_notify_node_id_set (app, node_id, GFP_KERNEL);
 
@@ -1206,7 +3065,7 @@ static int
 ovstack_nl_cmd_locator_add (struct sk_buff * skb, struct genl_info * info)
 {
 	__be32 * addr;
-	u8 app, ai_family, weight = OVSTACK_DEFAULT_WEIGHT;
+	u8 app, ai_family, family, weight = OVSTACK_DEFAULT_WEIGHT;
 	struct in_addr addr4;
 	struct in6_addr addr6;
 	struct net * net = sock_net (skb->sk);
@@ -1259,16 +3118,16 @@ ovstack_nl_cmd_locator_add (struct sk_buff * skb, struct genl_info * info)
 		pr_debug ("%s: locator exists\n", __func__);
 		return -EEXIST;
 	}
-	loc = kmalloc (sizeof (struct ov_locator), GFP_KERNEL);
-	memset (loc, 0, sizeof (struct ov_locator));
-	loc->node = ownnode;
-	loc->remote_ip_family = ai_family;
-	loc->weight = weight;
-	memcpy (&loc->remote_ip, addr, 
-		(ai_family == AF_INET) ? sizeof (struct in_addr) :
-		sizeof (struct in6_addr));
+	loc = ov_locator_create (ai_family, addr, weight);
+	if (!loc)
+		return -ENOMEM;
+	family = ov_node_loc_family (ownnode);
 	ov_locator_add (ownnode, loc);
 
+	/* src locator family of xmit plans may be changed */
+	if (family != ov_node_loc_family (ownnode))
+		ovstack_app_plan_update (ovapp);
+
 	ovstack_notify_locator (OVSTACK_EVENT_LOCATOR_ADD, 
 				app, loc, GFP_KERNEL);
 
@@ -1279,7 +3138,7 @@ static int
 ovstack_nl_cmd_locator_delete (struct sk_buff * skb, struct genl_info * info)
 {
 	__be32 * addr;
-	u8 app, ai_family;
+	u8 app, ai_family, family;
 	struct in_addr addr4;
 	struct in6_addr addr6;
 	struct net * net = sock_net (skb->sk);
@@ -1325,12 +3184,17 @@ ovstack_nl_cmd_locator_delete (struct sk_buff * skb, struct genl_info * info)
 		pr_debug ("%s: locator does not exist\n", __func__);
 		return -ENOENT;
 	}
-	ov_locator_delete (ownnode, loc);
-	kfree_rcu (loc, rcu);
-
+	/* notify while loc and loc->node are valid */
 	ovstack_notify_locator (OVSTACK_EVENT_LOCATOR_DELETE, 
 				app, loc, GFP_KERNEL);
 
+	family = ov_node_loc_family (ownnode);
+	ov_locator_delete (ownnode, loc);
+	ov_locator_destroy (loc);
+
+	if (family != ov_node_loc_family (ownnode))
+		ovstack_app_plan_update (ovapp);
+
 	return 0;
 }
 
@@ -1409,6 +3273,7 @@ ovstack_nl_cmd_node_add (struct sk_buff * skb, struct genl_info * info)
 {
 	__be32 * addr, node_id;
 	u8 app, ai_family, weight = OVSTACK_DEFAULT_WEIGHT;
+	u8 encap = OVSTACK_ENCAP_DEFAULT;
 	struct in_addr addr4;
 	struct in6_addr addr6;
 	struct net * net = sock_net (skb->sk);
@@ -1459,24 +3324,30 @@ ovstack_nl_cmd_node_add (struct sk_buff * skb, struct genl_info * info)
 		}
 	}
 
+	if (info->attrs[OVSTACK_ATTR_ENCAP]) {
+		encap = nla_get_u8 (info->attrs[OVSTACK_ATTR_ENCAP]);
+		if (encap > OVSTACK_ENCAP_MAX) {
+			pr_debug ("%s: invalid encap %d\n", __func__, encap);
+			return -EINVAL;
+		}
+	}
+
 	/* add new locator to node */
 	ovapp = OVSTACK_NET_APP (ovnet, app);
 	node = find_ov_node_by_id (ovapp, node_id);
 	if (node == NULL) {
 		node = ov_node_create (node_id);
+		if (!node)
+			return -ENOMEM;
 		ov_node_add (ovapp, node);
 	}
 
 	loc = find_ov_locator_by_addr (node, addr, ai_family);
 	if (loc == NULL) {
-		loc = kmalloc (sizeof (struct ov_locator), GFP_KERNEL);
-		memset (loc, 0, sizeof (struct ov_locator));
-		loc->node = node;
-		loc->remote_ip_family = ai_family;
-		loc->weight = weight;
-		memcpy (&loc->remote_ip, addr, 
-			(ai_family == AF_INET) ? sizeof (struct in_addr) :
-			sizeof (struct in6_addr));
+		loc = ov_locator_create (ai_family, addr, weight);
+		if (!loc)
+			return -ENOMEM;
+		loc->encap = encap;
 		ov_locator_add (node, loc);
 	} else {
 		pr_debug ("%s: locator exists in node id %pI4\n", 
@@ -1541,9 +3412,13 @@ ovstack_nl_cmd_node_delete (struct sk_buff * skb, struct genl_info * info)
 		return -ENOENT;
 	}
 
-	/* if locator is not specified, delete this node */
+	/* if locator is not specified, delete this node. a node referred
+	 * by routes remains without locators until the routes are deleted */
 	if (addr == NULL) {
-		ov_node_delete (node);
+		if (node->refcnt)
+			ov_node_flush_locators (node);
+		else
+			ov_node_delete (ovapp, node);
 		goto out;
 	}
 
@@ -1558,7 +3433,7 @@ ovstack_nl_cmd_node_delete (struct sk_buff * skb, struct genl_info * info)
 				app, loc, GFP_KERNEL);
 
 	ov_locator_delete (node, loc);
-	kfree_rcu (loc, rcu);
+	ov_locator_destroy (loc);
 
 out:
 	return 0;
@@ -1643,6 +3518,124 @@ ovstack_nl_cmd_node_weight_set (struct sk_buff * skb, struct genl_info * info)
 	return 0;
 }
 
+static int
+ovstack_nl_cmd_encap_set (struct sk_buff * skb, struct genl_info * info)
+{
+	u8 app, encap;
+	struct net * net = sock_net (skb->sk);
+	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
+
+	if (!info->attrs[OVSTACK_ATTR_APP_ID]) {
+		pr_debug ("%s: app id is not specified\n", __func__);
+		return -EINVAL;
+	}
+	app = nla_get_u8 (info->attrs[OVSTACK_ATTR_APP_ID]);
+	if (!OVSTACK_NET_APP (ovnet, app)) {
+		pr_debug ("%s: app id %d does not exist\n", __func__, app);
+		return -EINVAL;
+	}
+
+	if (!info->attrs[OVSTACK_ATTR_ENCAP]) {
+		pr_debug ("%s: encap is not specified\n", __func__);
+		return -EINVAL;
+	}
+	encap = nla_get_u8 (info->attrs[OVSTACK_ATTR_ENCAP]);
+	if (encap != OVSTACK_ENCAP_RAW && encap != OVSTACK_ENCAP_UDP) {
+		pr_debug ("%s: invalid encap %d\n", __func__, encap);
+		return -EINVAL;
+	}
+
+	OVSTACK_NET_APP (ovnet, app)->encap = encap;
+
+	return 0;
+}
+
+static int
+ovstack_nl_cmd_probe_set (struct sk_buff * skb, struct genl_info * info)
+{
+	u8 app, multi = OVSTACK_PROBE_DEFAULT_MULTI;
+	u32 interval;
+	struct net * net = sock_net (skb->sk);
+	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
+	struct ovstack_app * ovapp;
+
+	if (!info->attrs[OVSTACK_ATTR_APP_ID]) {
+		pr_debug ("%s: app id is not specified\n", __func__);
+		return -EINVAL;
+	}
+	app = nla_get_u8 (info->attrs[OVSTACK_ATTR_APP_ID]);
+	if (!OVSTACK_NET_APP (ovnet, app)) {
+		pr_debug ("%s: app id %d does not exist\n", __func__, app);
+		return -EINVAL;
+	}
+
+	if (!info->attrs[OVSTACK_ATTR_PROBE_INTERVAL]) {
+		pr_debug ("%s: probe interval is not specified\n", __func__);
+		return -EINVAL;
+	}
+	interval = nla_get_u32 (info->attrs[OVSTACK_ATTR_PROBE_INTERVAL]);
+
+	if (info->attrs[OVSTACK_ATTR_PROBE_MULTI])
+		multi = nla_get_u8 (info->attrs[OVSTACK_ATTR_PROBE_MULTI]);
+	if (multi == 0) {
+		pr_debug ("%s: invalid probe multiplier\n", __func__);
+		return -EINVAL;
+	}
+
+	ovapp = OVSTACK_NET_APP (ovnet, app);
+
+	/* start from up, or bring all locators back when stopped */
+	if (!interval || !ovapp->probe_interval)
+		ovstack_probe_reset (ovapp);
+
+	ovapp->probe_multi = multi;
+	ovapp->probe_interval = interval;
+	if (interval)
+		schedule_delayed_work (&(ovapp->probe_work), 0);
+
+	return 0;
+}
+
+static int
+ovstack_nl_cmd_adaptive_set (struct sk_buff * skb, struct genl_info * info)
+{
+	u8 app;
+	u32 interval;
+	struct net * net = sock_net (skb->sk);
+	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
+	struct ovstack_app * ovapp;
+
+	if (!info->attrs[OVSTACK_ATTR_APP_ID]) {
+		pr_debug ("%s: app id is not specified\n", __func__);
+		return -EINVAL;
+	}
+	app = nla_get_u8 (info->attrs[OVSTACK_ATTR_APP_ID]);
+	if (!OVSTACK_NET_APP (ovnet, app)) {
+		pr_debug ("%s: app id %d does not exist\n", __func__, app);
+		return -EINVAL;
+	}
+
+	if (!info->attrs[OVSTACK_ATTR_ADAPTIVE_INTERVAL]) {
+		pr_debug ("%s: adaptive interval is not specified\n",
+			  __func__);
+		return -EINVAL;
+	}
+	interval = nla_get_u32 (info->attrs[OVSTACK_ATTR_ADAPTIVE_INTERVAL]);
+
+	ovapp = OVSTACK_NET_APP (ovnet, app);
+
+	/* start from configured weights, and go back to them when stopped */
+	if (!interval || !ovapp->adapt_interval)
+		ovstack_adapt_reset (ovapp);
+
+	ovapp->adapt_interval = interval;
+	if (interval)
+		schedule_delayed_work (&(ovapp->adapt_work),
+				       msecs_to_jiffies (interval));
+
+	return 0;
+}
+
 static int
 ovstack_nl_app_send (struct sk_buff * skb, u32 pid, u32 seq, int flags,
 		     int cmd, struct ovstack_app * ovapp)
@@ -1660,7 +3653,13 @@ ovstack_nl_app_send (struct sk_buff * skb, u32 pid, u32 seq, int flags,
 		PTR_ERR (hdr);
 
 	if (nla_put_u8 (skb, OVSTACK_ATTR_APP_ID, ovapp->ov_app) ||
-	    nla_put_be32 (skb, OVSTACK_ATTR_NODE_ID, ownnode->node_id))
+	    nla_put_be32 (skb, OVSTACK_ATTR_NODE_ID, ownnode->node_id) ||
+	    nla_put_u8 (skb, OVSTACK_ATTR_ENCAP, ovapp->encap) ||
+	    nla_put_u32 (skb, OVSTACK_ATTR_PROBE_INTERVAL,
+			 ovapp->probe_interval) ||
+	    nla_put_u8 (skb, OVSTACK_ATTR_PROBE_MULTI, ovapp->probe_multi) ||
+	    nla_put_u32 (skb, OVSTACK_ATTR_ADAPTIVE_INTERVAL,
+			 ovapp->adapt_interval))
 		goto err_out;
 
 	return genlmsg_end (skb, hdr);
@@ -1697,6 +3696,124 @@ out:
 	return skb->len;
 }
 
+static void
+ovstack_app_stats_get (struct ovstack_app * ovapp,
+		       struct ovstack_app_stats * sum)
+{
+	unsigned int cpu;
+	struct ovstack_app_pcpu_stats tmp;
+
+	memset (sum, 0, sizeof (*sum));
+
+	for_each_possible_cpu (cpu) {
+		unsigned int start;
+		const struct ovstack_app_pcpu_stats * stats
+			= per_cpu_ptr (ovapp->stats, cpu);
+
+		do {
+			start = u64_stats_fetch_begin_bh (&stats->syncp);
+			memcpy (&tmp, stats, sizeof (tmp));
+		} while (u64_stats_fetch_retry_bh (&stats->syncp, start));
+
+		sum->rx_packets		+= tmp.rx_packets;
+		sum->rx_bytes		+= tmp.rx_bytes;
+		sum->tx_packets		+= tmp.tx_packets;
+		sum->tx_bytes		+= tmp.tx_bytes;
+		sum->fwd_packets	+= tmp.fwd_packets;
+		sum->fwd_bytes		+= tmp.fwd_bytes;
+		sum->local_packets	+= tmp.local_packets;
+		sum->local_bytes	+= tmp.local_bytes;
+		sum->mcast_replicas	+= tmp.mcast_replicas;
+		sum->rx_dropped		+= tmp.rx_dropped;
+		sum->tx_dropped		+= tmp.tx_dropped;
+	}
+}
+
+static int
+ovstack_nl_stats_send (struct sk_buff * skb, u32 pid, u32 seq, int flags,
+		       int cmd, struct ovstack_app * ovapp)
+{
+	void * hdr;
+	struct ovstack_app_stats stats;
+
+	if (!ovapp)
+		return -1;
+
+	hdr = genlmsg_put (skb, pid, seq, &ovstack_nl_family, flags, cmd);
+
+	if (IS_ERR (hdr))
+		PTR_ERR (hdr);
+
+	ovstack_app_stats_get (ovapp, &stats);
+
+	if (nla_put_u8 (skb, OVSTACK_ATTR_APP_ID, ovapp->ov_app) ||
+	    nla_put (skb, OVSTACK_ATTR_STATS, sizeof (stats), &stats))
+		goto err_out;
+
+	return genlmsg_end (skb, hdr);
+
+err_out:
+	genlmsg_cancel (skb, hdr);
+	return -1;
+}
+
+static int
+ovstack_nl_cmd_stats_dump (struct sk_buff * skb,
+			   struct netlink_callback * cb)
+{
+	u8 app;
+	struct net * net = sock_net (skb->sk);
+	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
+	struct ovstack_app * ovapp;
+
+	app = cb->args[1];
+
+	if (!OVSTACK_NET_APP (ovnet, app))
+		OVSTACK_APP_NEXTNUM (ovnet, app);
+
+	if (app == OVSTACK_APP_MAX)
+		goto out;
+
+	ovapp = OVSTACK_NET_APP (ovnet, app);
+	ovstack_nl_stats_send (skb, NETLINK_CB (cb->skb).portid,
+			       cb->nlh->nlmsg_seq, NLM_F_MULTI,
+			       OVSTACK_CMD_STATS_GET, ovapp);
+
+	cb->args[1] = app + 1;
+out:
+	return skb->len;
+}
+
+static int
+ovstack_nl_cmd_drops_dump (struct sk_buff * skb,
+			   struct netlink_callback * cb)
+{
+	void * hdr;
+	u64 drops[OVSTACK_DROP_MAX];
+
+	/* counters are module wide, so they are sent in one message */
+	if (cb->args[0])
+		goto out;
+
+	hdr = genlmsg_put (skb, NETLINK_CB (cb->skb).portid,
+			   cb->nlh->nlmsg_seq, &ovstack_nl_family,
+			   NLM_F_MULTI, OVSTACK_CMD_DROPS_GET);
+	if (IS_ERR_OR_NULL (hdr))
+		goto out;
+
+	ovstack_drop_stats_get (drops);
+
+	if (nla_put (skb, OVSTACK_ATTR_DROP_STATS, sizeof (drops), drops)) {
+		genlmsg_cancel (skb, hdr);
+		goto out;
+	}
+
+	genlmsg_end (skb, hdr);
+	cb->args[0] = 1;
+out:
+	return skb->len;
+}
+
 static int
 ovstack_nl_cmd_node_id_dump (struct sk_buff * skb,
 			     struct netlink_callback * cb)
@@ -1731,6 +3848,7 @@ ovstack_nl_locator_send (struct sk_buff * skb, u32 pid, u32 seq, int flags,
 {
 	void * hdr;
 	struct ov_node * node;
+	struct ovstack_locator_stats stats;
 
 	if (!skb || !loc) 
 		return -1;
@@ -1743,7 +3861,22 @@ ovstack_nl_locator_send (struct sk_buff * skb, u32 pid, u32 seq, int flags,
 
 	if (nla_put_u8 (skb, OVSTACK_ATTR_APP_ID, app) ||
 	    nla_put_be32 (skb, OVSTACK_ATTR_NODE_ID, node->node_id) ||
-	    nla_put_u8 (skb, OVSTACK_ATTR_LOCATOR_WEIGHT, loc->weight))
+	    nla_put_u8 (skb, OVSTACK_ATTR_LOCATOR_WEIGHT, loc->weight) ||
+	    nla_put_u8 (skb, OVSTACK_ATTR_LOCATOR_FLAGS, loc->flags))
+		goto err_out;
+
+	if (loc->pmtu &&
+	    nla_put_u32 (skb, OVSTACK_ATTR_LOCATOR_PMTU, loc->pmtu))
+		goto err_out;
+
+	ov_locator_stats_get (loc, &stats);
+	if (nla_put (skb, OVSTACK_ATTR_LOCATOR_STATS, sizeof (stats), &stats) ||
+	    nla_put_u8 (skb, OVSTACK_ATTR_LOCATOR_EFF_WEIGHT,
+			loc->eff_weight))
+		goto err_out;
+
+	if (loc->encap != OVSTACK_ENCAP_DEFAULT &&
+	    nla_put_u8 (skb, OVSTACK_ATTR_ENCAP, loc->encap))
 		goto err_out;
 
 	if (loc->remote_ip_family == AF_INET) {
@@ -1855,7 +3988,67 @@ out:
 }
 
 static int
-ovstack_nl_cmd_route_add (struct sk_buff * skb, struct genl_info * info)
+ovstack_nl_cmd_route_add (struct sk_buff * skb, struct genl_info * info)
+{
+	int ret, weight = -1;
+	u8 app, mode = OVSTACK_ROUTE_MODE_UNSPEC;
+	__be32 dst_node_id, nxt_node_id;
+	struct net * net = sock_net (skb->sk);
+	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
+	struct ovstack_app * ovapp;
+	struct ortable_set * ors;
+
+	if (!info->attrs[OVSTACK_ATTR_APP_ID]) {
+		pr_debug ("%s: app id is not specified", __func__);
+		return -EINVAL;
+	}
+	app = nla_get_u8 (info->attrs[OVSTACK_ATTR_APP_ID]);
+	if (!OVSTACK_NET_APP (ovnet, app)) {
+		pr_debug ("%s: app id %d does not exist", __func__, app);
+		return -EINVAL;
+	}
+
+	if (!info->attrs[OVSTACK_ATTR_DST_NODE_ID]) {
+		pr_debug ("%s: destiantion node is not specifed", __func__);
+		return -EINVAL;
+	}
+	dst_node_id = nla_get_be32 (info->attrs[OVSTACK_ATTR_DST_NODE_ID]);
+
+	if (!info->attrs[OVSTACK_ATTR_NXT_NODE_ID]) {
+		pr_debug ("%s: destiantion node is not specifed", __func__);
+		return -EINVAL;
+	}
+	nxt_node_id = nla_get_be32 (info->attrs[OVSTACK_ATTR_NXT_NODE_ID]);
+
+	if (info->attrs[OVSTACK_ATTR_ROUTE_MODE]) {
+		mode = nla_get_u8 (info->attrs[OVSTACK_ATTR_ROUTE_MODE]);
+		if (mode > OVSTACK_ROUTE_MODE_MAX) {
+			pr_debug ("%s: invalid route mode %d", __func__, mode);
+			return -EINVAL;
+		}
+	}
+
+	if (info->attrs[OVSTACK_ATTR_NXT_WEIGHT])
+		weight = nla_get_u8 (info->attrs[OVSTACK_ATTR_NXT_WEIGHT]);
+	
+	ovapp = OVSTACK_NET_APP (ovnet, app);
+	if (info->attrs[OVSTACK_ATTR_ROUTE_STAGING]) {
+		ors = ortable_staging_get (ovapp);
+		if (!ors)
+			return -ENOMEM;
+	} else
+		ors = OVSTACK_APP_ORTABLES (ovapp);
+
+	ret = ortable_add (ovapp, ors, dst_node_id, nxt_node_id, mode, weight);
+	
+	if (ret < 0) 
+		return ret;
+
+	return 0;
+}
+
+static int
+ovstack_nl_cmd_route_delete (struct sk_buff * skb, struct genl_info * info)
 {
 	int ret;
 	u8 app;
@@ -1863,6 +4056,7 @@ ovstack_nl_cmd_route_add (struct sk_buff * skb, struct genl_info * info)
 	struct net * net = sock_net (skb->sk);
 	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
 	struct ovstack_app * ovapp;
+	struct ortable_set * ors;
 
 	if (!info->attrs[OVSTACK_ATTR_APP_ID]) {
 		pr_debug ("%s: app id is not specified", __func__);
@@ -1887,23 +4081,30 @@ ovstack_nl_cmd_route_add (struct sk_buff * skb, struct genl_info * info)
 	nxt_node_id = nla_get_be32 (info->attrs[OVSTACK_ATTR_NXT_NODE_ID]);
 	
 	ovapp = OVSTACK_NET_APP (ovnet, app);
-	ret = ortable_add (ovapp, dst_node_id, nxt_node_id);
+	if (info->attrs[OVSTACK_ATTR_ROUTE_STAGING]) {
+		ors = ovapp->ortables_staging;
+		if (!ors) {
+			pr_debug ("%s: app %d has no staging table",
+				  __func__, app);
+			return -ENOENT;
+		}
+	} else
+		ors = OVSTACK_APP_ORTABLES (ovapp);
+
+	ret = ortable_delete (ovapp, ors, dst_node_id, nxt_node_id);
 	
-	if (!ret) 
+	if (ret < 0) 
 		return ret;
 
 	return 0;
 }
 
 static int
-ovstack_nl_cmd_route_delete (struct sk_buff * skb, struct genl_info * info)
+ovstack_nl_cmd_route_commit (struct sk_buff * skb, struct genl_info * info)
 {
-	int ret;
 	u8 app;
-	__be32 dst_node_id, nxt_node_id;
 	struct net * net = sock_net (skb->sk);
 	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
-	struct ovstack_app * ovapp;
 
 	if (!info->attrs[OVSTACK_ATTR_APP_ID]) {
 		pr_debug ("%s: app id is not specified", __func__);
@@ -1915,27 +4116,147 @@ ovstack_nl_cmd_route_delete (struct sk_buff * skb, struct genl_info * info)
 		return -EINVAL;
 	}
 
-	if (!info->attrs[OVSTACK_ATTR_DST_NODE_ID]) {
-		pr_debug ("%s: destiantion node is not specifed", __func__);
+	return ortable_commit (OVSTACK_NET_APP (ovnet, app));
+}
+
+static int
+ovstack_nl_cmd_route_abort (struct sk_buff * skb, struct genl_info * info)
+{
+	u8 app;
+	struct net * net = sock_net (skb->sk);
+	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
+
+	if (!info->attrs[OVSTACK_ATTR_APP_ID]) {
+		pr_debug ("%s: app id is not specified", __func__);
 		return -EINVAL;
 	}
-	dst_node_id = nla_get_be32 (info->attrs[OVSTACK_ATTR_DST_NODE_ID]);
-
-	if (!info->attrs[OVSTACK_ATTR_NXT_NODE_ID]) {
-		pr_debug ("%s: destiantion node is not specifed", __func__);
+	app = nla_get_u8 (info->attrs[OVSTACK_ATTR_APP_ID]);
+	if (!OVSTACK_NET_APP (ovnet, app)) {
+		pr_debug ("%s: app id %d does not exist", __func__, app);
 		return -EINVAL;
 	}
-	nxt_node_id = nla_get_be32 (info->attrs[OVSTACK_ATTR_NXT_NODE_ID]);
-	
-	ovapp = OVSTACK_NET_APP (ovnet, app);
-	ret = ortable_delete (ovapp, dst_node_id, nxt_node_id);
-	
-	if (!ret) 
-		return ret;
+
+	ortable_abort (OVSTACK_NET_APP (ovnet, app));
 
 	return 0;
 }
 
+/* commands which can be carried by OVSTACK_CMD_BULK */
+static int
+ovstack_nl_bulk_doit (u8 cmd, struct sk_buff * skb, struct genl_info * info)
+{
+	switch (cmd) {
+	case OVSTACK_CMD_NODE_ID_SET :
+		return ovstack_nl_cmd_node_id_set (skb, info);
+	case OVSTACK_CMD_LOCATOR_ADD :
+		return ovstack_nl_cmd_locator_add (skb, info);
+	case OVSTACK_CMD_LOCATOR_DELETE :
+		return ovstack_nl_cmd_locator_delete (skb, info);
+	case OVSTACK_CMD_LOCATOR_WEIGHT_SET :
+		return ovstack_nl_cmd_locator_weight_set (skb, info);
+	case OVSTACK_CMD_NODE_ADD :
+		return ovstack_nl_cmd_node_add (skb, info);
+	case OVSTACK_CMD_NODE_DELETE :
+		return ovstack_nl_cmd_node_delete (skb, info);
+	case OVSTACK_CMD_NODE_WEIGHT_SET :
+		return ovstack_nl_cmd_node_weight_set (skb, info);
+	case OVSTACK_CMD_ROUTE_ADD :
+		return ovstack_nl_cmd_route_add (skb, info);
+	case OVSTACK_CMD_ROUTE_DELETE :
+		return ovstack_nl_cmd_route_delete (skb, info);
+	case OVSTACK_CMD_ROUTE_COMMIT :
+		return ovstack_nl_cmd_route_commit (skb, info);
+	case OVSTACK_CMD_ROUTE_ABORT :
+		return ovstack_nl_cmd_route_abort (skb, info);
+	case OVSTACK_CMD_ENCAP_SET :
+		return ovstack_nl_cmd_encap_set (skb, info);
+	case OVSTACK_CMD_PROBE_SET :
+		return ovstack_nl_cmd_probe_set (skb, info);
+	case OVSTACK_CMD_ADAPTIVE_SET :
+		return ovstack_nl_cmd_adaptive_set (skb, info);
+	}
+
+	return -EOPNOTSUPP;
+}
+
+/*
+ * Each OVSTACK_ATTR_BULK_ENTRY is run by the handler of its command, as
+ * if it came in its own message. All entries are run under one genl_lock
+ * and answered by one reply, instead of a round trip per entry. Errors
+ * that do not fit in the reply are counted in bulk_failed only.
+ */
+static int
+ovstack_nl_cmd_bulk (struct sk_buff * skb, struct genl_info * info)
+{
+	int rem, rc;
+	u8 cmd;
+	u32 index = 0, failed = 0;
+	void * hdr;
+	struct nlattr * nla, * errs;
+	struct nlattr * attrs[OVSTACK_ATTR_MAX + 1];
+	struct sk_buff * reply;
+	struct genl_info einfo;
+	struct ovstack_bulk_error err;
+
+	reply = genlmsg_new (NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!reply)
+		return -ENOMEM;
+
+	hdr = genlmsg_put (reply, info->snd_portid, info->snd_seq,
+			   &ovstack_nl_family, 0, OVSTACK_CMD_BULK);
+	if (!hdr)
+		goto nomem;
+
+	errs = nla_nest_start (reply, OVSTACK_ATTR_BULK_ERRORS);
+	if (!errs)
+		goto nomem;
+
+	einfo = *info;
+	einfo.attrs = attrs;
+
+	nla_for_each_attr (nla, genlmsg_data (info->genlhdr),
+			   genlmsg_len (info->genlhdr), rem) {
+		if (nla_type (nla) != OVSTACK_ATTR_BULK_ENTRY)
+			continue;
+
+		rc = nla_parse_nested (attrs, OVSTACK_ATTR_MAX, nla,
+				       ovstack_nl_policy);
+		if (rc == 0) {
+			if (attrs[OVSTACK_ATTR_BULK_CMD]) {
+				cmd = nla_get_u8 (attrs[OVSTACK_ATTR_BULK_CMD]);
+				rc = ovstack_nl_bulk_doit (cmd, skb, &einfo);
+			} else
+				rc = -EINVAL;
+		}
+
+		if (rc < 0) {
+			failed++;
+			err.index = index;
+			err.error = rc;
+			/* keep room for bulk_count and bulk_failed */
+			if (skb_tailroom (reply) >= nla_total_size (sizeof (err))
+			    + nla_total_size (sizeof (u32)) * 2)
+				nla_put (reply, OVSTACK_ATTR_BULK_ERROR,
+					 sizeof (err), &err);
+		}
+		index++;
+	}
+
+	nla_nest_end (reply, errs);
+
+	if (nla_put_u32 (reply, OVSTACK_ATTR_BULK_COUNT, index) ||
+	    nla_put_u32 (reply, OVSTACK_ATTR_BULK_FAILED, failed))
+		goto nomem;
+
+	genlmsg_end (reply, hdr);
+
+	return genlmsg_reply (reply, info);
+
+nomem:
+	nlmsg_free (reply);
+	return -ENOMEM;
+}
+
 static int
 ovstack_nl_route_send (struct sk_buff * skb, u32 pid, u32 seq, int flags,
 		       int cmd, u8 app, struct ortable_nexthop * ortnxt)
@@ -1953,7 +4274,9 @@ ovstack_nl_route_send (struct sk_buff * skb, u32 pid, u32 seq, int flags,
 	if (nla_put_u8 (skb, OVSTACK_ATTR_APP_ID, app) ||
 	    nla_put_be32 (skb, OVSTACK_ATTR_DST_NODE_ID, 
 			  ortnxt->ort_nxt_dst) ||
-	    nla_put_be32 (skb, OVSTACK_ATTR_NXT_NODE_ID, ortnxt->ort_nxt)) 
+	    nla_put_be32 (skb, OVSTACK_ATTR_NXT_NODE_ID, ortnxt->ort_nxt) ||
+	    nla_put_u8 (skb, OVSTACK_ATTR_ROUTE_MODE, ortnxt->ort->mode) ||
+	    nla_put_u8 (skb, OVSTACK_ATTR_NXT_WEIGHT, ortnxt->weight))
 		goto err_out;
 
 	return genlmsg_end (skb, hdr);
@@ -1970,6 +4293,7 @@ ovstack_nl_cmd_route_dump (struct sk_buff * skb, struct netlink_callback * cb)
 	struct net * net = sock_net (skb->sk);
 	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
 	struct ovstack_app * ovapp;
+	struct ortable_set * ors = NULL;
 	struct ortable * ort;
 	struct ortable_nexthop * ortnxt;
 
@@ -1977,14 +4301,15 @@ ovstack_nl_cmd_route_dump (struct sk_buff * skb, struct netlink_callback * cb)
 		ovapp = OVSTACK_NET_APP (ovnet, app);
 		if (!ovapp)
 			continue;
-		if (OVSTACK_APP_FIRSTROUTE (ovapp))
+		ors = OVSTACK_APP_ORTABLES (ovapp);
+		if (OVSTACK_ORTABLES_FIRSTROUTE (ors))
 			break;
 	}
 
 	if (app == OVSTACK_APP_MAX)
 		goto out;
 
-	list_for_each_entry_rcu (ort, &ovapp->ortable_chain, chain) {
+	list_for_each_entry_rcu (ort, &ors->chain, chain) {
 		list_for_each_entry_rcu (ortnxt, &ort->ort_nxts, list) {
 			ovstack_nl_route_send (skb, 
 					       NETLINK_CB (cb->skb).portid,
@@ -2086,6 +4411,7 @@ ovstack_notify_locator (int cmd, __u8 app, struct ov_locator * loc,
 	event.weight = loc->weight;
 	event.family = loc->remote_ip_family;
 	event.node_id = loc->node->node_id;
+	event.flags = loc->flags;
 	if (loc->remote_ip_family == AF_INET)
 		memcpy (event.remote_ip4, &loc->remote_ip4,
 			sizeof (struct in_addr));
@@ -2097,12 +4423,9 @@ ovstack_notify_locator (int cmd, __u8 app, struct ov_locator * loc,
 }
 
 
-/* XXX */
-#ifdef DEBUG
+/* commands have not required CAP_NET_ADMIN, as DEBUG was always
+ * defined. It is kept apart from DEBUG, which no longer is. */
 #define GENL_ADMIN_PERM_OVSTACK	0
-#else
-#define GENL_ADMIN_PERM_OVSTACK	GENL_ADMIN_PERM
-#endif
 
 static struct genl_ops ovstack_nl_ops[] = {
 	{
@@ -2184,6 +4507,52 @@ static struct genl_ops ovstack_nl_ops[] = {
 		.dumpit = ovstack_nl_cmd_route_dump,
 		.policy = ovstack_nl_policy,
 	},
+	{
+		.cmd = OVSTACK_CMD_ENCAP_SET,
+		.doit = ovstack_nl_cmd_encap_set,
+		.policy = ovstack_nl_policy,
+		.flags = GENL_ADMIN_PERM_OVSTACK,
+	},
+	{
+		.cmd = OVSTACK_CMD_STATS_GET,
+		.dumpit = ovstack_nl_cmd_stats_dump,
+		.policy = ovstack_nl_policy,
+	},
+	{
+		.cmd = OVSTACK_CMD_DROPS_GET,
+		.dumpit = ovstack_nl_cmd_drops_dump,
+		.policy = ovstack_nl_policy,
+	},
+	{
+		.cmd = OVSTACK_CMD_BULK,
+		.doit = ovstack_nl_cmd_bulk,
+		.policy = ovstack_nl_policy,
+		.flags = GENL_ADMIN_PERM_OVSTACK,
+	},
+	{
+		.cmd = OVSTACK_CMD_ROUTE_COMMIT,
+		.doit = ovstack_nl_cmd_route_commit,
+		.policy = ovstack_nl_policy,
+		.flags = GENL_ADMIN_PERM_OVSTACK,
+	},
+	{
+		.cmd = OVSTACK_CMD_ROUTE_ABORT,
+		.doit = ovstack_nl_cmd_route_abort,
+		.policy = ovstack_nl_policy,
+		.flags = GENL_ADMIN_PERM_OVSTACK,
+	},
+	{
+		.cmd = OVSTACK_CMD_PROBE_SET,
+		.doit = ovstack_nl_cmd_probe_set,
+		.policy = ovstack_nl_policy,
+		.flags = GENL_ADMIN_PERM_OVSTACK,
+	},
+	{
+		.cmd = OVSTACK_CMD_ADAPTIVE_SET,
+		.doit = ovstack_nl_cmd_adaptive_set,
+		.policy = ovstack_nl_policy,
+		.flags = GENL_ADMIN_PERM_OVSTACK,
+	},
 };
 
 
@@ -2212,14 +4581,32 @@ ovstack_own_node_id (struct net * net, u8 app)
 }
 EXPORT_SYMBOL (ovstack_own_node_id);
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+#define skb_get_hash(skb) skb_get_rxhash (skb)
+#endif
+
+/*
+ * ov_hash of the inner flow of skb. skb->protocol and the network header
+ * must be the inner L3 header. seed is used for packets without an L3/L4
+ * flow (e.g. ARP), so that apps can spread them by their own key.
+ */
+__be32
+ovstack_flow_hash (struct sk_buff * skb, u32 seed)
+{
+	u32 hash = skb_get_hash (skb);
+
+	return htonl (jhash_1word (hash ? hash : seed, ovstack_salt));
+}
+EXPORT_SYMBOL (ovstack_flow_hash);
+
 
 int
 ovstack_register_app_ops (struct net * net, int app,
 			  int (*app_recv_ops) (struct sk_buff * skb))
 {
-	int n;
 	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
 	struct ovstack_app * ovapp;
+	struct ortable_set * ors;
 
 	if (app > OVSTACK_APP_MAX) 
 		return -EINVAL;
@@ -2233,19 +4620,42 @@ ovstack_register_app_ops (struct net * net, int app,
 	/* alloc new ov app instance */
 	
 	ovapp = kmalloc (sizeof (struct ovstack_app), GFP_KERNEL);
+	if (!ovapp)
+		return -ENOMEM;
 	memset (ovapp, 0, sizeof (struct ovstack_app));
 
 	ovapp->ov_app = app;
+	ovapp->net = net;
+	ovapp->ovnet = ovnet;
+	ovapp->encap = OVSTACK_ENCAP_RAW;
+	ovapp->probe_multi = OVSTACK_PROBE_DEFAULT_MULTI;
+	INIT_DELAYED_WORK (&(ovapp->probe_work), ovstack_probe_work);
+	INIT_DELAYED_WORK (&(ovapp->adapt_work), ovstack_adapt_work);
+
+	ovapp->stats = alloc_percpu (struct ovstack_app_pcpu_stats);
+	if (!ovapp->stats) {
+		kfree (ovapp);
+		return -ENOMEM;
+	}
 
 	/* init LIB */
-	for (n = 0; n < LIB_HASH_SIZE; n++) 
-		INIT_LIST_HEAD (&(ovapp->node_list[n]));
+	if (ov_hash_init (&(ovapp->node_hash), LIB_HASH_MIN_BITS,
+			  LIB_HASH_MAX_BITS) < 0) {
+		free_percpu (ovapp->stats);
+		kfree (ovapp);
+		return -ENOMEM;
+	}
 	INIT_LIST_HEAD (&(ovapp->node_chain));
 
 	/* init overlay routing table */
-	for (n = 0; n < ORT_HASH_SIZE; n++) 
-		INIT_LIST_HEAD (&(ovapp->ortable_list[n]));
-	INIT_LIST_HEAD (&(ovapp->ortable_chain));
+	ors = ortable_set_alloc ();
+	if (!ors) {
+		ov_hash_destroy (&(ovapp->node_hash));
+		free_percpu (ovapp->stats);
+		kfree (ovapp);
+		return -ENOMEM;
+	}
+	RCU_INIT_POINTER (ovapp->ortables, ors);
 
 	/* init own node for the application */
 	OVSTACK_APP_OWNNODE (ovapp) = ov_node_create (0);
@@ -2261,12 +4671,34 @@ ovstack_register_app_ops (struct net * net, int app,
 }
 EXPORT_SYMBOL (ovstack_register_app_ops);
 
+int
+ovstack_register_app_pmtu_ops (struct net * net, int app,
+			       int (*app_pmtu_ops) (struct sk_buff * skb,
+						    unsigned int mtu))
+{
+	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
+	struct ovstack_app * ovapp;
+
+	if (app > OVSTACK_APP_MAX)
+		return -EINVAL;
+
+	ovapp = OVSTACK_NET_APP (ovnet, app);
+	if (!ovapp)
+		return -ENOENT;
+
+	ovapp->app_pmtu_ops = app_pmtu_ops;
+
+	return 0;
+}
+EXPORT_SYMBOL (ovstack_register_app_pmtu_ops);
+
 int
 ovstack_unregister_app_ops (struct net * net, int app)
 {
 	struct list_head * p, * tmp;
 	struct ov_node * node;
 	struct ortable * ort;
+	struct ortable_set * ors;
 	struct ovstack_net * ovnet = net_generic (net, ovstack_net_id);
 	struct ovstack_app * ovapp;
 
@@ -2281,23 +4713,45 @@ ovstack_unregister_app_ops (struct net * net, int app)
 	
 	ovapp = OVSTACK_NET_APP (ovnet, app);
 
+	/*
+	 * no new packet finds the app. packets in flight are waited for
+	 * before the stats are freed. Under genl_lock, PROBE_SET and
+	 * ADAPTIVE_SET no longer find the app to re-arm the works, and a
+	 * work running after this sees interval 0 and does not requeue.
+	 */
+	genl_lock ();
+	ovnet->apps[app] = NULL;
+	ovapp->probe_interval = 0;
+	ovapp->adapt_interval = 0;
+	genl_unlock ();
+
+	cancel_delayed_work_sync (&(ovapp->probe_work));
+	cancel_delayed_work_sync (&(ovapp->adapt_work));
+
+	/* destroy overlay routing table */
+	ortable_abort (ovapp);
+	ors = OVSTACK_APP_ORTABLES (ovapp);
+	list_for_each_safe (p, tmp, &ors->chain) {
+		ort = list_entry (p, struct ortable, chain);
+		ortable_destroy (ovapp, ors, ort);
+	}
+
 	/* destroy locator information base */
 	list_for_each_safe (p, tmp, &ovapp->node_chain) {
 		node = list_entry (p, struct ov_node, chain);
-		ov_node_delete (node);
-	}
-	
-	/* destroy overlay routing table */
-	list_for_each_safe (p, tmp, &ovapp->ortable_chain) {
-		ort = list_entry (p, struct ortable, chain);
-		ortable_destroy (ort);
+		ov_node_delete (ovapp, node);
 	}
 
 	/* destroy own self */
 	ov_node_destroy (OVSTACK_APP_OWNNODE (ovapp));
 
+	ov_hash_destroy (&(ors->hash));
+	kfree (ors);
+	ov_hash_destroy (&(ovapp->node_hash));
+
+	synchronize_rcu ();
+	free_percpu (ovapp->stats);
 	kfree (ovapp);
-	ovnet->apps[app] = NULL;
 
 	printk (KERN_INFO "ovstack application (%d) is unloaded\n", app);
 
@@ -2307,15 +4761,242 @@ EXPORT_SYMBOL (ovstack_unregister_app_ops);
 
 
 
+/*****************************
+ *	GRO operations
+ *****************************/
+
+/*
+ * Nested GRO needs gro_complete () with nhoff and
+ * gro_find_receive_by_type (), which appeared in 3.14.
+ * Packets for own node of OVAPP_ETHERNET are coalesced per
+ * (app, vni, src, dst) and inner ether header, and handed to
+ * GRO of the inner protocol. Transit packets are not coalesced
+ * because they are forwarded without decapsulation.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+
+static struct sk_buff **
+ovstack_gro_receive (struct sk_buff ** head, struct sk_buff * skb)
+{
+	int flush = 1;
+	unsigned int hlen, off_ov, off_eth;
+	struct sk_buff * p, ** pp = NULL;
+	struct ovhdr * ovh, * ovh2;
+	struct ethhdr * eh, * eh2;
+	struct ovstack_net * ovnet;
+	struct ovstack_app * ovapp;
+	const struct packet_offload * ptype;
+
+	off_ov = skb_gro_offset (skb);
+	hlen = off_ov + sizeof (struct ovhdr);
+	ovh = skb_gro_header_fast (skb, off_ov);
+	if (skb_gro_header_hard (skb, hlen)) {
+		ovh = skb_gro_header_slow (skb, hlen, off_ov);
+		if (unlikely (!ovh))
+			goto out;
+	}
+
+	if (ovh->ov_app != OVAPP_ETHERNET || ovh->ov_flags)
+		goto out;
+
+	ovnet = net_generic (dev_net (skb->dev), ovstack_net_id);
+	ovapp = OVSTACK_NET_APP (ovnet, ovh->ov_app);
+	if (!ovapp || ovh->ov_dst != OVSTACK_APP_OWNNODE (ovapp)->node_id)
+		goto out;
+
+	for (p = *head; p; p = p->next) {
+		if (!NAPI_GRO_CB (p)->same_flow)
+			continue;
+
+		ovh2 = (struct ovhdr *)(p->data + off_ov);
+		if (ovh->ov_app != ovh2->ov_app ||
+		    ovh->ov_vni != ovh2->ov_vni ||
+		    ovh->ov_src != ovh2->ov_src ||
+		    ovh->ov_dst != ovh2->ov_dst) {
+			NAPI_GRO_CB (p)->same_flow = 0;
+			continue;
+		}
+	}
+
+	skb_gro_pull (skb, sizeof (struct ovhdr));
+
+	off_eth = skb_gro_offset (skb);
+	hlen = off_eth + sizeof (struct ethhdr);
+	eh = skb_gro_header_fast (skb, off_eth);
+	if (skb_gro_header_hard (skb, hlen)) {
+		eh = skb_gro_header_slow (skb, hlen, off_eth);
+		if (unlikely (!eh))
+			goto out;
+	}
+
+	for (p = *head; p; p = p->next) {
+		if (!NAPI_GRO_CB (p)->same_flow)
+			continue;
+
+		eh2 = (struct ethhdr *)(p->data + off_eth);
+		if (compare_ether_header (eh, eh2)) {
+			NAPI_GRO_CB (p)->same_flow = 0;
+			continue;
+		}
+	}
+
+	rcu_read_lock ();
+	ptype = gro_find_receive_by_type (eh->h_proto);
+	if (ptype == NULL) {
+		rcu_read_unlock ();
+		goto out;
+	}
+
+	skb_gro_pull (skb, sizeof (struct ethhdr));
+	pp = ptype->callbacks.gro_receive (head, skb);
+	rcu_read_unlock ();
+
+	flush = 0;
+
+out:
+	NAPI_GRO_CB (skb)->flush |= flush;
+
+	return pp;
+}
+
+/* nhoff is offset of ovhdr */
+static int
+ovstack_gro_complete (struct sk_buff * skb, int nhoff)
+{
+	int err = -ENOSYS;
+	struct ethhdr * eh;
+	struct packet_offload * ptype;
+
+	eh = (struct ethhdr *)(skb->data + nhoff + sizeof (struct ovhdr));
+
+	rcu_read_lock ();
+	ptype = gro_find_complete_by_type (eh->h_proto);
+	if (ptype != NULL)
+		err = ptype->callbacks.gro_complete (skb, nhoff +
+						     sizeof (struct ovhdr) +
+						     sizeof (struct ethhdr));
+	rcu_read_unlock ();
+
+	return err;
+}
+
+static const struct net_offload ovstack_offload = {
+	.callbacks = {
+		.gro_receive	= ovstack_gro_receive,
+		.gro_complete	= ovstack_gro_complete,
+	},
+};
+
+/* UDP encapsulation. udp_gro_receive () pulls the UDP header */
+static struct udp_offload ovstack_udp_offload = {
+	.callbacks = {
+		.gro_receive	= ovstack_gro_receive,
+		.gro_complete	= ovstack_gro_complete,
+	},
+};
+
+static int
+ovstack_gro_init (void)
+{
+	int rc;
+
+	rc = inet_add_offload (&ovstack_offload, IPPROTO_OVSTACK);
+	if (rc != 0)
+		return rc;
+
+	rc = inet6_add_offload (&ovstack_offload, IPPROTO_OVSTACK);
+	if (rc != 0)
+		goto reg_ip6offload_failed;
+
+	ovstack_udp_offload.port = htons (OVSTACK_PORT);
+	rc = udp_add_offload (&ovstack_udp_offload);
+	if (rc != 0)
+		goto reg_udpoffload_failed;
+
+	return 0;
+
+reg_udpoffload_failed:
+	inet6_del_offload (&ovstack_offload, IPPROTO_OVSTACK);
+
+reg_ip6offload_failed:
+	inet_del_offload (&ovstack_offload, IPPROTO_OVSTACK);
+
+	return rc;
+}
+
+static void
+ovstack_gro_exit (void)
+{
+	udp_del_offload (&ovstack_udp_offload);
+	inet6_del_offload (&ovstack_offload, IPPROTO_OVSTACK);
+	inet_del_offload (&ovstack_offload, IPPROTO_OVSTACK);
+}
+
+#else
+
+static inline int
+ovstack_gro_init (void)
+{
+	return 0;
+}
+
+static inline void
+ovstack_gro_exit (void)
+{
+}
+
+#endif
+
+
+
 /*****************************
  *	init/exit module
  *****************************/
 
+/*
+ * ICMP errors for raw encapsulated outer packets update the route
+ * exception of the dst locator, and cached dsts are renewed by
+ * dst_check (). skb->data is the quoted outer header.
+ *
+ * ICMP errors for UDP encapsulation quote the hashed source port,
+ * which has no socket, and are dropped by UDP before reaching ovstack.
+ * This kernel has no error hook for encapsulation sockets, so UDP paths
+ * do not learn the path MTU from ICMP.
+ */
+static void
+ovstack_err4 (struct sk_buff * skb, u32 info)
+{
+	if (icmp_hdr (skb)->type != ICMP_DEST_UNREACH ||
+	    icmp_hdr (skb)->code != ICMP_FRAG_NEEDED)
+		return;
+
+	ipv4_update_pmtu (skb, dev_net (skb->dev), info, 0, 0,
+			  IPPROTO_OVSTACK, 0);
+}
+
+static void
+ovstack_err6 (struct sk_buff * skb, struct inet6_skb_parm * opt,
+	      u8 type, u8 code, int offset, __be32 info)
+{
+	if (type != ICMPV6_PKT_TOOBIG)
+		return;
+
+	ip6_update_pmtu (skb, dev_net (skb->dev), info, 0, 0);
+}
+
 static struct net_protocol ovstack_ip_protocol __read_mostly = {
 	.handler	= ovstack_recv,
+	.err_handler	= ovstack_err4,
 	.netns_ok	= 1,
 };
 
+/* skb->data is at ovhdr as well as ipv4, so ovstack_recv () is shared */
+static const struct inet6_protocol ovstack_ip6_protocol = {
+	.handler	= ovstack_recv,
+	.err_handler	= ovstack_err6,
+	.flags		= INET6_PROTO_NOPOLICY | INET6_PROTO_FINAL,
+};
+
 
 static int
 __init ovstack_init_module (void)
@@ -2340,11 +5021,25 @@ __init ovstack_init_module (void)
 	if (rc != 0)
 		goto reg_ipproto_failed;
 
+	rc = inet6_add_protocol (&ovstack_ip6_protocol, IPPROTO_OVSTACK);
+	if (rc != 0)
+		goto reg_ip6proto_failed;
+
+	rc = ovstack_gro_init ();
+	if (rc != 0)
+		goto reg_gro_failed;
+
 	printk (KERN_INFO "overlay stack (version %s) is loaded\n", 
 		OVSTACK_VERSION);
 
 	return 0;
 
+reg_gro_failed:
+	inet6_del_protocol (&ovstack_ip6_protocol, IPPROTO_OVSTACK);
+
+reg_ip6proto_failed:
+	inet_del_protocol (&ovstack_ip_protocol, IPPROTO_OVSTACK);
+
 reg_ipproto_failed:
 	genl_unregister_family (&ovstack_nl_family);
 
@@ -2362,11 +5057,16 @@ static void
 __exit ovstack_exit_module (void)
 {
 
+	ovstack_gro_exit ();
+	inet6_del_protocol (&ovstack_ip6_protocol, IPPROTO_OVSTACK);
 	inet_del_protocol (&ovstack_ip_protocol, IPPROTO_OVSTACK);
 	genl_unregister_family (&ovstack_nl_event_family);
 	genl_unregister_family (&ovstack_nl_family);
 	unregister_pernet_subsys (&ovstack_net_ops);
 
+	/* wait for ov_locator_free_rcu () */
+	rcu_barrier ();
+
 	printk (KERN_INFO "overlay stack (version %s) is unloaded\n",
 		OVSTACK_VERSION);
 
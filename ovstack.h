@@ -8,6 +8,8 @@
 #include <linux/netdevice.h>
 #include <net/net_namespace.h>
 
+#include "ovstack_netlink.h"
+
 #define OVSTACK_APP_IP        4
 #define OVSTACK_APP_IPV6      6
 #define OVSTACK_APP_ETHER     7
@@ -46,6 +48,10 @@ struct ovhdr {
 #define ovh_rsv(h) (ntohl ((h)->ov_vni) & 0x000000FF)
 #define ovh_vni(h) (ntohl ((h)->ov_vni) >> 8)
 
+/* ov_flags. probes carry only ovhdr, and are not passed to apps */
+#define OVSTACK_FLAG_PROBE		0x01	/* locator liveness probe */
+#define OVSTACK_FLAG_PROBE_REPLY	0x02
+
 
 
 /*
@@ -53,12 +59,37 @@ struct ovhdr {
  */
 
 __be32 ovstack_own_node_id (struct net * net, u8 app);
+__be32 ovstack_flow_hash (struct sk_buff * skb, u32 seed);
 int ovstack_register_app_ops (struct net * net, int app,
 			      int (*app_recv_ops) (struct sk_buff * skb));
 int ovstack_unregister_app_ops (struct net * net, int app);
 
+/*
+ * app_pmtu_ops is called when a packet sent by the app is larger than
+ * the path MTU. skb->data is ovhdr, and mtu is the largest packet
+ * after ovhdr. Return 0 when the sender is told and the packet is
+ * dropped, or nonzero to send it fragmented.
+ */
+int ovstack_register_app_pmtu_ops (struct net * net, int app,
+				   int (*app_pmtu_ops) (struct sk_buff * skb,
+							unsigned int mtu));
+
 netdev_tx_t ovstack_xmit (struct sk_buff * skb, struct net_device * dev);
 
+void ovstack_drop_account (struct sk_buff * skb, struct ovhdr * ovh,
+			   int reason, unsigned long location);
+
+/*
+ * drop a packet with OVSTACK_DROP_* reason. ovh is the overlay header of
+ * the packet, or NULL. kfree_skb () is called at the caller, so that
+ * drop monitor reports the caller as the location.
+ */
+#define ovstack_drop(skb, ovh, reason)					\
+	do {								\
+		ovstack_drop_account (skb, ovh, reason, _THIS_IP_);	\
+		kfree_skb (skb);					\
+	} while (0)
+
 
 
 /*
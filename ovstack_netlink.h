@@ -24,10 +24,37 @@
  * NODE_ID_GET		- app_id, ret node_id : my node id info
  * LOCATOR_GET		- app_id, ret remote_ip, weight : my locator info
  * NODE_GET		- app_id, ret node_id, or dump : get (or dump) node
+ *			  locators are dumped with locator_stats and
+ *			  locator_eff_weight.
 
- * ROUTE_ADD		- app_id, dst_node_id, nxt_node_id
- * ROUTE_DEL		- app_id, dst_node_id, nxt_node_id
- * ROUTE_GET		- app_id, ret dst_node_id, nxt_node_id
+ * ROUTE_ADD		- app_id, dst_node_id, nxt_node_id, [mode, nxt_weight,
+ *			  staging]
+ * ROUTE_DEL		- app_id, dst_node_id, nxt_node_id, [staging]
+ * ROUTE_GET		- app_id, ret dst_node_id, nxt_node_id, mode, nxt_weight
+ * ROUTE_COMMIT		- app_id : replace routing table with staging table.
+ *			  without staging table, all routes are flushed.
+ * ROUTE_ABORT		- app_id : discard staging table
+
+ * PROBE_SET		- app_id, probe_interval, [probe_multi] : probe all
+ *			  locator pairs every interval msec, and mark a
+ *			  locator down when it does not answer in interval *
+ *			  multi msec. interval 0 stops probing.
+ * ADAPTIVE_SET		- app_id, adaptive_interval : every interval msec,
+ *			  lower effective weight of locators whose underlay
+ *			  egress drops packets, and restore it while they
+ *			  do not. interval 0 restores configured weights.
+
+ * ENCAP_SET		- app_id, encap : set encapsulation of the app
+
+ * STATS_GET		- app_id, ret stats : dump datapath stats of apps
+ * DROPS_GET		- ret drop stats : dump drop counters per reason
+
+ * BULK			- bulk_entry... : run set, add and delete commands
+ *			  carried as nested entries in order. entries are
+ *			  not stopped by an error, and the reply has
+ *			  bulk_count, bulk_failed and bulk_errors of failed
+ *			  entries. bulk_errors may be truncated, while
+ *			  bulk_failed counts all failed entries.
 
  */
 
@@ -50,6 +77,16 @@ enum {
 	OVSTACK_CMD_ROUTE_GET,
 
 	OVSTACK_CMD_EVENT,
+
+	OVSTACK_CMD_ENCAP_SET,
+
+	OVSTACK_CMD_STATS_GET,
+	OVSTACK_CMD_DROPS_GET,
+	OVSTACK_CMD_BULK,
+	OVSTACK_CMD_ROUTE_COMMIT,
+	OVSTACK_CMD_ROUTE_ABORT,
+	OVSTACK_CMD_PROBE_SET,
+	OVSTACK_CMD_ADAPTIVE_SET,
 	__OVSTACK_CMD_MAX,
 };
 
@@ -66,10 +103,50 @@ enum {
 	OVSTACK_ATTR_LOCATOR_IP6ADDR,	/* ipv6 address */
 	OVSTACK_ATTR_LOCATOR_WEIGHT,	/* 8bit weight */
 	OVSTACK_ATTR_EVENT,		/* ovstack_genl_event_* */
+	OVSTACK_ATTR_ENCAP,		/* 8bit OVSTACK_ENCAP_* */
+	OVSTACK_ATTR_STATS,		/* struct ovstack_app_stats */
+	OVSTACK_ATTR_DROP_STATS,	/* __u64 [OVSTACK_DROP_MAX] */
+	OVSTACK_ATTR_ROUTE_MODE,	/* 8bit OVSTACK_ROUTE_MODE_* */
+	OVSTACK_ATTR_NXT_WEIGHT,	/* 8bit weight of next hop */
+	OVSTACK_ATTR_BULK_ENTRY,	/* nested attrs of one command */
+	OVSTACK_ATTR_BULK_CMD,		/* 8bit OVSTACK_CMD_* of an entry */
+	OVSTACK_ATTR_BULK_COUNT,	/* 32bit number of entries run */
+	OVSTACK_ATTR_BULK_ERRORS,	/* nested OVSTACK_ATTR_BULK_ERROR */
+	OVSTACK_ATTR_BULK_ERROR,	/* struct ovstack_bulk_error */
+	OVSTACK_ATTR_ROUTE_STAGING,	/* flag, route to staging table */
+	OVSTACK_ATTR_PROBE_INTERVAL,	/* 32bit msec, 0 is disabled */
+	OVSTACK_ATTR_PROBE_MULTI,	/* 8bit detection multiplier */
+	OVSTACK_ATTR_LOCATOR_FLAGS,	/* 8bit OVSTACK_LOCATOR_F_* */
+	OVSTACK_ATTR_LOCATOR_PMTU,	/* 32bit path MTU after outer header */
+	OVSTACK_ATTR_LOCATOR_STATS,	/* struct ovstack_locator_stats */
+	OVSTACK_ATTR_LOCATOR_EFF_WEIGHT,/* 8bit weight used for selection */
+	OVSTACK_ATTR_ADAPTIVE_INTERVAL,	/* 32bit msec, 0 is disabled */
+	OVSTACK_ATTR_BULK_FAILED,	/* 32bit number of failed entries */
 	__OVSTACK_ATTR_MAX,
 };
 #define OVSTACK_ATTR_MAX	(__OVSTACK_ATTR_MAX - 1)
 
+/* encapsulation of the app, or of a node locator (overrides the app) */
+enum {
+	OVSTACK_ENCAP_DEFAULT,		/* locator: follow the app */
+	OVSTACK_ENCAP_RAW,		/* IPPROTO_OVSTACK */
+	OVSTACK_ENCAP_UDP,		/* UDP, dst port OVSTACK_PORT */
+	__OVSTACK_ENCAP_MAX,
+};
+#define OVSTACK_ENCAP_MAX	(__OVSTACK_ENCAP_MAX - 1)
+
+/* how a route uses its next hops */
+enum {
+	OVSTACK_ROUTE_MODE_UNSPEC,	/* route add: keep current mode */
+	OVSTACK_ROUTE_MODE_REPLICATE,	/* send to all next hops */
+	OVSTACK_ROUTE_MODE_ECMP,	/* send to one, selected by ov_hash */
+	__OVSTACK_ROUTE_MODE_MAX,
+};
+#define OVSTACK_ROUTE_MODE_MAX	(__OVSTACK_ROUTE_MODE_MAX - 1)
+
+/* locator flags */
+#define OVSTACK_LOCATOR_F_DOWN	0x01	/* probes are not answered */
+
 
 /*
   notify operations.
@@ -106,6 +183,8 @@ struct ovstack_genl_event {
 		__be32	__loc_addr4[1];
 		__be32	__loc_addr6[4];
 	} remote_ip;
+
+	__u8	flags;		/* OVSTACK_LOCATOR_F_* */
 };
 
 #else
@@ -126,9 +205,74 @@ struct ovstack_genl_event {
 		struct in_addr	remote_ip4;
 		struct in6_addr	remote_ip6;
 	} remote_ip;
+
+	__u8	flags;		/* OVSTACK_LOCATOR_F_* */
 };
 
 #endif
 
 
+/* datapath stats of an app, sum of all cpus */
+struct ovstack_app_stats {
+	__u64	rx_packets;	/* received for the app */
+	__u64	rx_bytes;
+	__u64	tx_packets;	/* sent to next hops, including forwarded */
+	__u64	tx_bytes;
+	__u64	fwd_packets;	/* received, not for own node */
+	__u64	fwd_bytes;
+	__u64	local_packets;	/* delivered to the app callback */
+	__u64	local_bytes;
+	__u64	mcast_replicas;	/* copies made for multiple next hops */
+	__u64	rx_dropped;
+	__u64	tx_dropped;
+};
+
+/*
+ * datapath stats of a locator, sum of all cpus. tx is counted on both
+ * src and dst locators, rx on own locators by outer destination address.
+ */
+struct ovstack_locator_stats {
+	__u64	tx_packets;
+	__u64	tx_bytes;
+	__u64	tx_errors;	/* not queued, or congested on underlay */
+	__u64	rx_packets;
+	__u64	rx_bytes;
+};
+
+/* failed entry of OVSTACK_CMD_BULK. index is the order in the message */
+struct ovstack_bulk_error {
+	__u32	index;
+	__s32	error;		/* -errno */
+};
+
+/*
+ * drop reasons. OVSTACK_DROP_REASONS (FN) is expanded to the enum, and to
+ * the names for logs, tracepoint and ip ov stats drops.
+ */
+#define OVSTACK_DROP_REASONS(FN)					\
+	FN (TRUNCATED,		"truncated")				\
+	FN (UDP_CSUM,		"udp_csum")				\
+	FN (UNKNOWN_APP,	"unknown_app")				\
+	FN (NO_APP_RECV,	"no_app_recv")				\
+	FN (TTL_EXCEEDED,	"ttl_exceeded")				\
+	FN (NO_ROUTE,		"no_route")				\
+	FN (NO_LOCATOR,		"no_locator")				\
+	FN (UNDERLAY_ROUTE,	"underlay_route")			\
+	FN (NOMEM,		"nomem")				\
+	FN (CSUM,		"csum")					\
+	FN (GSO_SEGMENT,	"gso_segment")				\
+	FN (UNKNOWN_VNI,	"unknown_vni")				\
+	FN (LOOP,		"loop")					\
+	FN (INVALID_SESSION,	"invalid_session")			\
+	FN (TOO_BIG,		"too_big")
+
+#define OVSTACK_DROP_ENUM(reason, name)	OVSTACK_DROP_##reason,
+
+enum {
+	OVSTACK_DROP_REASONS (OVSTACK_DROP_ENUM)
+	__OVSTACK_DROP_MAX
+};
+#define OVSTACK_DROP_MAX	__OVSTACK_DROP_MAX
+
+
 #endif /* _LINUX_OVSTACK_NETLINK_ */
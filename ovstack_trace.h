@@ -0,0 +1,243 @@
+/*
+ * Overlay Routing Stack Tracepoints
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ovstack
+
+#if !defined(_OVSTACK_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _OVSTACK_TRACE_H_
+
+#include <linux/skbuff.h>
+#include <linux/tracepoint.h>
+#include <net/ipv6.h>
+
+#include "ovstack.h"
+
+#define OVSTACK_DROP_SYMBOL(reason, name) { OVSTACK_DROP_##reason, name },
+
+TRACE_EVENT (ovstack_drop,
+
+	TP_PROTO (struct sk_buff * skb, struct ovhdr * ovh, int reason,
+		  unsigned long location),
+
+	TP_ARGS (skb, ovh, reason, location),
+
+	TP_STRUCT__entry (
+		__field (void *,	skbaddr)
+		__field (unsigned long,	location)
+		__field (int,		reason)
+		__field (unsigned int,	len)
+		__field (u8,		app)
+		__field (u8,		ttl)
+		__field (u32,		vni)
+		__field (u32,		hash)
+		__field (__be32,	dst)
+		__field (__be32,	src)
+	),
+
+	TP_fast_assign (
+		__entry->skbaddr	= skb;
+		__entry->location	= location;
+		__entry->reason		= reason;
+		__entry->len		= skb->len;
+		__entry->app		= ovh ? ovh->ov_app : 0;
+		__entry->ttl		= ovh ? ovh->ov_ttl : 0;
+		__entry->vni		= ovh ? ovh_vni (ovh) : 0;
+		__entry->hash		= ovh ? ntohl (ovh->ov_hash) : 0;
+		__entry->dst		= ovh ? ovh->ov_dst : 0;
+		__entry->src		= ovh ? ovh->ov_src : 0;
+	),
+
+	TP_printk ("skbaddr=%p location=%pS reason=%s len=%u app=%u ttl=%u "
+		   "vni=%u hash=0x%08x dst=%pI4 src=%pI4",
+		   __entry->skbaddr, (void *) __entry->location,
+		   __print_symbolic (__entry->reason,
+				     OVSTACK_DROP_REASONS (OVSTACK_DROP_SYMBOL)
+				     { -1, NULL }),
+		   __entry->len, __entry->app, __entry->ttl, __entry->vni,
+		   __entry->hash, &__entry->dst, &__entry->src)
+);
+
+/*
+ * hot path events for latency profiling. They carry the overlay header
+ * and skb length, so that each stage can be matched by skbaddr.
+ */
+DECLARE_EVENT_CLASS (ovstack_ovhdr_class,
+
+	TP_PROTO (struct sk_buff * skb, struct ovhdr * ovh),
+
+	TP_ARGS (skb, ovh),
+
+	TP_STRUCT__entry (
+		__field (void *,	skbaddr)
+		__field (unsigned int,	len)
+		__field (u8,		app)
+		__field (u8,		ttl)
+		__field (u32,		vni)
+		__field (__be32,	dst)
+		__field (__be32,	src)
+	),
+
+	TP_fast_assign (
+		__entry->skbaddr	= skb;
+		__entry->len		= skb->len;
+		__entry->app		= ovh->ov_app;
+		__entry->ttl		= ovh->ov_ttl;
+		__entry->vni		= ovh_vni (ovh);
+		__entry->dst		= ovh->ov_dst;
+		__entry->src		= ovh->ov_src;
+	),
+
+	TP_printk ("skbaddr=%p len=%u app=%u ttl=%u vni=%u dst=%pI4 src=%pI4",
+		   __entry->skbaddr, __entry->len, __entry->app, __entry->ttl,
+		   __entry->vni, &__entry->dst, &__entry->src)
+);
+
+/* ovstack_recv () entry, skb->data is ovhdr */
+DEFINE_EVENT (ovstack_ovhdr_class, ovstack_recv,
+	TP_PROTO (struct sk_buff * skb, struct ovhdr * ovh),
+	TP_ARGS (skb, ovh)
+);
+
+/* oveth_xmit () hands an encapsulated copy to ovstack_xmit () */
+DEFINE_EVENT (ovstack_ovhdr_class, oveth_xmit,
+	TP_PROTO (struct sk_buff * skb, struct ovhdr * ovh),
+	TP_ARGS (skb, ovh)
+);
+
+/* oveth_encap_recv () entry, called by ovstack for OVAPP_ETHERNET */
+DEFINE_EVENT (ovstack_ovhdr_class, oveth_encap_recv,
+	TP_PROTO (struct sk_buff * skb, struct ovhdr * ovh),
+	TP_ARGS (skb, ovh)
+);
+
+/* ovstack_recv () hands a packet to the app, or forwards it */
+TRACE_EVENT (ovstack_recv_dispatch,
+
+	TP_PROTO (struct sk_buff * skb, struct ovhdr * ovh, bool forward),
+
+	TP_ARGS (skb, ovh, forward),
+
+	TP_STRUCT__entry (
+		__field (void *,	skbaddr)
+		__field (unsigned int,	len)
+		__field (u8,		app)
+		__field (u32,		vni)
+		__field (__be32,	dst)
+		__field (__be32,	src)
+		__field (bool,		forward)
+	),
+
+	TP_fast_assign (
+		__entry->skbaddr	= skb;
+		__entry->len		= skb->len;
+		__entry->app		= ovh->ov_app;
+		__entry->vni		= ovh_vni (ovh);
+		__entry->dst		= ovh->ov_dst;
+		__entry->src		= ovh->ov_src;
+		__entry->forward	= forward;
+	),
+
+	TP_printk ("skbaddr=%p len=%u app=%u vni=%u dst=%pI4 src=%pI4 %s",
+		   __entry->skbaddr, __entry->len, __entry->app,
+		   __entry->vni, &__entry->dst, &__entry->src,
+		   __entry->forward ? "forward" : "local")
+);
+
+/* route lookup result of ovstack_xmit (). nxt_count 0 is no route */
+TRACE_EVENT (ovstack_xmit_route,
+
+	TP_PROTO (struct sk_buff * skb, struct ovhdr * ovh,
+		  unsigned int nxt_count),
+
+	TP_ARGS (skb, ovh, nxt_count),
+
+	TP_STRUCT__entry (
+		__field (void *,	skbaddr)
+		__field (unsigned int,	len)
+		__field (u8,		app)
+		__field (u32,		vni)
+		__field (__be32,	dst)
+		__field (__be32,	src)
+		__field (unsigned int,	nxt_count)
+	),
+
+	TP_fast_assign (
+		__entry->skbaddr	= skb;
+		__entry->len		= skb->len;
+		__entry->app		= ovh->ov_app;
+		__entry->vni		= ovh_vni (ovh);
+		__entry->dst		= ovh->ov_dst;
+		__entry->src		= ovh->ov_src;
+		__entry->nxt_count	= nxt_count;
+	),
+
+	TP_printk ("skbaddr=%p len=%u app=%u vni=%u dst=%pI4 src=%pI4 "
+		   "nexthops=%u",
+		   __entry->skbaddr, __entry->len, __entry->app,
+		   __entry->vni, &__entry->dst, &__entry->src,
+		   __entry->nxt_count)
+);
+
+/*
+ * locators chosen by ovstack_xmit_node (). IPv4 locators are recorded
+ * as v4 mapped addresses, so that both families are printed by %pI6c.
+ */
+#define OVSTACK_TRACE_LOC_ADDR(addr, family, loc)			\
+	do {								\
+		if ((family) == AF_INET)				\
+			ipv6_addr_set_v4mapped (*(loc),			\
+						(struct in6_addr *) (addr)); \
+		else							\
+			memcpy ((addr), (loc), sizeof (struct in6_addr)); \
+	} while (0)
+
+TRACE_EVENT (ovstack_xmit_node,
+
+	TP_PROTO (struct sk_buff * skb, struct ovhdr * ovh, __be32 nxt,
+		  u8 family, __be32 * src_loc, __be32 * dst_loc, int encap),
+
+	TP_ARGS (skb, ovh, nxt, family, src_loc, dst_loc, encap),
+
+	TP_STRUCT__entry (
+		__field (void *,	skbaddr)
+		__field (unsigned int,	len)
+		__field (u8,		app)
+		__field (u32,		vni)
+		__field (__be32,	dst)
+		__field (__be32,	nxt)
+		__array (u8,		saddr, sizeof (struct in6_addr))
+		__array (u8,		daddr, sizeof (struct in6_addr))
+		__field (int,		encap)
+	),
+
+	TP_fast_assign (
+		__entry->skbaddr	= skb;
+		__entry->len		= skb->len;
+		__entry->app		= ovh->ov_app;
+		__entry->vni		= ovh_vni (ovh);
+		__entry->dst		= ovh->ov_dst;
+		__entry->nxt		= nxt;
+		__entry->encap		= encap;
+		OVSTACK_TRACE_LOC_ADDR (__entry->saddr, family, src_loc);
+		OVSTACK_TRACE_LOC_ADDR (__entry->daddr, family, dst_loc);
+	),
+
+	TP_printk ("skbaddr=%p len=%u app=%u vni=%u dst=%pI4 nexthop=%pI4 "
+		   "saddr=%pI6c daddr=%pI6c encap=%s",
+		   __entry->skbaddr, __entry->len, __entry->app,
+		   __entry->vni, &__entry->dst, &__entry->nxt,
+		   __entry->saddr, __entry->daddr,
+		   __entry->encap == OVSTACK_ENCAP_UDP ? "udp" : "raw")
+);
+
+#endif /* _OVSTACK_TRACE_H_ */
+
+/* out of tree, so that define_trace.h finds this file in the module dir */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ovstack_trace
+
+#include <trace/define_trace.h>
@@ -2,10 +2,6 @@
  * Session Routing in Overlay Network.
  */
 
-#ifndef DEBUG
-#define DEBUG
-#endif
-
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/hashtable.h>
@@ -350,8 +346,8 @@ ovstack_srovgw_recv (struct sk_buff * skb)
 	/* find session, and rebuild original packet  */
 	ss = srov_session_find_by_id (&sgnet->session_table, id);
 	if (!ss) {
-		pr_debug ("srovgw:%s: invalid session id %u", __func__, id);
-		return -ENOENT;
+		ovstack_drop (skb, ovh, OVSTACK_DROP_INVALID_SESSION);
+		return 0;
 	}
 
 	__skb_pull (skb, sizeof (struct ovhdr));